@@ -0,0 +1,150 @@
+`timescale 1ns / 1ps
+
+//*****************************************************************************
+//
+// Multiplexed I/O (mux mode) for autonomous switching of FPGAs
+// by the USB controller's firmware.
+//
+// In mux mode, every FPGA receives data written to EP6 (as in listen mode)
+// and the firmware selects FPGAs in turn, registering output limit.
+// Data goes in frames, each frame starts with a tag (16-bit words):
+//
+// Host -> FPGA:
+//		word 0: { MUX_TAG, FPGA number }
+//		word 1: data length in words
+// Only frames tagged with FPGA's own number go into input FIFO.
+//
+// FPGA -> host (on output limit registration):
+//		word 0: { MUX_TAG, error flag, FPGA number }
+//		word 1: data length in words (registered output limit)
+//		word 2: free space in input FIFO, words
+//		word 3: words received into input FIFO since mux mode was enabled
+//				(modulo 2**16), so the host knows free space at the moment
+//				the tag was generated
+//
+// Listening FPGAs don't apply backpressure: the host writes no more
+// than FPGA has free space.
+//
+//*****************************************************************************
+
+module hs_io_mux(
+	input CLK,
+	input [2:0] FPGA_ID,
+	input mux_mode,
+	input error, // application reports an error
+
+	// from hs_io to input FIFO
+	input [15:0] din,
+	input wr_en_in,
+	output wr_en,
+	input full,
+	input [15:0] input_free,
+	output reg mux_err = 0, // bad tag or input FIFO overflow
+
+	// from output FIFO to hs_io
+	input [15:0] output_din,
+	output output_rd_en,
+	input output_empty,
+	input reg_output_limit,
+	input [15:0] output_limit,
+
+	output [15:0] dout,
+	input rd_en,
+	output empty
+	);
+
+	localparam [7:0] MUX_TAG = 8'hA5;
+
+
+	// *************************
+	//
+	// Input
+	//
+	// *************************
+	localparam RX_TAG0 = 0,
+				RX_TAG1 = 1,
+				RX_DATA = 2;
+
+	reg [1:0] rx_state = RX_TAG0;
+	reg rx_own = 0;
+	reg [15:0] rx_count = 0;
+	reg [15:0] received = 0;
+
+	assign wr_en = mux_mode ? wr_en_in & rx_state == RX_DATA & rx_own : wr_en_in;
+
+	always @(posedge CLK) begin
+		if (~mux_mode) begin
+			rx_state <= RX_TAG0;
+			received <= 0;
+		end
+
+		else if (wr_en_in) begin
+			case (rx_state)
+			RX_TAG0: begin
+				rx_own <= din[2:0] == FPGA_ID;
+				if (din[15:8] == MUX_TAG)
+					rx_state <= RX_TAG1;
+				else
+					mux_err <= 1;
+			end
+
+			RX_TAG1: begin
+				rx_count <= din;
+				if (din)
+					rx_state <= RX_DATA;
+				else
+					rx_state <= RX_TAG0;
+			end
+
+			RX_DATA: begin
+				if (rx_own)
+					received <= received + 1'b1;
+				rx_count <= rx_count - 1'b1;
+				if (rx_count == 1)
+					rx_state <= RX_TAG0;
+			end
+			endcase
+		end
+
+		if (wr_en & full)
+			mux_err <= 1;
+	end
+
+
+	// *************************
+	//
+	// Output
+	//
+	// *************************
+
+	// Output limit is known the cycle after registration.
+	// Output FIFO has data no earlier than 3 cycles after registration,
+	// so the tag goes first.
+	reg reg_output_limit_r = 0;
+	reg [2:0] tx_state = 0; // 0: data, 1..4: tag words
+	reg [15:0] tx_len = 0, tx_free = 0, tx_received = 0;
+
+	always @(posedge CLK) begin
+		reg_output_limit_r <= reg_output_limit;
+
+		if (mux_mode & reg_output_limit_r) begin
+			tx_len <= output_limit;
+			tx_free <= input_free;
+			tx_received <= received;
+			tx_state <= 1;
+		end
+		else if (tx_state != 0 & rd_en)
+			tx_state <= tx_state == 4 ? 3'd0 : tx_state + 1'b1;
+	end
+
+	assign dout =
+		tx_state == 1 ? { MUX_TAG, error | mux_err, 4'b0, FPGA_ID } :
+		tx_state == 2 ? tx_len :
+		tx_state == 3 ? tx_free :
+		tx_state == 4 ? tx_received :
+		output_din;
+
+	assign empty = tx_state == 0 & output_empty;
+	assign output_rd_en = rd_en & tx_state == 0;
+
+endmodule
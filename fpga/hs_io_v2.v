@@ -21,6 +21,26 @@
 // 3. One cycle delay when switching control outputs into Z-state on CS deassertion
 //		so controls for Slave FIFO (active low) always in a defined state.
 //
+// Listen mode (broadcast write):
+//
+// FPGA that isn't selected receives data the selected FPGA reads from
+// Slave FIFO (SLRD is sampled from the shared pin). It doesn't apply
+// backpressure: the host writes no more than every listening FPGA
+// has free space in its input FIFO.
+// chip_select.v isn't changed: data pins are inputs on every FPGA anyway,
+// and deselected FPGA already has SLRD in Z-state (out_z_wait1).
+// What listener needs is the read strobe, and SLRD is handled here.
+//
+// With NO_PKTEND (mux mode), output isn't committed with PKTEND:
+// output of FPGAs selected in turn goes in full-size USB packets.
+//
+// Stream mode: output limit is off, output goes into Slave FIFO
+// as it comes. With STREAM_END asserted, after the output FIFO
+// is drained and all output is committed, zero-length packet
+// is committed (PKTEND with no data) and zlp_sent is asserted.
+// The host takes ZLP as the end of the selected FPGA's output.
+// zlp_sent is deasserted with STREAM_END.
+//
 //*****************************************************************************
 
 module hs_io_v2 #(
@@ -37,6 +57,12 @@ module hs_io_v2 #(
 	// Deasserted EN doesn't perform read/write,
 	// keeps signals for Slave FIFO in proper state.
 	input EN,
+	// receive data when not selected
+	input LISTEN,
+	// don't commit partially filled USB packets
+	input NO_PKTEND,
+	// stream mode: end the output with zero-length packet
+	input STREAM_END,
 
 	// Attention: attempt to send data to FPGA not aligned to
 	// 2-byte word would result in a junk in upper byte
@@ -45,7 +71,7 @@ module hs_io_v2 #(
 	output FIFOADR1,
 	// Following signals are active low.
 	output SLOE, // Slave output enable
-	output SLRD,
+	inout SLRD,
 	output SLWR,
 	output PKTEND,
 	// FLAGA/B/C are fixed (independent from FIFOADR)
@@ -68,7 +94,8 @@ module hs_io_v2 #(
 	output [7:0] io_timeout, // in ~1us intervals @30MHz IFCLK
 	output reg io_fsm_error = 0, // CS or EN deasserted while active I/O
 	output reg sfifo_not_empty = 0,
-	output reg io_err_write = 0
+	output reg io_err_write = 0,
+	output reg zlp_sent = 0
 	);
 
 	reg rw_direction = 0; // 1: FPGA writes
@@ -119,7 +146,14 @@ module hs_io_v2 #(
 	reg input_r_ok = 0;
 	always @(posedge IFCLK)
 		input_r_ok <= ~SLRD_R;
-	assign wr_en = input_r_ok & FLAGC_R;
+
+	// Listen mode: read was performed by other FPGA
+	(* IOB="true" *) reg SLRD_IN_R = 1;
+	always @(posedge IFCLK)
+		SLRD_IN_R <= SLRD;
+	wire listen_r_ok = LISTEN & ~CS & ~SLRD_IN_R;
+
+	assign wr_en = (input_r_ok | listen_r_ok) & FLAGC_R;
 
 	
 	// *************************
@@ -188,6 +222,8 @@ module hs_io_v2 #(
 	localparam IO_STATE_DISABLED = 13;
 	localparam IO_STATE_WR_WAIT = 14;
 	localparam IO_STATE_PKT_COMMIT = 15;
+	localparam IO_STATE_ZLP_SETUP1 = 16;
+	localparam IO_STATE_ZLP_SETUP2 = 17;
 	
 	(* FSM_EXTRACT="YES" *)
 	reg [4:0] io_state = IO_STATE_DISABLED;
@@ -198,6 +234,9 @@ module hs_io_v2 #(
 					& io_state != IO_STATE_READ & io_state != IO_STATE_WR)
 			timeout <= timeout + 1'b1;
 
+		if (~STREAM_END)
+			zlp_sent <= 0;
+
 		// Disabled: EN is off, outputs in proper state
 		if (io_state == IO_STATE_DISABLED) begin
 			if (CS & EN)
@@ -251,8 +290,13 @@ module hs_io_v2 #(
 		end
 
 		IO_STATE_WR_SETUP0: begin
+			// Output is committed (not in WR_WAIT), nothing left to send
+			if (STREAM_END & ~zlp_sent & empty & ~output_r_valid & ~FLAGA_R) begin
+				rw_direction <= 1;
+				io_state <= IO_STATE_ZLP_SETUP1;
+			end
 			//if (empty | ~FLAGB_R)
-			if ((empty & ~output_r_valid) | FLAGA_R)
+			else if ((empty & ~output_r_valid) | FLAGA_R)
 				io_state <= IO_STATE_READ_SETUP0;
 			// go on transmit
 			else begin
@@ -302,8 +346,14 @@ module hs_io_v2 #(
 			wr_timeout <= wr_timeout + 1'b1;
 			
 			if (wr_timeout == PKTEND_WR_TIMEOUT) begin
-				PKTEND_R <= 0;
-				io_state <= IO_STATE_PKT_COMMIT;
+				if (NO_PKTEND) begin
+					rw_direction <= 0;
+					io_state <= IO_STATE_READ_SETUP0;
+				end
+				else begin
+					PKTEND_R <= 0;
+					io_state <= IO_STATE_PKT_COMMIT;
+				end
 			end
 			else if (!empty)
 				io_state <= IO_STATE_WR_SETUP1;
@@ -314,6 +364,17 @@ module hs_io_v2 #(
 			rw_direction <= 0;
 			io_state <= IO_STATE_READ_SETUP0;
 		end
+
+		// Zero-length packet: FIFOADR setup same as for write
+		IO_STATE_ZLP_SETUP1: begin
+			io_state <= IO_STATE_ZLP_SETUP2;
+		end
+
+		IO_STATE_ZLP_SETUP2: begin
+			PKTEND_R <= 0;
+			zlp_sent <= 1;
+			io_state <= IO_STATE_PKT_COMMIT;
+		end
 		
 		endcase
 		// CS & EN
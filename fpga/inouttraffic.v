@@ -34,7 +34,7 @@ module inouttraffic(
 	output FIFOADR0,
 	output FIFOADR1,
 	output SLOE, 
-	output SLRD,
+	inout SLRD, // sampled in listen mode
 	output SLWR,
 	output PKTEND,
 	input FLAGA,
@@ -73,14 +73,16 @@ module inouttraffic(
 	// ********************************************************
 	wire [15:0] hs_input_din;
 	wire [7:0] hs_input_dout;
+	wire [15:0] hs_input_free;
 	
 	input_fifo input_fifo(
 		.wr_clk(IFCLK),
 		.din( {hs_input_din[7:0],hs_input_din[15:8]} ), // to Cypress IO
 		.wr_en(hs_input_wr_en), // to Cypress IO
-		.full(), // to Cypress IO
+		.full(hs_input_full),
 		.almost_full(hs_input_almost_full), // to Cypress IO
 		.prog_full(hs_input_prog_full),
+		.free(hs_input_free),
 
 		.rd_clk(PKT_COMM_CLK),
 		.dout(hs_input_dout),
@@ -128,7 +130,9 @@ module inouttraffic(
 	//
 	// ********************************************************
 	wire [15:0] output_limit;
+	wire [15:0] output_avail;
 	wire [15:0] output_dout; // output via High-Speed Interface
+	wire [15:0] output_fifo_dout;
 
 	output_fifo output_fifo(
 		.wr_clk(PKT_COMM_CLK),
@@ -137,35 +141,62 @@ module inouttraffic(
 		.full(app_full),
 
 		.rd_clk(IFCLK),
-		.dout(output_dout), // to Cypress IO,
-		.rd_en(output_rd_en), // to Cypress IO,
-		.empty(output_empty), // to Cypress IO
+		.dout(output_fifo_dout),
+		.rd_en(output_fifo_rd_en),
+		.empty(output_fifo_empty),
 		.mode_limit(output_mode_limit),
 		.reg_output_limit(reg_output_limit),
 		.output_limit(output_limit),
-		.output_limit_not_done(output_limit_not_done)
+		.output_limit_not_done(output_limit_not_done),
+		.output_avail(output_avail)
 	);
 
 
+	// ********************************************************
+	//
+	// Multiplexed I/O (mux mode): tagged frames
+	//
+	// ********************************************************
+	wire hs_listen, hs_mux_mode;
+
+	hs_io_mux hs_io_mux(
+		.CLK(IFCLK), .FPGA_ID(FPGA_ID), .mux_mode(hs_mux_mode),
+		.error(| {app_status, pkt_comm_status}),
+		// from Cypress IO to input buffer
+		.din(hs_input_din), .wr_en_in(hs_io_wr_en), .wr_en(hs_input_wr_en),
+		.full(hs_input_full), .input_free(hs_input_free), .mux_err(hs_mux_err),
+		// from output buffer to Cypress IO
+		.output_din(output_fifo_dout), .output_rd_en(output_fifo_rd_en),
+		.output_empty(output_fifo_empty),
+		.reg_output_limit(reg_output_limit), .output_limit(output_limit),
+		.dout(output_dout), .rd_en(output_rd_en), .empty(output_empty)
+	);
+
+
 	// ********************************************************
 	//
 	// High-Speed I/O Interface (Slave FIFO)
 	//
 	// ********************************************************
 	wire [7:0] hs_io_timeout;
+	// stream mode: end of the selected FPGA's output (ZLP)
+	wire hs_stream_end, hs_zlp_sent;
 	
 	hs_io_v2 #(
 		.USB_ENDPOINT_IN(2),
 		.USB_ENDPOINT_OUT(6)
 	) hs_io_inst(
 		.IFCLK(IFCLK), .CS(CS), .out_z_wait1(out_z_wait1), .EN(hs_en),
+		.LISTEN(hs_listen | hs_mux_mode), .NO_PKTEND(hs_mux_mode),
+		.STREAM_END(hs_stream_end),
 		.FIFO_DATA(FIFO_DATA), .FIFOADR0(FIFOADR0), .FIFOADR1(FIFOADR1),
 		.SLOE(SLOE), .SLRD(SLRD), .SLWR(SLWR), .PKTEND(PKTEND), .FLAGA(FLAGA), .FLAGB(FLAGB), .FLAGC(FLAGC),
 		// data output from Cypress IO, received by FPGA
-		.dout(hs_input_din),	.wr_en(hs_input_wr_en), .almost_full(hs_input_almost_full),
+		.dout(hs_input_din),	.wr_en(hs_io_wr_en), .almost_full(hs_input_almost_full),
 		.din(output_dout), .rd_en(output_rd_en), .empty(output_empty), // to Cypress IO, out of FPGA
 		.io_timeout(hs_io_timeout), .sfifo_not_empty(sfifo_not_empty),
-		.io_fsm_error(io_fsm_error), .io_err_write(io_err_write)
+		.io_fsm_error(io_fsm_error), .io_err_write(io_err_write),
+		.zlp_sent(hs_zlp_sent)
 	);
 
 
@@ -181,12 +212,16 @@ module inouttraffic(
 		// various inputs to be read by CPU
 		.FPGA_ID(FPGA_ID),
 		.hs_io_timeout(hs_io_timeout), .hs_input_prog_full(hs_input_prog_full),
-		.sfifo_not_empty(sfifo_not_empty), .io_fsm_error(io_fsm_error), .io_err_write(io_err_write),
+		.hs_input_free(hs_input_free),
+		.sfifo_not_empty(sfifo_not_empty), .io_fsm_error(io_fsm_error),
+		.io_err_write(io_err_write | hs_mux_err),
 		.output_limit(output_limit), .output_limit_not_done(output_limit_not_done),
+		.output_avail(output_avail), .zlp_sent(hs_zlp_sent),
 		.app_status(app_status),
 		.pkt_comm_status(pkt_comm_status), .debug2(debug2), .debug3(debug3),
 		// various control wires
-		.hs_en(hs_en),
+		.hs_en(hs_en), .hs_listen(hs_listen), .mux_mode(hs_mux_mode),
+		.stream_end(hs_stream_end),
 		.output_mode_limit(output_mode_limit),
 		.reg_output_limit(reg_output_limit),
 		.app_mode(app_mode)
@@ -8,6 +8,7 @@ module input_fifo(
 	output full,
 	output almost_full,
 	output prog_full,
+	output [15:0] free, // free space in 16-bit words
 	
 	input rd_clk,
 	input rd_en,
@@ -21,8 +22,10 @@ module input_fifo(
 	// * write: width 16, depth 16384 (32 Kbytes), read width 8
 	// * Almost Full Flag
 	// * Single Programmable Full Threshold Constant: Assert Value 8192
+	// * Write Data Count, width 14
 	// * Reset: off
 	wire [7:0] din_stage2;
+	wire [13:0] wr_data_count;
 	
 	fifo_16in_8out fifo_16in_8out(
 		.wr_clk(wr_clk),
@@ -31,6 +34,7 @@ module input_fifo(
 		.full(full),
 		.almost_full(almost_full),
 		.prog_full(prog_full),
+		.wr_data_count(wr_data_count),
 		
 		.rd_clk(wr_clk),
 		//.dout(dout),
@@ -43,6 +47,11 @@ module input_fifo(
 
 	assign tx_stage2 = ~empty_stage2 & ~full_stage2;
 
+	// Write Data Count is never less than actual number of words in FIFO,
+	// so free space is never overstated. Actual FIFO depth is 16383 words.
+	// Data in the 2nd stage FIFO is not counted.
+	assign free = { 2'b00, 14'h3FFF - wr_data_count };
+
 	//
 	// fifo_16in_8out is large in size and its memory blocks are scattered over large area.
 	// That's unable to operate at high frequency such as 200 MHz because of routing delay.
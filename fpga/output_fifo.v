@@ -19,7 +19,8 @@ module output_fifo (
 	input mode_limit,
 	input reg_output_limit,
 	output [15:0] output_limit,
-	output output_limit_not_done
+	output output_limit_not_done,
+	output [15:0] output_avail
 	);
 
 	//
@@ -67,7 +68,8 @@ module output_fifo (
 		.mode_limit(mode_limit),
 		.reg_output_limit(reg_output_limit),
 		.output_limit(output_limit),
-		.output_limit_not_done(output_limit_not_done)
+		.output_limit_not_done(output_limit_not_done),
+		.output_avail(output_avail)
 	);
 
 endmodule
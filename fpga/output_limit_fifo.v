@@ -16,6 +16,8 @@
 //   - Starts output of that amount, asserts output_limit_not_done
 //   - Deasserts output_limit_not_done when finished
 //
+// * Reports amount written and not registered yet (output_avail)
+//
 // * Does not require extra components from IP Coregen
 //
 // * The design is unable for asynchronous operation
@@ -45,7 +47,8 @@ module output_limit_fifo #(
 	input mode_limit, // turn on output limit
 	input reg_output_limit,
 	output [15:0] output_limit,
-	output reg output_limit_not_done
+	output reg output_limit_not_done,
+	output [15:0] output_avail
 	);
 
 	reg [ADDR_MSB:0] addra = 0;
@@ -58,6 +61,9 @@ module output_limit_fifo #(
 	assign empty = rst || ~wft;
 
 	assign output_limit = { {15-ADDR_MSB{1'b0}}, output_limit_r };
+
+	wire [ADDR_MSB:0] output_avail_w = addra - output_limit_addr;
+	assign output_avail = { {15-ADDR_MSB{1'b0}}, output_avail_w };
 	
 	assign full = rst || (addra + 1'b1 == addrb);	
 	wire ena = wr_en && !full;
@@ -43,10 +43,13 @@ module vcr_v2(
 	input [2:0] FPGA_ID,
 	input [7:0] hs_io_timeout,
 	input hs_input_prog_full,
+	input [15:0] hs_input_free,
 	input sfifo_not_empty,
 	input io_fsm_error, io_err_write,
 	input [15:0] output_limit,
 	input output_limit_not_done,
+	input [15:0] output_avail,
+	input zlp_sent,
 	input [7:0] app_status,
 	input [7:0] pkt_comm_status, debug2, debug3,
 	
@@ -54,6 +57,9 @@ module vcr_v2(
 	// Defaults for various controls
 	//
 	output reg hs_en = 0, // high-speed i/o
+	output reg hs_listen = 0, // receive broadcast write when not selected
+	output reg mux_mode = 0, // multiplexed I/O (hs_io_mux)
+	output reg stream_end = 0, // stream mode: end output with ZLP
 	output reg output_mode_limit = 1, // output_limit 
 	output reg reg_output_limit = 0,
 	output reg [7:0] app_mode = 0 // default mode: 0
@@ -94,6 +100,25 @@ module vcr_v2(
 	localparam VCR_RESET = 8'h8B;
 	localparam VCR_GET_ID_DATA = 8'h90;
 	localparam VCR_GET_IO_TIMEOUT = 8'h91;
+	// free space in input FIFO (in 16-bit words), latched on address select
+	localparam VCR_GET_INPUT_FREE = 8'h92;
+	// listen mode: receive data written to the selected FPGA
+	localparam VCR_SET_HS_LISTEN_ENABLE = 8'h93;
+	localparam VCR_SET_HS_LISTEN_DISABLE = 8'h94;
+	// mux mode: tagged frames, FPGAs are switched by the firmware
+	localparam VCR_SET_MUX_ENABLE = 8'h95;
+	localparam VCR_SET_MUX_DISABLE = 8'h96;
+	// output not registered yet (in output_limit_fifo words),
+	// latched on address select
+	localparam VCR_GET_OUTPUT_AVAIL = 8'h97;
+	// capabilities of the bitstream, bit 0: mux mode is supported,
+	// bit 1: stream mode (VCR 0x99, 0x9A) is supported
+	localparam VCR_GET_CAPS = 8'h98;
+	// stream mode: end the output with zero-length packet;
+	// cleared by VCR_SET_HS_IO_ENABLE
+	localparam VCR_SET_STREAM_END = 8'h99;
+	// bit 0: zero-length packet was sent
+	localparam VCR_GET_STREAM_STATUS = 8'h9A;
 	//localparam VCR_ = 8'h;
 
 
@@ -105,6 +130,8 @@ module vcr_v2(
 	localparam [15:0] BITSTREAM_TYPE = 1;
 	reg [7:0] echo_content [3:0];
 	reg RESET_R = 0;
+	reg [15:0] input_free_r = 0;
+	reg [15:0] output_avail_r = 0;
 	
 
 	reg [7:0] addr = 0;
@@ -137,6 +164,9 @@ module vcr_v2(
 		end
 		
 		STATE_SET_ADDR: begin
+			input_free_r <= hs_input_free;
+			output_avail_r <= output_avail;
+
 			// Addresses for write
 			if (addr == VCR_ECHO_REQUEST
 					|| addr == VCR_SET_APP_MODE)
@@ -146,18 +176,42 @@ module vcr_v2(
 			else if (addr == VCR_GET_IO_STATUS
 					|| addr == VCR_GET_ID_DATA
 					|| addr == VCR_GET_FPGA_ID
-					|| addr == VCR_GET_IO_TIMEOUT)
+					|| addr == VCR_GET_IO_TIMEOUT
+					|| addr == VCR_GET_INPUT_FREE
+					|| addr == VCR_GET_OUTPUT_AVAIL
+					|| addr == VCR_GET_STREAM_STATUS)
 				state <= STATE_RD;
 				
 			// For addresses below, no need to read or write, just select address.
 			else if (addr == VCR_SET_HS_IO_ENABLE) begin
 				hs_en <= 1;
+				stream_end <= 0;
 				state <= STATE_WAIT;	
 			end
 			else if (addr == VCR_SET_HS_IO_DISABLE) begin
 				hs_en <= 0;
 				state <= STATE_WAIT;	
 			end
+			else if (addr == VCR_SET_HS_LISTEN_ENABLE) begin
+				hs_listen <= 1;
+				state <= STATE_WAIT;
+			end
+			else if (addr == VCR_SET_HS_LISTEN_DISABLE) begin
+				hs_listen <= 0;
+				state <= STATE_WAIT;
+			end
+			else if (addr == VCR_SET_MUX_ENABLE) begin
+				mux_mode <= 1;
+				state <= STATE_WAIT;
+			end
+			else if (addr == VCR_SET_MUX_DISABLE) begin
+				mux_mode <= 0;
+				state <= STATE_WAIT;
+			end
+			else if (addr == VCR_SET_STREAM_END) begin
+				stream_end <= 1;
+				state <= STATE_WAIT;
+			end
 			else if (addr == VCR_SET_OUTPUT_LIMIT_ENABLE) begin
 				output_mode_limit <= 1;
 				state <= STATE_WAIT;	
@@ -197,9 +251,12 @@ module vcr_v2(
 			count <= count + 1'b1;
 			if (addr == VCR_GET_FPGA_ID
 					|| addr == VCR_GET_IO_TIMEOUT
+					|| addr == VCR_GET_STREAM_STATUS
 					|| count == 1 && addr == VCR_REG_OUTPUT_LIMIT
 					|| count == 1 && addr == VCR_GET_ID_DATA
 					|| count == 3 && addr == VCR_ECHO_REQUEST
+					|| count == 1 && addr == VCR_GET_INPUT_FREE
+					|| count == 1 && addr == VCR_GET_OUTPUT_AVAIL
 					|| count == 5 && addr == VCR_GET_IO_STATUS)
 				state <= STATE_WAIT;
 		end
@@ -217,8 +274,10 @@ module vcr_v2(
 		(addr == VCR_REG_OUTPUT_LIMIT && count == 0) ? output_limit[7:0] :
 		(addr == VCR_REG_OUTPUT_LIMIT && count == 1) ? output_limit[15:8] :
 		
+		// bit 6: VCR_GET_INPUT_FREE is supported
+		// bit 7: listen mode is supported
 		(addr == VCR_GET_IO_STATUS && count == 0) ? {
-			{2{1'b0}}, io_err_write, io_fsm_error,
+			1'b1, 1'b1, io_err_write, io_fsm_error,
 			sfifo_not_empty, 1'b0, output_limit_not_done, hs_input_prog_full
 		} :
 		(addr == VCR_GET_IO_STATUS && count == 1) ? hs_io_timeout :
@@ -235,6 +294,16 @@ module vcr_v2(
 		(addr == VCR_GET_FPGA_ID) ? { {5{1'b0}}, FPGA_ID } :
 
 		(addr == VCR_GET_IO_TIMEOUT) ? hs_io_timeout :
+
+		(addr == VCR_GET_INPUT_FREE && count == 0) ? input_free_r[7:0] :
+		(addr == VCR_GET_INPUT_FREE && count == 1) ? input_free_r[15:8] :
+
+		(addr == VCR_GET_OUTPUT_AVAIL && count == 0) ? output_avail_r[7:0] :
+		(addr == VCR_GET_OUTPUT_AVAIL && count == 1) ? output_avail_r[15:8] :
+
+		(addr == VCR_GET_STREAM_STATUS) ? { 7'b0, zlp_sent } :
+
+		(addr == VCR_GET_CAPS) ? 8'h03 :
 		8'b0;
 
 	assign vcr_dir = state == STATE_RD;
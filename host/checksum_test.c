@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "pkt_comm/pkt_comm.h"
+#include "pkt_comm/pkt_checksum.h"
+
+// Checks that pkt_checksum() and pkt_checksum_copy() implementations
+// give identical results, measures their throughput.
+//
+// Usage: checksum_test [MB_per_run]
+
+#define BUF_SIZE	(1024 * 1024 + 64)
+
+int sizes[] = { 10, 24, 256, 4096, 32766, 1024 * 1024, 0 };
+
+double time_sec(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	int mb_per_run = argc > 1 ? atoi(argv[1]) : 256;
+	if (mb_per_run <= 0) {
+		printf("Usage: %s [MB_per_run]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	unsigned char *buf = malloc(BUF_SIZE);
+	unsigned char *dst = malloc(BUF_SIZE);
+	if (!buf || !dst) {
+		fprintf(stderr, "malloc(%d) failed\n", BUF_SIZE);
+		exit(EXIT_FAILURE);
+	}
+	int i;
+	srandom(1);
+	for (i = 0; i < BUF_SIZE; i++)
+		buf[i] = random();
+
+	// Correctness: all lengths 0..300 and all alignments,
+	// then some large lengths
+	struct pkt_checksum_impl *impl, *ref = &pkt_checksum_impls[0];
+	int errors = 0;
+	for (impl = pkt_checksum_impls + 1; impl->name; impl++) {
+		if (!impl->supported())
+			continue;
+		int offset, len;
+		for (offset = 0; offset < 32; offset++)
+			for (len = 0; len <= 300; len++) {
+				if (impl->sum(buf + offset, len) != ref->sum(buf + offset, len))
+					errors++;
+				memset(dst, 0, len + 64);
+				if (impl->copy_sum(dst + 7, buf + offset, len) != ref->sum(buf + offset, len)
+						|| memcmp(dst + 7, buf + offset, len) || dst[7 + len])
+					errors++;
+			}
+		for (len = BUF_SIZE - 64 - 35; len <= BUF_SIZE - 64; len++)
+			if (impl->sum(buf + 3, len) != ref->sum(buf + 3, len))
+				errors++;
+		if (errors) {
+			printf("%s: results differ from %s (%d errors)\n",
+					impl->name, ref->name, errors);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	printf("pkt_checksum() uses %s\n", pkt_checksum_get_impl()->name);
+
+	// Throughput: checksum; copy with checksum vs. memcpy() + checksum
+	int *size;
+	for (size = sizes; *size; size++) {
+		printf("%8d bytes:", *size);
+		for (impl = pkt_checksum_impls; impl->name; impl++) {
+			if (!impl->supported())
+				continue;
+
+			long long count = (long long)mb_per_run * 1048576 / *size;
+			if (!count)
+				count = 1;
+			PKT_CHECKSUM_TYPE sum = 0;
+			double t0 = time_sec();
+			long long j;
+			for (j = 0; j < count; j++)
+				sum += impl->sum(buf + (j & 7), *size);
+			double sec = time_sec() - t0;
+			if (sum == 0x12345678)	// keep the result in use
+				printf(" ");
+			printf("  %s %.2f GB/s", impl->name, count * *size / sec / 1e9);
+		}
+		printf("\n");
+	}
+
+	for (size = sizes; *size; size++) {
+		printf("%8d bytes copy:", *size);
+		for (impl = pkt_checksum_impls; impl->name; impl++) {
+			if (!impl->supported())
+				continue;
+
+			long long count = (long long)mb_per_run * 1048576 / *size;
+			if (!count)
+				count = 1;
+			PKT_CHECKSUM_TYPE sum = 0;
+			long long j;
+			double t0 = time_sec();
+			for (j = 0; j < count; j++) {
+				memcpy(dst, buf + (j & 7), *size);
+				sum += impl->sum(dst, *size);
+			}
+			double t1 = time_sec();
+			for (j = 0; j < count; j++)
+				sum += impl->copy_sum(dst, buf + (j & 7), *size);
+			double t2 = time_sec();
+			if (sum == 0x12345678)
+				printf(" ");
+			printf("  %s %.2f/%.2f GB/s", impl->name,
+					count * *size / (t1 - t0) / 1e9, count * *size / (t2 - t1) / 1e9);
+		}
+		printf("\n");
+	}
+	printf("(copy: memcpy() + checksum / single pass)\n");
+
+	free(dst);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <libusb-1.0/libusb.h>
+
+#include "ztex.h"
+#include "inouttraffic.h"
+#include "pkt_comm/pkt_comm.h"
+#include "pkt_comm/word_list.h"
+#include "pkt_comm/word_gen.h"
+#include "device.h"
+#include "emulator.h"
+
+// Checks that device_pkt_rw() writes within FPGA input credit
+// without status request (device_pkt_rw_credit): emulated board
+// with 1 FPGA, small writes, slow word generation, so FPGA output
+// is often empty at status requests. All results must come back.
+// With 'old_firmware' set, status replies don't include input_free,
+// credit is based on prog_full.
+//
+// Usage: credit_test [seconds [words_per_sec [old_firmware]]]
+
+struct device_bitstream bitstream_emu = {
+	0x0001,
+	"(emulated)",	// no upload takes place
+	{ 2, 32768, 32766 }
+};
+
+// 1 candidate per word from the word list
+struct word_gen word_gen_1 = {
+	1,
+	{
+		{ 1, 0, 48 }
+	},
+	1, { 1 },	// insert word at position 1
+	0			// generate all
+};
+
+char *words[] = {
+	"aaaaa", "bbb", "cc", "dddddd", "e", "f", "g", "hh",
+	NULL };
+
+#define WORDS_PER_LIST	8
+
+int main(int argc, char **argv)
+{
+	int seconds = argc > 1 ? atoi(argv[1]) : 2;
+	emu_params.words_per_sec = argc > 2 ? atoi(argv[2]) : 1000000;
+	emu_params.status_no_input_free = argc > 3 ? atoi(argv[3]) : 0;
+	if (seconds <= 0 || emu_params.words_per_sec <= 0) {
+		printf("Usage: %s [seconds [words_per_sec [old_firmware]]]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	struct device_list *device_list = device_emu_list_new(1, 1);
+	device_list_init(device_list, &bitstream_emu);
+	struct device *device = device_list->device;
+	if (!device_valid(device)) {
+		printf("Emulated device isn't initialized\n");
+		exit(EXIT_FAILURE);
+	}
+	struct fpga *fpga = &device->fpga[0];
+
+	unsigned long long expected = 0, results = 0, bad_results = 0;
+	int pkt_id = 0;
+
+	struct timeval tv0, tv1;
+	gettimeofday(&tv0, NULL);
+
+	// Feed the FPGA for 'seconds', then wait for the rest of results
+	for ( ; ; ) {
+		gettimeofday(&tv1, NULL);
+		int sec = tv1.tv_sec - tv0.tv_sec;
+		if (sec >= seconds + 5 || sec >= seconds && results == expected)
+			break;
+
+		if (sec < seconds && !pkt_comm_has_output_data(fpga->comm)
+				&& !pkt_queue_full(fpga->comm->output_queue, 2)) {
+			struct pkt *pkt = pkt_word_gen_new(&word_gen_1);
+			pkt->id = pkt_id++;
+			pkt_queue_push(fpga->comm->output_queue, pkt);
+			pkt_queue_push(fpga->comm->output_queue, pkt_word_list_new(words));
+			expected += WORDS_PER_LIST;
+		}
+
+		int result = device_pkt_rw(device);
+		if (result < 0) {
+			printf("device_pkt_rw(): %d (%s)\n", result, libusb_strerror(result));
+			exit(EXIT_FAILURE);
+		}
+
+		struct pkt *inpkt;
+		while ( (inpkt = pkt_queue_fetch(fpga->comm->input_queue)) ) {
+			if (inpkt->type != 0x81 || inpkt->data_len != EMU_RESULT_DATA_LEN)
+				bad_results++;
+			results++;
+			pkt_delete(inpkt);
+		}
+	}
+
+	printf("results: %llu of %llu (%llu bad), control transfers: %llu,"
+			" %llu writes without status request\n",
+			results, expected, bad_results,
+			(unsigned long long)fpga->cmd_count,
+			(unsigned long long)fpga->wr.credit_wr_count);
+
+	if (results != expected || bad_results || !fpga->wr.credit_wr_count) {
+		printf("FAILED\n");
+		exit(EXIT_FAILURE);
+	}
+	return 0;
+}
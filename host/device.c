@@ -7,7 +7,9 @@
 #include "inouttraffic.h"
 #include "ztex_scan.h"
 #include "pkt_comm/pkt_comm.h"
+#include "pkt_comm/pkt_pool.h"
 #include "device.h"
+#include "device_async.h"
 
 
 int device_init_fpgas(struct device *device, struct pkt_comm_params *params)
@@ -23,7 +25,8 @@ int device_init_fpgas(struct device *device, struct pkt_comm_params *params)
 		}
 
 		// Resets FPGA application with Global Set Reset (GSR)
-		result = fpga_reset(device->handle);
+		// (fpga_reset() over device's transport)
+		result = device->transport->control(device, 0x8B, 0, 0, NULL, 0);
 		if (result < 0) {
 			printf("SN %s #%d: device_fpga_reset: %d (%s)\n",
 				device->ztex_device->snString,
@@ -133,36 +136,345 @@ struct device_list *device_init_scan(struct device_bitstream *bitstream)
 }
 
 
+// Checks fpga->wr.io_state previously received with
+// fpga_select_setup_io() (or asynchronously).
+// Returns < 0 if FPGA reports an error.
+int fpga_check_io_state(struct fpga *fpga)
+{
+	struct device *device = fpga->device;
+
+	// TODO: human readable error description
+	if (fpga->wr.io_state.pkt_comm_status) {
+		fprintf(stderr, "SN %s FPGA #%d error: pkt_comm_status=0x%02x\n",
+			device->ztex_device->snString, fpga->num, fpga->wr.io_state.pkt_comm_status);
+		return -1;
+	}
+
+	if (fpga->wr.io_state.app_status) {
+		fprintf(stderr, "SN %s FPGA #%d error: app_status=0x%02x\n",
+			device->ztex_device->snString, fpga->num, fpga->wr.io_state.app_status);
+		return -1;
+	}
+	
+	if (fpga->wr.io_state.io_state
+			& ~(IO_STATE_INPUT_PROG_FULL | IO_STATE_INPUT_FREE_VALID
+			| IO_STATE_LISTEN)) {
+		fprintf(stderr, "SN %s FPGA #%d error: io_state=0x%02x\n",
+			device->ztex_device->snString, fpga->num, fpga->wr.io_state.io_state);
+		return -1;
+	}
+	return 0;
+}
+
+
+int device_pkt_rw_duplex = 0;
+
+void fpga_rw_duplex_callback(struct libusb_transfer *transfer)
+{
+	*(int *)transfer->user_data = 1;
+}
+
+// Cancels duplex transfers that remain submitted, waits for callbacks
+// (transfers have timeouts, that won't wait forever).
+// Returns false if some transfer is still submitted.
+int fpga_rw_duplex_cancel(struct fpga *fpga)
+{
+	if (!fpga->duplex_wr_done)
+		libusb_cancel_transfer(fpga->duplex_wr);
+	if (!fpga->duplex_rd_done)
+		libusb_cancel_transfer(fpga->duplex_rd);
+
+	while (!fpga->duplex_wr_done || !fpga->duplex_rd_done) {
+		int result = libusb_handle_events(NULL);
+		if (result < 0 && result != LIBUSB_ERROR_INTERRUPTED) {
+			fprintf(stderr, "fpga_rw_duplex_cancel(): libusb_handle_events: %d\n",
+					result);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void fpga_rw_duplex_delete(struct fpga *fpga)
+{
+	if (!fpga->duplex_wr)
+		return;
+	// Submitted transfer can't be freed
+	if (!fpga_rw_duplex_cancel(fpga))
+		return;
+	libusb_free_transfer(fpga->duplex_wr);
+	libusb_free_transfer(fpga->duplex_rd);
+	fpga->duplex_wr = NULL;
+	fpga->duplex_rd = NULL;
+}
+
+// Performs write and read on the selected FPGA simultaneously
+// (EP6 OUT and EP2 IN are independent endpoints).
+// Returns when both transfers are completed.
+// Return values same as from libusb_bulk_transfer(), ERR_WR_PARTIAL, ERR_RD_ZEROREAD
+int fpga_rw_duplex(struct fpga *fpga, unsigned char *output_data, int output_len,
+		unsigned char *input_buf, int read_limit)
+{
+	if (!fpga->duplex_wr) {
+		fpga->duplex_wr = libusb_alloc_transfer(0);
+		fpga->duplex_rd = libusb_alloc_transfer(0);
+		fpga->duplex_wr_done = 1;
+		fpga->duplex_rd_done = 1;
+		if (!fpga->duplex_wr || !fpga->duplex_rd) {
+			fprintf(stderr, "fpga_rw_duplex(): libusb_alloc_transfer failed\n");
+			if (fpga->duplex_wr) libusb_free_transfer(fpga->duplex_wr);
+			if (fpga->duplex_rd) libusb_free_transfer(fpga->duplex_rd);
+			fpga->duplex_wr = NULL;
+			fpga->duplex_rd = NULL;
+			return LIBUSB_ERROR_NO_MEM;
+		}
+	}
+	struct libusb_transfer *wr = fpga->duplex_wr;
+	struct libusb_transfer *rd = fpga->duplex_rd;
+	int *wr_done = &fpga->duplex_wr_done, *rd_done = &fpga->duplex_rd_done;
+	int error = 0;
+	int received = 0;
+
+	libusb_fill_bulk_transfer(wr, fpga->device->handle, 0x06, output_data, output_len,
+			fpga_rw_duplex_callback, wr_done, USB_RW_TIMEOUT);
+	libusb_fill_bulk_transfer(rd, fpga->device->handle, 0x82, input_buf, read_limit,
+			fpga_rw_duplex_callback, rd_done, USB_RW_TIMEOUT);
+
+	*wr_done = 0;
+	int result = libusb_submit_transfer(wr);
+	if (result < 0) {
+		*wr_done = 1;
+		return result;
+	}
+	*rd_done = 0;
+	result = libusb_submit_transfer(rd);
+	if (result < 0) {
+		error = result;
+		*rd_done = 1;
+		libusb_cancel_transfer(wr);
+	}
+
+	int wr_processed = 0, rd_processed = *rd_done;
+	while (!wr_processed || !rd_processed) {
+		if (!(*wr_done && !wr_processed) && !(*rd_done && !rd_processed)) {
+			result = libusb_handle_events_completed(NULL, NULL);
+			if (result < 0 && result != LIBUSB_ERROR_INTERRUPTED) {
+				fprintf(stderr, "fpga_rw_duplex(): libusb_handle_events: %d\n", result);
+				fpga_rw_duplex_cancel(fpga);
+				return result;
+			}
+			continue;
+		}
+
+		if (*wr_done && !wr_processed) {
+			wr_processed = 1;
+			result = device_async_transfer_result(wr);
+			if (DEBUG) printf("#%d duplex write: result=%d tx=%d/%d\n",
+					fpga->num, result, wr->actual_length, output_len);
+			if (!error && result < 0)
+				error = result;
+			else if (!error && wr->actual_length != output_len)
+				error = ERR_WR_PARTIAL;
+			if (error && !rd_processed)
+				libusb_cancel_transfer(rd);
+		}
+
+		if (*rd_done && !rd_processed) {
+			int current_read_limit = read_limit - received;
+			result = device_async_transfer_result(rd);
+			if (DEBUG) printf("#%d duplex read: result=%d, rx=%d/%d\n",
+					fpga->num, result, rd->actual_length, current_read_limit);
+			if (error) {
+				rd_processed = 1;
+			}
+			else if (result < 0) {
+				error = result;
+				rd_processed = 1;
+			}
+			else if (rd->actual_length == 0) {
+				error = ERR_RD_ZEROREAD;
+				rd_processed = 1;
+			}
+			else if (rd->actual_length != current_read_limit) { // partial read
+				if (DEBUG) printf("#%d PARTIAL READ: %d of %d\n",
+						fpga->num, rd->actual_length, current_read_limit);
+				received += rd->actual_length;
+				fpga->rd.partial_read_count++;
+				libusb_fill_bulk_transfer(rd, fpga->device->handle, 0x82,
+						input_buf + received, read_limit - received,
+						fpga_rw_duplex_callback, rd_done, USB_RW_TIMEOUT);
+				*rd_done = 0;
+				result = libusb_submit_transfer(rd);
+				if (result < 0) {
+					*rd_done = 1;
+					error = result;
+					rd_processed = 1;
+				}
+			}
+			else
+				rd_processed = 1;
+
+			if (error && !wr_processed)
+				libusb_cancel_transfer(wr);
+		}
+	}
+
+	return error;
+}
+
+
+int device_sched_idle_skip_max = DEVICE_SCHED_IDLE_SKIP_MAX_DEFAULT;
+int device_sched_stay_max = DEVICE_SCHED_STAY_MAX_DEFAULT;
+
+// Returns true if FPGA was idle at previous visits
+// and r/w operation on it can be skipped
+int fpga_sched_skip(struct fpga *fpga)
+{
+	struct fpga_sched *sched = &fpga->sched;
+	if (!sched->idle_skip)
+		return 0;
+
+	// There's output data and FPGA is able to accept it
+	if (!sched->input_full && pkt_comm_has_output_data(fpga->comm)) {
+		sched->skip_count = 0;
+		return 0;
+	}
+
+	if (sched->skip_count < sched->idle_skip) {
+		sched->skip_count++;
+		return 1;
+	}
+	sched->skip_count = 0;
+	return 0;
+}
+
+// Updates scheduler state after r/w operation on FPGA
+// (select & status request was performed, 'bytes' written and read)
+void fpga_sched_update(struct fpga *fpga, int bytes)
+{
+	struct fpga_sched *sched = &fpga->sched;
+	sched->data_bytes += bytes;
+	if (bytes) {
+		sched->idle_skip = 0;
+		return;
+	}
+	// Idle FPGA is visited less often, up to 1 of
+	// (device_sched_idle_skip_max + 1) passes
+	sched->idle_skip = sched->idle_skip ? sched->idle_skip * 2 : 1;
+	if (sched->idle_skip > device_sched_idle_skip_max)
+		sched->idle_skip = device_sched_idle_skip_max;
+}
+
+
+int device_pkt_rw_credit = 1;
+
+// Limits write length to FPGA input credit, aligned.
+// Link layer with no input credit accepts output_max_len in 1 write.
+int fpga_pkt_write_len(struct fpga *fpga, int len)
+{
+	if (!fpga->device->transport->input_credit || len <= fpga->wr.credit)
+		return len;
+
+	int align = fpga->comm->params->alignment;
+	len = fpga->wr.credit;
+	if (align)
+		len -= len % align;
+	return len;
+}
+
+// Writes to the FPGA within input credit, without status request.
+// Returns 0 if the write isn't possible (status request required).
+int fpga_pkt_write_credit(struct fpga *fpga)
+{
+	struct device *device = fpga->device;
+
+	// FPGA had output at last status - it needs another one
+	if (!device_pkt_rw_credit || fpga->wr.credit <= 0
+			|| device->selected_fpga != fpga->num
+			|| fpga->rd.read_limit || fpga->sched.read_limit)
+		return 0;
+
+	int output_data_len = 0;
+	unsigned char *output_data = pkt_comm_get_output_data(fpga->comm, &output_data_len);
+	if (!output_data)
+		return 0;
+
+	// Remaining credit
+	output_data_len = fpga_pkt_write_len(fpga, output_data_len);
+	if (!output_data_len)
+		return 0;
+
+	int transferred = 0;
+	int result = device->transport->write(fpga, output_data, output_data_len,
+			&transferred);
+	if (DEBUG) printf("#%d credit write: result=%d tx=%d/%d\n",
+			fpga->num, result, transferred, output_data_len);
+	if (result < 0)
+		return result;
+	if (transferred != output_data_len)
+		return ERR_WR_PARTIAL;
+
+	pkt_comm_output_completed(fpga->comm, output_data_len, 0);
+	fpga->wr.credit -= output_data_len;
+	fpga->wr.credit_wr_count++;
+	fpga_sched_update(fpga, output_data_len);
+	return 1;
+}
+
+
 ///////////////////////////////////////////////////////////////////
 //
-// Perform read/write operations on the device
+// Perform read/write operations on the FPGA
 // using high-speed packet communication interface (pkt_comm).
-// Expecting caller doesn't mix this with other r/w functions.
 //
 // Return values:
-// <0 - error (expecting caller to invalidate / reset the device)
-// 0 - no data was actually send or received (because of either host or remote reasons)
+// <0 - error
+// 0 - no data was actually send or received
 // >0 - success, some data was sent or received
 //
 ///////////////////////////////////////////////////////////////////
 
-int device_pkt_rw(struct device *device)
+int fpga_pkt_rw(struct fpga *fpga)
 {
-	int data_transferred = 0;
+	struct device *device = fpga->device;
+	int num = fpga->num;
 	int result;
-	int num;
-	for (num = 0; num < device->num_of_fpgas; num++) {
-		struct fpga *fpga = &device->fpga[num];
-		
-		// Get input buffer
-		unsigned char *input_buf = pkt_comm_input_get_buf(fpga->comm);
-		if (fpga->comm->error)
-			return -1;
-		// Input buffer is full - skip r/w operation
-		if (!input_buf) {
-			if (DEBUG) printf("fpga_pkt_rw(): input buffer is full\n");
-			continue;
+
+	// Get input buffer
+	unsigned char *input_buf = pkt_comm_input_get_buf(fpga->comm);
+	if (fpga->comm->error)
+		return -1;
+	// Input buffer is full - skip r/w operation
+	if (!input_buf) {
+		if (DEBUG) printf("fpga_pkt_rw(): input buffer is full\n");
+		fpga->sched.status_valid = 0;
+		return 0;
+	}
+
+	// Writes within input credit, without status request
+	int credit_write = 0;
+
+	if (fpga->sched.status_valid) {
+		// Status was taken by device_select_setup_io()
+		fpga->sched.status_valid = 0;
+
+	} else if (fpga->sched.stay && device_pkt_rw_credit
+			&& device->transport->input_credit && device->selected_fpga == num) {
+		// Staying on the FPGA after full read: last status and input credit
+		// are reused, only output limit is registered
+		result = fpga_setup_output_limit(fpga);
+		if (result < 0) {
+			fprintf(stderr, "SN %s FPGA #%d fpga_setup_output_limit() error: %d\n",
+				device->ztex_device->snString, num, result);
+			return result;
 		}
+		credit_write = 1;
+
+	} else {
+		// Write within input credit, status request is deferred
+		result = fpga_pkt_write_credit(fpga);
+		if (result)
+			return result;
 
 		// fpga_select(), fpga_get_io_state(), fpga_setup_output() in 1 USB request
 		result = fpga_select_setup_io(fpga);
@@ -171,121 +483,755 @@ int device_pkt_rw(struct device *device)
 				device->ztex_device->snString, num, result);
 			return result;
 		}
+	}
 
-		// TODO: human readable error description
-		if (fpga->wr.io_state.pkt_comm_status) {
-			fprintf(stderr, "SN %s FPGA #%d error: pkt_comm_status=0x%02x\n",
-				device->ztex_device->snString, num, fpga->wr.io_state.pkt_comm_status);
-			return -1;
-		}
+	result = fpga_check_io_state(fpga);
+	if (result < 0)
+		return result;
 
-		if (fpga->wr.io_state.app_status) {
-			fprintf(stderr, "SN %s FPGA #%d error: app_status=0x%02x\n",
-				device->ztex_device->snString, num, fpga->wr.io_state.app_status);
-			return -1;
-		}
+	int input_full = fpga->wr.io_state.io_state & IO_STATE_INPUT_PROG_FULL;
+	int output_data_len = 0;
+	unsigned char *output_data = NULL;
+	if (input_full) {
+	
+		// FPGA input is full - no write
+		if (DEBUG) printf("#%d write: Input full\n", num);
+	
+	} else {
 		
-		if (fpga->wr.io_state.io_state & ~IO_STATE_INPUT_PROG_FULL) {
-			fprintf(stderr, "SN %s FPGA #%d error: io_state=0x%02x\n",
-				device->ztex_device->snString, num, fpga->wr.io_state.io_state);
-			return -1;
+		// Get output buffer, write no more than FPGA accepts
+		output_data = pkt_comm_get_output_data(fpga->comm, &output_data_len);
+		output_data_len = fpga_pkt_write_len(fpga, output_data_len);
+
+		if (!output_data || !output_data_len) {
+			output_data = NULL;
+			// No data for output - no write
+			if (DEBUG) printf("fpga_pkt_write(): no data for output\n");
+		}
+		else if (DEBUG >= 2) {
+			int i;
+			for (i=0; i < output_data_len; i++) {
+				if (i && !(i%32)) printf("\n");
+				printf("%02x ", output_data[i]);
+			}
+			printf("\n");
 		}
+	}
 
-		int input_full = fpga->wr.io_state.io_state & IO_STATE_INPUT_PROG_FULL;
-		if (input_full) {
-		
-			// FPGA input is full - no write
-			if (DEBUG) printf("#%d write: Input full\n", num);
+	int read_limit = fpga->rd.read_limit;
+	fpga->sched.input_full = input_full;
+	fpga->sched.read_limit = read_limit;
+
+	// Status was taken while other FPGA remained selected
+	if ((output_data || read_limit) && device->selected_fpga != num) {
+		result = fpga_select(fpga);
+		if (result < 0)
+			return result;
+	}
+
+	if (device_pkt_rw_duplex && output_data && read_limit
+			&& device->transport == &device_transport_usb) {
 		
-		} else {
-			
-			// Get output buffer
-			int output_data_len = 0;
-			unsigned char *output_data = pkt_comm_get_output_data(fpga->comm,
-					&output_data_len);
+		// Write and read go simultaneously
+		result = fpga_rw_duplex(fpga, output_data, output_data_len,
+				input_buf, read_limit);
+		if (result < 0)
+			return result;
 
-			if (!output_data) {
-			
-				// No data for output - no write
-				if (DEBUG) printf("fpga_pkt_write(): no data for output\n");
-			
-			} else {
+		pkt_comm_output_completed(fpga->comm, output_data_len, 0);
+		fpga->wr.credit -= output_data_len;
+		fpga->wr.credit_wr_count += credit_write;
+		fpga->rd.read_limit = 0;
+		result = pkt_comm_input_completed(fpga->comm, read_limit, 0);
+		if (result < 0)
+			return result;
+		fpga_sched_update(fpga, output_data_len + read_limit);
+		return 1;
+	}
+
+	if (output_data) {
 			
-				if (DEBUG >= 2) {
-					int i;
-					for (i=0; i < output_data_len; i++) {
-						if (i && !(i%32)) printf("\n");
-						printf("%02x ", output_data[i]);
-					}
-					printf("\n");
-				}
-				
-				// Performing write
-				int transferred = 0;
-				result = libusb_bulk_transfer(fpga->device->handle, 0x06,
-						output_data, output_data_len, &transferred, USB_RW_TIMEOUT);
-				if (DEBUG) printf("#%d write: result=%d tx=%d/%d\n",
-						fpga->num, result, transferred, output_data_len);
-				if (result < 0) {
-					return result;
-				}
-				if (transferred != output_data_len) {
-					return ERR_WR_PARTIAL;
-				}
-				
-				// Let pkt_comm register data transmit (clear buffers etc)
-				pkt_comm_output_completed(fpga->comm, output_data_len, 0);
-				data_transferred = 1;
-			}
-		} // output issues end
+		// Performing write
+		int transferred = 0;
+		result = device->transport->write(fpga, output_data, output_data_len,
+				&transferred);
+		if (DEBUG) printf("#%d write: result=%d tx=%d/%d\n",
+				fpga->num, result, transferred, output_data_len);
+		if (result < 0) {
+			return result;
+		}
+		if (transferred != output_data_len) {
+			return ERR_WR_PARTIAL;
+		}
+		
+		// Let pkt_comm register data transmit (clear buffers etc)
+		pkt_comm_output_completed(fpga->comm, output_data_len, 0);
+		fpga->wr.credit -= output_data_len;
+		fpga->wr.credit_wr_count += credit_write;
+	} // output issues end
+
 
+	// No data to read from FPGA
+	if (!read_limit) {
+		fpga_sched_update(fpga, output_data_len);
+		return output_data_len ? 1 : 0;
+	}
 
-		// No data to read from FPGA - continue with next one
-		int read_limit = fpga->rd.read_limit;
-		if (!read_limit)
+	// Performing read
+	int received = 0;
+	for ( ; ; ) {
+		int transferred = 0;
+		int current_read_limit = read_limit - received;
+		result = device->transport->read(fpga, input_buf + received,
+				current_read_limit, &transferred);
+		if (DEBUG) printf("#%d read: result=%d, rx=%d/%d\n",
+				fpga->num, result, transferred, current_read_limit);
+		if (result < 0) {
+			return result;
+		}
+		else if (transferred == 0) {
+			return ERR_RD_ZEROREAD;
+		}
+		received += transferred;
+		if (transferred != current_read_limit) { // partial read
+			if (DEBUG) printf("#%d PARTIAL READ: %d of %d\n",
+					fpga->num, transferred, current_read_limit);
+			fpga->rd.partial_read_count++;
 			continue;
+		}
+		else
+			break;
+	} // for(;;)
+	
+	// Read completed, registered output limit is used up
+	fpga->rd.read_limit = 0;
+	if (DEBUG >= 2) {
+		int i;
+		for (i=0; i < read_limit; i++) {
+			if (i && !(i%32)) printf("\n");
+			printf("%02x ", input_buf[i]);
+		}
+		printf("\n");
+	}
 
-		// Performing read
-		int current_read_limit = read_limit;
-		for ( ; ; ) {
-			int transferred = 0;
-			result = libusb_bulk_transfer(fpga->device->handle, 0x82, input_buf,
-					current_read_limit, &transferred, USB_RW_TIMEOUT);
-			if (DEBUG) printf("#%d read: result=%d, rx=%d/%d\n",
-					fpga->num, result, transferred, current_read_limit);
-			if (result < 0) {
-				return result;
+	// Let pkt_comm handle data (process packets, place into input queue)
+	result = pkt_comm_input_completed(fpga->comm, read_limit, 0);
+	if (result < 0)
+		return result;
+	fpga_sched_update(fpga, output_data_len + read_limit);
+	return 1;
+}
+
+
+///////////////////////////////////////////////////////////////////
+//
+// Broadcast: packets from device->broadcast go to every FPGA.
+//
+// - If every FPGA supports listen mode, data is written once:
+// the highest FPGA is selected, others listen (VC 0x8F).
+// Listening FPGAs don't stop the transfer when their input is full,
+// so no more than the smallest input credit is written.
+// - Broadcast data is inserted at packet boundary of per-FPGA output.
+// Per-FPGA output is suspended until the broadcast reaches
+// packet boundary.
+// - Otherwise, packets are copied into each FPGA's output queue.
+//
+///////////////////////////////////////////////////////////////////
+
+// Copies packets from broadcast output queue to each FPGA.
+// A packet goes to every FPGA or remains in broadcast queue.
+int device_pkt_broadcast_copy(struct device *device)
+{
+	struct pkt_comm *comm = device->broadcast;
+	struct pkt *pkt_copy[DEVICE_FPGAS_MAX];
+	int last = device->num_of_fpgas - 1;
+	int num;
+
+	for ( ; ; ) {
+		struct pkt *pkt = pkt_queue_peek(comm->output_queue);
+		if (!pkt)
+			return 0;
+		for (num = 0; num <= last; num++)
+			if (pkt_queue_full(device->fpga[num].comm->output_queue, 1))
+				return 0;
+
+		// The last FPGA gets the original packet
+		for (num = 0; num < last; num++) {
+			pkt_copy[num] = pkt_pool_pkt_copy(device->fpga[num].comm->pool, pkt);
+			if (!pkt_copy[num]) {
+				while (num--)
+					pkt_delete(pkt_copy[num]);
+				return -1;
 			}
-			else if (transferred == 0) {
-				return ERR_RD_ZEROREAD;
+		}
+		pkt_copy[last] = pkt;
+		pkt_queue_fetch(comm->output_queue);
+
+		for (num = 0; num <= last; num++) {
+			if (pkt_queue_push(device->fpga[num].comm->output_queue,
+					pkt_copy[num]) < 0) {
+				pkt_error("device_pkt_broadcast_copy(): FPGA #%d queue full\n", num);
+				for ( ; num <= last; num++)
+					pkt_delete(pkt_copy[num]);
+				return -1;
 			}
-			else if (transferred != current_read_limit) { // partial read
-				if (DEBUG) printf("#%d PARTIAL READ: %d of %d\n",
-						fpga->num, transferred, current_read_limit);
-				current_read_limit -= transferred;
-				fpga->rd.partial_read_count++;
-				continue;
+		}
+	}
+}
+
+struct pkt_comm *device_broadcast_comm(struct device *device)
+{
+	if (!device->broadcast && device->fpga[0].comm)
+		device->broadcast = pkt_comm_new(device->fpga[0].comm->params);
+	return device->broadcast;
+}
+
+// Status of all FPGAs for broadcast input credit. No output limit
+// is registered, read limits registered earlier remain.
+int device_broadcast_status(struct device *device)
+{
+	unsigned int read_limit[DEVICE_FPGAS_MAX];
+	int num;
+
+	for (num = 0; num < device->num_of_fpgas; num++)
+		read_limit[num] = device->fpga[num].rd.read_limit;
+	int result = device_select_setup_io(device, 0);
+	for (num = 0; num < device->num_of_fpgas; num++) {
+		struct fpga *fpga = &device->fpga[num];
+		fpga->rd.read_limit = read_limit[num];
+		fpga->sched.status_valid = 0;
+	}
+	return result;
+}
+
+// The smallest input credit among FPGAs
+int device_broadcast_credit(struct device *device)
+{
+	int credit = device->fpga[0].wr.credit;
+	int num;
+	for (num = 1; num < device->num_of_fpgas; num++)
+		if (device->fpga[num].wr.credit < credit)
+			credit = device->fpga[num].wr.credit;
+	return credit > 0 ? credit : 0;
+}
+
+int device_pkt_broadcast(struct device *device)
+{
+	struct pkt_comm *comm = device->broadcast;
+	int result;
+	int num;
+
+	if (!comm || !pkt_comm_has_output_data(comm))
+		return 0;
+
+	// Listen mode support is known after a status request
+	if (device->broadcast_mode == DEVICE_BROADCAST_UNKNOWN) {
+		device->broadcast_mode = DEVICE_BROADCAST_COPY;
+		if (device_status_all_supported(device)) {
+			result = device_broadcast_status(device);
+			// The firmware without VR 0x8D has no listen mode either
+			if (result == LIBUSB_ERROR_PIPE)
+				return device_pkt_broadcast_copy(device);
+			if (result < 0)
+				return result;
+			device->broadcast_mode = DEVICE_BROADCAST_LISTEN;
+			for (num = 0; num < device->num_of_fpgas; num++) {
+				struct fpga *fpga = &device->fpga[num];
+				if (!(fpga->wr.io_state.io_state & IO_STATE_LISTEN))
+					device->broadcast_mode = DEVICE_BROADCAST_COPY;
 			}
-			else
+		}
+	}
+
+	if (device->broadcast_mode == DEVICE_BROADCAST_COPY)
+		return device_pkt_broadcast_copy(device);
+
+	// Wait until output to every FPGA reaches packet boundary
+	int at_boundary = 1;
+	for (num = 0; num < device->num_of_fpgas; num++) {
+		struct pkt_comm *fpga_comm = device->fpga[num].comm;
+		pkt_comm_set_output_suspend(fpga_comm, 1);
+		if (!pkt_comm_output_at_boundary(fpga_comm))
+			at_boundary = 0;
+	}
+	if (!at_boundary)
+		return 0;
+
+	int output_data_len = 0;
+	unsigned char *output_data = pkt_comm_get_output_data(comm, &output_data_len);
+	if (!output_data)
+		return 0;
+
+	// Write no more than the smallest input credit. Credit left from
+	// earlier status requests is a lower bound of free space; status
+	// is requested only if that isn't enough for the data.
+	struct fpga *master = &device->fpga[device->num_of_fpgas - 1];
+	int credit = device_broadcast_credit(device);
+	if (credit < output_data_len) {
+		result = device_broadcast_status(device);
+		if (result < 0)
+			return result;
+		for (num = 0; num < device->num_of_fpgas; num++) {
+			result = fpga_check_io_state(&device->fpga[num]);
+			if (result < 0)
+				return result;
+		}
+		credit = device_broadcast_credit(device);
+	}
+	int master_credit = master->wr.credit;
+	master->wr.credit = credit;
+	output_data_len = fpga_pkt_write_len(master, output_data_len);
+	master->wr.credit = master_credit;
+	if (!output_data_len)
+		return 0;
+
+	result = device->transport->control(device, 0x8F,
+			(1 << device->num_of_fpgas) - 1, 0, NULL, 0);
+	master->cmd_count++;
+	if (result < 0)
+		return result;
+	device->selected_fpga = master->num;
+
+	int transferred = 0;
+	result = device->transport->write(master, output_data, output_data_len,
+			&transferred);
+	if (DEBUG) printf("broadcast write: result=%d tx=%d/%d\n",
+			result, transferred, output_data_len);
+	if (result < 0)
+		return result;
+	if (transferred != output_data_len)
+		return ERR_WR_PARTIAL;
+
+	result = device->transport->control(device, 0x8F, 0, 0, NULL, 0);
+	master->cmd_count++;
+	if (result < 0)
+		return result;
+
+	pkt_comm_output_completed(comm, output_data_len, 0);
+	for (num = 0; num < device->num_of_fpgas; num++)
+		device->fpga[num].wr.credit -= output_data_len;
+
+	// Per-FPGA output resumes at broadcast packet boundary
+	if (pkt_comm_output_at_boundary(comm))
+		for (num = 0; num < device->num_of_fpgas; num++)
+			pkt_comm_set_output_suspend(device->fpga[num].comm, 0);
+	return 1;
+}
+
+
+///////////////////////////////////////////////////////////////////
+//
+// Mux mode. The firmware selects FPGAs in turn and registers
+// output limit, FPGA outputs a tag followed by the data.
+// Every FPGA receives data written to the device and keeps frames
+// tagged with its number.
+//
+// - Listening FPGAs don't apply backpressure. Input credit is
+// free space from the tag less data that was written
+// but not received by FPGA when the tag was generated.
+// - If FPGA's input buffer is full, the rest of the stream waits.
+//
+///////////////////////////////////////////////////////////////////
+
+int device_mux_enable(struct device *device, int enable)
+{
+	int result;
+	int num;
+
+	if (!enable) {
+		if (!device->mux)
+			return 0;
+		free(device->mux);
+		device->mux = NULL;
+		result = device->transport->control(device, 0x90, 0, 0, NULL, 0);
+		if (result < 0)
+			return result;
+		device->selected_fpga = device->num_of_fpgas - 1;
+		return 0;
+	}
+
+	if (device->mux)
+		return 1;
+	if (!device_status_all_supported(device))
+		return 0;
+	// Capabilities are from fpga_test_get_id()
+	for (num = 0; num < device->num_of_fpgas; num++)
+		if (!(device->fpga[num].caps & FPGA_CAP_MUX))
+			return 0;
+
+	// Status without output limit registration: no data goes
+	// out of FPGAs before mux mode. Input credit is from the status.
+	result = device_select_setup_io(device, 0);
+	if (result == LIBUSB_ERROR_PIPE)
+		return 0;
+	if (result < 0)
+		return result;
+	for (num = 0; num < device->num_of_fpgas; num++) {
+		struct fpga *fpga = &device->fpga[num];
+		fpga->sched.status_valid = 0;
+		result = fpga_check_io_state(fpga);
+		if (result < 0)
+			return result;
+	}
+
+	struct device_mux *mux = malloc(sizeof(struct device_mux));
+	if (!mux) {
+		pkt_error("device_mux_enable(): unable to allocate %d bytes\n",
+				(int)sizeof(struct device_mux));
+		return -1;
+	}
+	memset(mux, 0, sizeof(struct device_mux));
+
+	result = device->transport->control(device, 0x90, device->num_of_fpgas,
+			0, NULL, 0);
+	if (result < 0) {
+		free(mux);
+		return result;
+	}
+	device->mux = mux;
+	return 1;
+}
+
+// Tag of a frame from FPGA
+int device_mux_tag(struct device *device)
+{
+	struct device_mux *mux = device->mux;
+	unsigned char *tag = mux->tag;
+	int num = tag[0] & ~MUX_TAG_ERROR;
+
+	if (tag[1] != MUX_TAG || num >= device->num_of_fpgas) {
+		fprintf(stderr, "SN %s mux: bad tag 0x%02x 0x%02x\n",
+			device->ztex_device->snString, tag[0], tag[1]);
+		return -1;
+	}
+	if (tag[0] & MUX_TAG_ERROR) {
+		fprintf(stderr, "SN %s FPGA #%d error (mux mode)\n",
+			device->ztex_device->snString, num);
+		return -1;
+	}
+
+	struct fpga *fpga = &device->fpga[num];
+	int words = tag[2] | tag[3] << 8;
+	int input_free = tag[4] | tag[5] << 8;
+	unsigned short received = tag[6] | tag[7] << 8;
+	unsigned short in_transit = mux->wr_words[num] - received;
+
+	fpga->wr.credit = (input_free - in_transit) * INPUT_WORD_WIDTH;
+	if (fpga->wr.credit < 0)
+		fpga->wr.credit = 0;
+	mux->rd_fpga = fpga;
+	mux->rd_remain = words * OUTPUT_WORD_WIDTH;
+	return 0;
+}
+
+// Passes data from the read buffer to FPGAs' pkt_comm.
+// Returns 1 if some data was passed.
+int device_mux_demux(struct device *device)
+{
+	struct device_mux *mux = device->mux;
+	int data_passed = 0;
+	int result;
+
+	while (mux->rd_offset < mux->rd_len) {
+		unsigned char *data = mux->rd_buf + mux->rd_offset;
+		int len = mux->rd_len - mux->rd_offset;
+
+		// Tag can be split between reads
+		if (!mux->rd_remain) {
+			if (len > MUX_TAG_IN_LEN - mux->tag_len)
+				len = MUX_TAG_IN_LEN - mux->tag_len;
+			memcpy(mux->tag + mux->tag_len, data, len);
+			mux->tag_len += len;
+			mux->rd_offset += len;
+			if (mux->tag_len < MUX_TAG_IN_LEN)
 				break;
-		} // for(;;)
-		
-		// Read completed.
-		if (DEBUG >= 2) {
-			int i;
-			for (i=0; i < read_limit; i++) {
-				if (i && !(i%32)) printf("\n");
-				printf("%02x ", input_buf[i]);
-			}
-			printf("\n");
+
+			mux->tag_len = 0;
+			result = device_mux_tag(device);
+			if (result < 0)
+				return result;
+			continue;
 		}
 
-		// Let pkt_comm handle data (process packets, place into input queue)
-		result = pkt_comm_input_completed(fpga->comm, read_limit, 0);
+		struct pkt_comm *comm = mux->rd_fpga->comm;
+		unsigned char *input_buf = pkt_comm_input_get_buf(comm);
+		if (comm->error)
+			return -1;
+		if (!input_buf)
+			break;
+
+		if (len > mux->rd_remain)
+			len = mux->rd_remain;
+		if (len > comm->params->input_max_len)
+			len = comm->params->input_max_len;
+		memcpy(input_buf, data, len);
+		result = pkt_comm_input_completed(comm, len, 0);
+		if (result < 0)
+			return result;
+
+		mux->rd_offset += len;
+		mux->rd_remain -= len;
+		mux->rd_fpga->sched.data_bytes += len;
+		data_passed = 1;
+	}
+	return data_passed;
+}
+
+int device_pkt_rw_mux(struct device *device)
+{
+	struct device_mux *mux = device->mux;
+	int data_transferred = 0;
+	int wr_len = 0;
+	int len[DEVICE_FPGAS_MAX];
+	int result;
+	int num;
+
+	// Broadcast packets are copied to each FPGA
+	if (device->broadcast) {
+		result = device_pkt_broadcast_copy(device);
 		if (result < 0)
 			return result;
+	}
+
+	// Frames for FPGAs that have output data, within input credit
+	for (num = 0; num < device->num_of_fpgas; num++) {
+		struct fpga *fpga = &device->fpga[num];
+		len[num] = 0;
+
+		int max_len = DEVICE_MUX_BUF_SIZE - wr_len - MUX_TAG_OUT_LEN;
+		if (max_len > fpga->wr.credit)
+			max_len = fpga->wr.credit;
+		max_len -= max_len % INPUT_WORD_WIDTH;
+		if (max_len <= 0)
+			continue;
+
+		int output_data_len = 0;
+		unsigned char *output_data = pkt_comm_get_output_data(fpga->comm,
+				&output_data_len);
+		if (!output_data)
+			continue;
+		if (output_data_len > max_len)
+			output_data_len = max_len;
+
+		unsigned char *tag = mux->wr_buf + wr_len;
+		int words = output_data_len / INPUT_WORD_WIDTH;
+		tag[0] = num;
+		tag[1] = MUX_TAG;
+		tag[2] = words;
+		tag[3] = words >> 8;
+		memcpy(tag + MUX_TAG_OUT_LEN, output_data, output_data_len);
+		wr_len += MUX_TAG_OUT_LEN + output_data_len;
+		len[num] = output_data_len;
+	}
+
+	if (wr_len) {
+		int transferred = 0;
+		result = device->transport->write(&device->fpga[0], mux->wr_buf, wr_len,
+				&transferred);
+		if (DEBUG) printf("mux write: result=%d tx=%d/%d\n",
+				result, transferred, wr_len);
+		if (result < 0)
+			return result;
+		if (transferred != wr_len)
+			return ERR_WR_PARTIAL;
+
+		for (num = 0; num < device->num_of_fpgas; num++) {
+			struct fpga *fpga = &device->fpga[num];
+			if (!len[num])
+				continue;
+			pkt_comm_output_completed(fpga->comm, len[num], 0);
+			fpga->wr.credit -= len[num];
+			mux->wr_words[num] += len[num] / INPUT_WORD_WIDTH;
+			fpga->sched.data_bytes += len[num];
+		}
 		data_transferred = 1;
 	}
+
+	// Read when previously read data is processed
+	int read_error = 0;
+	if (mux->rd_offset == mux->rd_len) {
+		int transferred = 0;
+		result = device->transport->read(&device->fpga[0], mux->rd_buf,
+				DEVICE_MUX_READ_LEN, &transferred);
+		if (DEBUG) printf("mux read: result=%d, rx=%d\n", result, transferred);
+		if (result < 0 && !transferred)
+			return result;
+		// Data received before the error is demultiplexed
+		if (result < 0)
+			read_error = result;
+		mux->rd_len = transferred;
+		mux->rd_offset = 0;
+	}
+
+	result = device_mux_demux(device);
+	if (result < 0)
+		return result;
+	if (read_error)
+		return read_error;
+	if (result > 0)
+		data_transferred = 1;
+	return data_transferred;
+}
+
+
+///////////////////////////////////////////////////////////////////
+//
+// Notification (VC 0x91)
+//
+// The firmware checks FPGAs when there's no I/O on the selected one
+// and sends a message via interrupt endpoint (EP1 IN) when some FPGA
+// has output ready or its input is drained. The application waits
+// for the message instead of polling FPGAs with status requests.
+//
+///////////////////////////////////////////////////////////////////
+
+int device_notify_enable(struct device *device, int output_bytes,
+		int input_free_bytes)
+{
+	if (!device->transport->wait_event)
+		return 0;
+
+	int output_words = (output_bytes + OUTPUT_WORD_WIDTH - 1)
+			/ OUTPUT_WORD_WIDTH;
+	if (output_words > 0xFFFF)
+		output_words = 0xFFFF;
+	int input_units = (input_free_bytes + 256 * INPUT_WORD_WIDTH - 1)
+			/ (256 * INPUT_WORD_WIDTH);
+	if (input_units > 0xFF)
+		input_units = 0xFF;
+	int num = output_words > 0 || input_units > 0 ? device->num_of_fpgas : 0;
+
+	int result = device->transport->control(device, 0x91, output_words,
+			input_units | num << 8, NULL, 0);
+	// The firmware doesn't support notification
+	if (result == LIBUSB_ERROR_PIPE) {
+		device->notify = 0;
+		return 0;
+	}
+	if (result < 0)
+		return result;
+	device->notify = num > 0;
+	return device->notify;
+}
+
+int device_wait_event(struct device *device, int timeout_ms)
+{
+	if (!device->notify)
+		return 0;
+	if (timeout_ms <= 0)
+		timeout_ms = 1;
+
+	unsigned char events[2];
+	int result = device->transport->wait_event(device, events, timeout_ms);
+	if (result == LIBUSB_ERROR_TIMEOUT)
+		return 0;
+	if (result < 0)
+		return result;
+	return events[0] | events[1] << 8;
+}
+
+
+///////////////////////////////////////////////////////////////////
+//
+// Perform read/write operations on the device
+// using high-speed packet communication interface (pkt_comm).
+// Expecting caller doesn't mix this with other r/w functions.
+//
+// - In mux mode, device_pkt_rw_mux() does the job
+// - Broadcast packets are written first (device_pkt_broadcast())
+// - FPGAs that were idle at previous passes are visited less often
+// - With device_pkt_rw_status_all, status of all FPGAs can be taken
+// in 1 USB request, then only FPGAs with something to transfer are selected
+// - If FPGA's output buffer came back full, stay on the FPGA
+// (no FPGA switch in the firmware, no status request if the link layer
+// keeps input credit) up to device_sched_stay_max times
+//
+// Return values:
+// <0 - error (expecting caller to invalidate / reset the device)
+// 0 - no data was actually send or received (because of either host or remote reasons)
+// >0 - success, some data was sent or received
+//
+///////////////////////////////////////////////////////////////////
+
+int device_pkt_rw_status_all = 0;
+
+int device_pkt_rw(struct device *device)
+{
+	int data_transferred = 0;
+	int num;
+
+	if (device->mux)
+		return device_pkt_rw_mux(device);
+
+	int result = device_pkt_broadcast(device);
+	if (result < 0) {
+		fprintf(stderr, "SN %s device_pkt_broadcast() error: %d\n",
+			device->ztex_device->snString, result);
+		return result;
+	}
+	if (result > 0)
+		data_transferred = 1;
+
+	// FPGAs to visit at this pass
+	int visit_mask = 0, idle_count = 0;
+	for (num = 0; num < device->num_of_fpgas; num++) {
+		struct fpga *fpga = &device->fpga[num];
+		if (fpga_sched_skip(fpga))
+			continue;
+		visit_mask |= 1 << num;
+		if (fpga->sched.idle_skip && !pkt_comm_has_output_data(fpga->comm))
+			idle_count++;
+	}
+
+	// Status of all FPGAs in 1 request pays off if 2 or more FPGAs
+	// are going to be visited just to find out they're still idle.
+	// Then every FPGA that has something to transfer is visited.
+	if (device_pkt_rw_status_all && device_status_all_supported(device)
+			&& idle_count >= 2) {
+		// Output limit is registered on FPGAs where it's going to be read.
+		// FPGAs with received data waiting for processing are visited
+		// anyway (pkt_comm_input_get_buf() processes it)
+		int reg_mask = 0, input_mask = 0;
+		for (num = 0; num < device->num_of_fpgas; num++) {
+			struct pkt_comm *comm = device->fpga[num].comm;
+			if (!pkt_comm_input_full(comm))
+				reg_mask |= 1 << num;
+			else if (comm->input_buf_len || comm->input_pending_count)
+				input_mask |= 1 << num;
+		}
+
+		result = device_select_setup_io(device, reg_mask);
+		if (result < 0) {
+			fprintf(stderr, "SN %s device_select_setup_io() error: %d\n",
+				device->ztex_device->snString, result);
+			return result;
+		}
+		visit_mask = reg_mask | input_mask;
+		for (num = 0; num < device->num_of_fpgas; num++)
+			if (!(visit_mask & 1 << num))
+				device->fpga[num].sched.status_valid = 0;
+	}
+
+	for (num = 0; num < device->num_of_fpgas; num++) {
+		struct fpga *fpga = &device->fpga[num];
+		if (!(visit_mask & 1 << num))
+			continue;
+
+		int count;
+		for (count = 0; ; count++) {
+			fpga->sched.stay = count > 0;
+			result = fpga_pkt_rw(fpga);
+			if (result < 0)
+				return result;
+			if (!result)
+				break;
+			data_transferred = 1;
+
+			if (fpga->sched.read_limit < fpga->comm->params->input_max_len
+					|| count + 1 >= device_sched_stay_max)
+				break;
+		}
+	}
 	
 	return data_transferred;
 }
@@ -37,6 +37,205 @@ struct device_list *device_timely_scan(struct device_list *device_list, struct d
 // >0 - success, some data was sent or received
 int device_pkt_rw(struct device *device);
 
+// Perform read/write operations on the FPGA (used by device_pkt_rw())
+int fpga_pkt_rw(struct fpga *fpga);
+
+// device_pkt_rw() scheduler.
+// FPGA that had nothing to send or receive is skipped at subsequent
+// passes (1, 2, 4 ... up to device_sched_idle_skip_max passes)
+// unless there's output data for it. 0 disables skipping.
+#define DEVICE_SCHED_IDLE_SKIP_MAX_DEFAULT	8
+extern int device_sched_idle_skip_max;
+
+// If FPGA's output buffer came back full (read_limit == input_max_len),
+// r/w operation on the FPGA is repeated up to that many times in total
+// before switching to next FPGA. 1 disables. If the link layer keeps
+// input credit, repeats reuse the last status: only output limit
+// is registered (VR 0x85), writes go within the credit.
+#define DEVICE_SCHED_STAY_MAX_DEFAULT	4
+extern int device_sched_stay_max;
+
+// If set, device_pkt_rw() performs write and read on the selected FPGA
+// simultaneously and proceeds to next FPGA when both are completed.
+// Default: 0 (write, then read)
+extern int device_pkt_rw_duplex;
+
+// Input credit. After a status request that found FPGA input
+// not prog_full, FPGA is known to accept device->transport->input_credit
+// bytes. If the bitstream reports input free space, credit is that
+// free space (up to the whole input FIFO). Writes never exceed credit.
+// If set, device_pkt_rw() writes to FPGA that's still selected
+// and had no output at last status request within remaining credit,
+// without a status request. Default: 1
+extern int device_pkt_rw_credit;
+
+// If set and link layer supports it, device_pkt_rw() takes status
+// of all FPGAs in 1 request (device_select_setup_io()) at passes when
+// 2 or more idle FPGAs are due for a visit, then selects only FPGAs
+// that have something to transfer. Requires firmware built from
+// inouttraffic.c (VR 0x8D); inouttraffic.ihx in the repository doesn't
+// have it, if the request stalls, FPGAs are visited one by one as with
+// the flag off. Default: 0
+extern int device_pkt_rw_status_all;
+
+// pkt_comm for packets that go to every FPGA of the device
+// (device->broadcast), created on first call with parameters
+// of FPGA's pkt_comm. Returns NULL if allocation failed.
+struct pkt_comm *device_broadcast_comm(struct device *device);
+
+// Writes packets from device->broadcast to every FPGA
+// (used by device_pkt_rw()). If every FPGA supports listen mode
+// (IO_STATE_LISTEN), data is written once within the smallest input
+// credit; output to each FPGA is suspended at packet boundary until
+// the broadcast reaches packet boundary. Otherwise, and in mux mode,
+// packets from broadcast output queue are copied into each FPGA's
+// output queue (pkt_comm_output_reserve() isn't supported then).
+// Order of broadcast packets relative to per-FPGA packets isn't defined.
+// Not supported with device_pkt_rw_async().
+int device_pkt_broadcast(struct device *device);
+
+// Mux mode (VC 0x90): the firmware switches FPGAs on its own,
+// output of every FPGA is read as one stream of tagged frames
+// and input for all FPGAs is written in 1 transfer (see MUX_TAG).
+// device_pkt_rw() then performs 1 write and 1 read, no vendor requests.
+// Link layer must support status_all. device_pkt_rw_async() and other
+// functions that use vendor requests aren't used in mux mode.
+// Mux mode pays off when vendor requests are slow (~250 usec or more,
+// e.g. boards behind hubs): emulated board, 30 MB/s, 1 ms per request -
+// 12.8 MB/s vs. 10.5 MB/s. With fast requests it's slower (12.7 vs.
+// 18.0 MB/s at 0 latency): the rate is limited by FPGA switching
+// in the firmware, every frame carries a tag.
+// Returns 1 if mux mode is enabled, 0 if it's not supported
+// (bitstream without FPGA_CAP_MUX or firmware without VR 0x8D),
+// < 0 on error. Disable mux mode when there's no data in transit.
+int device_mux_enable(struct device *device, int enable);
+
+#define DEVICE_MUX_BUF_SIZE		65536
+// Bulk IN stream has no short packets in mux mode, reads wait
+// until that many bytes are ready (FPGAs send tags when idle)
+#define DEVICE_MUX_READ_LEN		8192
+
+struct device_mux {
+	// frames for every FPGA go in 1 write
+	unsigned char wr_buf[DEVICE_MUX_BUF_SIZE];
+	// words written to each FPGA (modulo 2**16)
+	unsigned short wr_words[DEVICE_FPGAS_MAX];
+	// demultiplexer
+	unsigned char rd_buf[DEVICE_MUX_READ_LEN];
+	int rd_len, rd_offset;
+	unsigned char tag[MUX_TAG_IN_LEN];
+	int tag_len;			// bytes of the tag received
+	struct fpga *rd_fpga;	// FPGA the frame is from
+	int rd_remain;			// frame data bytes not processed yet
+};
+
+// Performs write and read in mux mode (used by device_pkt_rw())
+int device_pkt_rw_mux(struct device *device);
+
+// Notification (VC 0x91): when there's no I/O, the firmware checks
+// FPGAs (at most once per USB frame, 1 ms) and sends a message via interrupt endpoint as some FPGA gets
+// 'output_bytes' or more of output ready, or 'input_free_bytes' or more
+// of free space in its input FIFO (rounded up to 512 bytes). 0 turns
+// off the respective check, both 0 disable notification.
+// The state is reported again after FPGA leaves it. Bitstreams
+// without VCR 0x97 (output not registered yet) never report output.
+// No notification in mux mode.
+// Returns 1 if notification is enabled, 0 if it's disabled
+// or not supported, < 0 on error.
+int device_notify_enable(struct device *device, int output_bytes,
+		int input_free_bytes);
+
+// Waits for notification message up to 'timeout_ms'.
+// Returns bitmask of FPGAs with output ready (DEVICE_EVENT_OUTPUT)
+// and with input drained (DEVICE_EVENT_INPUT); 0 on timeout or if
+// notification isn't enabled (the call doesn't wait then); < 0 on error.
+// FPGA with output below the threshold is found only at the timeout.
+int device_wait_event(struct device *device, int timeout_ms);
+
+#define DEVICE_EVENT_OUTPUT(num)	(1 << (num))
+#define DEVICE_EVENT_INPUT(num)		(0x100 << (num))
+
+// Returns write length 'len' limited to FPGA input credit
+int fpga_pkt_write_len(struct fpga *fpga, int len);
+
+// Performs write and read on the selected FPGA simultaneously.
+// Returns when both transfers are completed.
+int fpga_rw_duplex(struct fpga *fpga, unsigned char *output_data, int output_len,
+		unsigned char *input_buf, int read_limit);
+
+// Frees transfers kept for fpga_rw_duplex() (used by device_invalidate())
+void fpga_rw_duplex_delete(struct fpga *fpga);
+
+// Same as device_pkt_rw(), performed with asynchronous I/O engine (device_async.c).
+// Several OUT and IN transfers are kept in flight, transfers to other devices
+// are performed while the function waits for completion.
+// Return values are same as for device_pkt_rw().
+// The caller must not mix it with other r/w functions on the same device.
+// The engine is for USB only: on other transports (emulator, loopback)
+// returns LIBUSB_ERROR_NOT_SUPPORTED, use device_pkt_rw() there.
+int device_pkt_rw_async(struct device *device);
+
+// Stream mode (VC 0x92, asynchronous I/O engine only): the selected
+// FPGA pushes output into EP2 as it comes, the engine keeps IN transfers
+// posted and relies on pkt_comm framing for packet boundaries.
+// There's no output limit request before reads: r/w pass switches
+// FPGAs with VR 0x93 (that also returns status for the write), the
+// firmware ends the output of previous FPGA with zero-length packet.
+// The streaming FPGA remains selected; if there's no output data for
+// it, it's not visited, so 1 FPGA with results only takes no vendor
+// requests at all.
+// Returns 1 if stream mode is enabled, 0 if it's disabled or not
+// supported (other transport, bitstream without FPGA_CAP_STREAM,
+// firmware without VC 0x92, mux mode or notification is enabled),
+// < 0 on error (LIBUSB_ERROR_BUSY if r/w pass is in progress).
+// Disabling ends the output and passes the rest to pkt_comm:
+// LIBUSB_ERROR_TIMEOUT if FPGA's input queue stays full, fetch
+// input packets and repeat. Use device_pkt_rw_async() or
+// device_list_advance() only while stream mode is enabled.
+int device_stream_enable(struct device *device, int enable);
+
+// Event loop integration (asynchronous I/O engine).
+// Instead of spinning on device_pkt_rw(), application polls
+// descriptors from device_get_pollfds() (e.g. with epoll) and sleeps
+// no longer than device_list_next_timeout(), then calls
+// device_list_advance(). Descriptors set can change when devices
+// are opened or closed (see libusb_set_pollfd_notifiers()).
+//
+// Fills 'fds' with libusb file descriptors and events to poll for.
+// Returns number of descriptors, < 0 on error.
+struct pollfd;
+int device_get_pollfds(struct pollfd *fds, int max_fds);
+
+// Returns microseconds until next deadline: libusb timeout,
+// r/w pass on some device or next device scan (device_timely_scan()).
+// 0 if some work is ready.
+int device_list_next_timeout(struct device_list *device_list);
+
+// Processes USB events that are ready and starts r/w passes that are due,
+// doesn't wait. New output packets are picked up at next r/w pass.
+// Devices with errors are invalidated. Devices on other transports
+// have no descriptors to poll and are skipped (also by
+// device_list_next_timeout()), the caller drives them with device_pkt_rw().
+// Returns number of devices where some data was sent or received,
+// < 0 on libusb error.
+int device_list_advance(struct device_list *device_list);
+
+// If there's no output data, FPGAs are polled for input every that many
+// microseconds (device_list_advance() only)
+#define DEVICE_ASYNC_IDLE_USEC_DEFAULT	1000
+extern int device_async_idle_usec;
+
+// With notification enabled (device_notify_enable()), r/w pass on idle
+// device starts when the device reports an event, or after that many
+// microseconds (output below the threshold)
+#define DEVICE_ASYNC_NOTIFY_USEC_DEFAULT	100000
+extern int device_async_notify_usec;
+
+// Checks fpga->wr.io_state previously received with
+// fpga_select_setup_io() (or asynchronously).
+// Returns < 0 if FPGA reports an error.
+int fpga_check_io_state(struct fpga *fpga);
+
 // Returns ASCII string containing human-readable error description.
 // ! not implemented yet
 char *device_strerror(int error_code);
@@ -0,0 +1,1226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <libusb-1.0/libusb.h>
+
+#include "ztex.h"
+#include "inouttraffic.h"
+#include "pkt_comm/pkt_comm.h"
+#include "device.h"
+#include "ztex_scan.h"
+#include "device_async.h"
+
+// device_pkt_rw_async() waits for USB events that long
+#define ASYNC_WAIT_USEC	10000
+
+int device_async_idle_usec = DEVICE_ASYNC_IDLE_USEC_DEFAULT;
+int device_async_notify_usec = DEVICE_ASYNC_NOTIFY_USEC_DEFAULT;
+
+
+struct device_async *device_async_new(struct device *device)
+{
+	struct device_async *async = malloc(sizeof(struct device_async));
+	if (!async) {
+		fprintf(stderr, "device_async_new(): unable to allocate %d bytes\n",
+				(int)sizeof(struct device_async));
+		return NULL;
+	}
+	async->device = device;
+	async->fpga_num = 0;
+	async->active = 0;
+	async->pass_done = 0;
+	async->in_flight = 0;
+	async->error = 0;
+	async->data_transferred = 0;
+	async->pass_time.tv_sec = 0;
+	async->pass_time.tv_usec = 0;
+	async->notify_active = 0;
+	async->notify_events = 0;
+	async->stream = 0;
+	async->stream_fpga = -1;
+	async->stream_first = 0;
+	async->stream_rd = NULL;
+	async->stream_rd_next = 0;
+	async->stream_in_flight = 0;
+	async->stream_owner_first = 0;
+	async->stream_owner_count = 0;
+	async->stream_data = 0;
+
+	int ok = 1;
+	async->notify_transfer = libusb_alloc_transfer(0);
+	if (!async->notify_transfer)
+		ok = 0;
+	int num;
+	for (num = 0; num < DEVICE_FPGAS_MAX; num++) {
+		struct fpga_async *fa = &async->fpga[num];
+		fa->fpga = &device->fpga[num];
+		fa->device_async = async;
+		fa->state = FPGA_ASYNC_IDLE;
+		fa->setup_active = 0;
+		fa->setup_transfer = libusb_alloc_transfer(0);
+		if (!fa->setup_transfer)
+			ok = 0;
+		fa->wr_chunks = fa->wr_count = 0;
+		fa->rd_chunks = fa->rd_count = 0;
+
+		int i;
+		for (i = 0; i < ASYNC_TRANSFERS_MAX; i++) {
+			fa->wr[i].fpga_async = fa;
+			fa->wr[i].active = 0;
+			fa->wr[i].transfer = libusb_alloc_transfer(0);
+			fa->rd[i].fpga_async = fa;
+			fa->rd[i].active = 0;
+			fa->rd[i].transfer = libusb_alloc_transfer(0);
+			if (!fa->wr[i].transfer || !fa->rd[i].transfer)
+				ok = 0;
+		}
+	}
+	device->async = async;
+
+	if (!ok) {
+		fprintf(stderr, "device_async_new(): libusb_alloc_transfer failed\n");
+		device_async_delete(device);
+		return NULL;
+	}
+	return async;
+}
+
+// Cancels all transfers in flight. Completion callbacks are called
+// with LIBUSB_TRANSFER_CANCELLED.
+void device_async_cancel(struct device_async *async)
+{
+	int num;
+	for (num = 0; num < DEVICE_FPGAS_MAX; num++) {
+		struct fpga_async *fa = &async->fpga[num];
+		if (fa->setup_active)
+			libusb_cancel_transfer(fa->setup_transfer);
+		int i;
+		for (i = 0; i < ASYNC_TRANSFERS_MAX; i++) {
+			if (fa->wr[i].active)
+				libusb_cancel_transfer(fa->wr[i].transfer);
+			if (fa->rd[i].active)
+				libusb_cancel_transfer(fa->rd[i].transfer);
+		}
+	}
+	if (async->stream_rd) {
+		int i;
+		for (i = 0; i < STREAM_TRANSFERS; i++)
+			if (async->stream_rd[i].active)
+				libusb_cancel_transfer(async->stream_rd[i].transfer);
+	}
+}
+
+void device_async_delete(struct device *device)
+{
+	struct device_async *async = device->async;
+	if (!async)
+		return;
+
+	if (async->in_flight) {
+		if (!async->error)
+			async->error = -1;
+		device_async_cancel(async);
+		// Transfers have timeouts, that won't wait forever
+		while (async->in_flight) {
+			int result = libusb_handle_events(NULL);
+			if (result < 0 && result != LIBUSB_ERROR_INTERRUPTED)
+				break;
+		}
+	}
+
+	if (async->notify_active) {
+		libusb_cancel_transfer(async->notify_transfer);
+		while (async->notify_active) {
+			int result = libusb_handle_events(NULL);
+			if (result < 0 && result != LIBUSB_ERROR_INTERRUPTED)
+				break;
+		}
+	}
+	if (async->notify_transfer)
+		libusb_free_transfer(async->notify_transfer);
+
+	device_stream_delete(async);
+
+	int num;
+	for (num = 0; num < DEVICE_FPGAS_MAX; num++) {
+		struct fpga_async *fa = &async->fpga[num];
+		if (fa->setup_transfer)
+			libusb_free_transfer(fa->setup_transfer);
+		int i;
+		for (i = 0; i < ASYNC_TRANSFERS_MAX; i++) {
+			if (fa->wr[i].transfer)
+				libusb_free_transfer(fa->wr[i].transfer);
+			if (fa->rd[i].transfer)
+				libusb_free_transfer(fa->rd[i].transfer);
+		}
+	}
+	free(async);
+	device->async = NULL;
+}
+
+// Converts transfer status into libusb error code
+int device_async_transfer_result(struct libusb_transfer *transfer)
+{
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_INTERRUPTED;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+// Error on some transfer. Other transfers are cancelled,
+// r/w pass finishes when all of them complete.
+void device_async_set_error(struct device_async *async, int error)
+{
+	if (!async->error) {
+		async->error = error;
+		device_async_cancel(async);
+	}
+	if (!async->in_flight) {
+		async->active = 0;
+		async->pass_done = 1;
+	}
+}
+
+// Splits 'len' bytes into at most ASYNC_TRANSFERS_MAX chunks
+// of no less than ASYNC_CHUNK_LEN. Returns number of chunks.
+int device_async_split(struct async_transfer *xfer, int offset, int len)
+{
+	int chunk_len = ASYNC_CHUNK_LEN;
+	if (len > chunk_len * ASYNC_TRANSFERS_MAX) {
+		chunk_len = (len + ASYNC_TRANSFERS_MAX - 1) / ASYNC_TRANSFERS_MAX;
+		chunk_len = (chunk_len + 511) & ~511;
+	}
+
+	int count = 0;
+	while (len > 0) {
+		xfer[count].offset = offset;
+		xfer[count].len = len > chunk_len ? chunk_len : len;
+		xfer[count].actual_len = 0;
+		offset += xfer[count].len;
+		len -= xfer[count].len;
+		count++;
+	}
+	return count;
+}
+
+int device_async_submit(struct async_transfer *xfer)
+{
+	struct device_async *async = xfer->fpga_async->device_async;
+	int result = libusb_submit_transfer(xfer->transfer);
+	if (result < 0)
+		return result;
+	xfer->active = 1;
+	async->in_flight++;
+	return 0;
+}
+
+
+void device_async_setup_callback(struct libusb_transfer *transfer);
+void device_async_wr_callback(struct libusb_transfer *transfer);
+void device_async_rd_callback(struct libusb_transfer *transfer);
+void device_stream_next_fpga(struct device_async *async);
+
+// Start processing of FPGA #async->fpga_num or next one.
+// If there're no more FPGAs to process then r/w pass is finished.
+void device_async_next_fpga(struct device_async *async)
+{
+	struct device *device = async->device;
+
+	if (async->stream) {
+		device_stream_next_fpga(async);
+		return;
+	}
+
+	for ( ; async->fpga_num < device->num_of_fpgas; async->fpga_num++) {
+		struct fpga_async *fa = &async->fpga[async->fpga_num];
+		struct fpga *fpga = fa->fpga;
+
+		// Get input buffer
+		fa->input_buf = pkt_comm_input_get_buf(fpga->comm);
+		if (fpga->comm->error) {
+			device_async_set_error(async, -1);
+			return;
+		}
+		// Input buffer is full - skip r/w operation
+		if (!fa->input_buf) {
+			if (DEBUG) printf("#%d async: input buffer is full\n", fpga->num);
+			continue;
+		}
+
+		// fpga_select(), fpga_get_io_state(), fpga_setup_output() in 1 USB request
+		libusb_fill_control_setup(fa->setup_buf, 0xc0, 0x8C, fpga->num, 0,
+				sizeof(struct fpga_status));
+		libusb_fill_control_transfer(fa->setup_transfer, device->handle, fa->setup_buf,
+				device_async_setup_callback, fa, USB_CMD_TIMEOUT);
+		int result = libusb_submit_transfer(fa->setup_transfer);
+		if (result < 0) {
+			fprintf(stderr, "SN %s FPGA #%d async setup_io error: %d\n",
+				device->ztex_device->snString, fpga->num, result);
+			device_async_set_error(async, result);
+			return;
+		}
+		fa->setup_active = 1;
+		fa->state = FPGA_ASYNC_SETUP_IO;
+		async->in_flight++;
+		return;
+	}
+
+	// All FPGAs processed
+	async->active = 0;
+	async->pass_done = 1;
+}
+
+// Both OUT and IN transfers completed (or were not required)
+void device_async_fpga_done(struct fpga_async *fa)
+{
+	struct device_async *async = fa->device_async;
+	fa->state = FPGA_ASYNC_IDLE;
+	async->fpga_num++;
+	device_async_next_fpga(async);
+}
+
+void device_async_start(struct device_async *async)
+{
+	async->notify_events = 0;
+	async->active = 1;
+	async->pass_done = 0;
+	async->error = 0;
+	async->data_transferred = 0;
+	async->fpga_num = 0;
+	async->stream_first = async->stream_fpga + 1;
+	device_async_next_fpga(async);
+}
+
+// Submits IN transfers for the remaining part of read_limit
+int device_async_submit_read(struct fpga_async *fa)
+{
+	struct device *device = fa->fpga->device;
+	fa->rd_chunks = device_async_split(fa->rd, fa->rd_received,
+			fa->read_limit - fa->rd_received);
+
+	int i;
+	for (i = 0; i < fa->rd_chunks; i++) {
+		struct async_transfer *xfer = &fa->rd[i];
+		libusb_fill_bulk_transfer(xfer->transfer, device->handle, 0x82,
+				fa->input_buf + xfer->offset, xfer->len,
+				device_async_rd_callback, xfer, USB_RW_TIMEOUT);
+		int result = device_async_submit(xfer);
+		if (result < 0)
+			return result;
+		fa->rd_count++;
+	}
+	return 0;
+}
+
+// Submits OUT transfers with output data within FPGA's input credit
+// (status is received)
+int device_async_submit_write(struct fpga_async *fa)
+{
+	struct fpga *fpga = fa->fpga;
+
+	int input_full = fpga->wr.io_state.io_state & IO_STATE_INPUT_PROG_FULL;
+	if (input_full) {
+		// FPGA input is full - no write
+		if (DEBUG) printf("#%d async write: Input full\n", fpga->num);
+		return 0;
+	}
+
+	// Get output buffer, write no more than FPGA accepts
+	fa->output_len = 0;
+	fa->output_data = pkt_comm_get_output_data(fpga->comm, &fa->output_len);
+	fa->output_len = fpga_pkt_write_len(fpga, fa->output_len);
+	if (!fa->output_data || !fa->output_len)
+		return 0;
+
+	fa->wr_chunks = device_async_split(fa->wr, 0, fa->output_len);
+	int i;
+	for (i = 0; i < fa->wr_chunks; i++) {
+		struct async_transfer *xfer = &fa->wr[i];
+		libusb_fill_bulk_transfer(xfer->transfer, fpga->device->handle, 0x06,
+				fa->output_data + xfer->offset, xfer->len,
+				device_async_wr_callback, xfer, USB_RW_TIMEOUT);
+		int result = device_async_submit(xfer);
+		if (result < 0)
+			return result;
+		fa->wr_count++;
+	}
+	return 0;
+}
+
+void device_async_setup_callback(struct libusb_transfer *transfer)
+{
+	struct fpga_async *fa = transfer->user_data;
+	struct device_async *async = fa->device_async;
+	struct fpga *fpga = fa->fpga;
+	int result;
+
+	fa->setup_active = 0;
+	async->in_flight--;
+	if (async->error) {
+		device_async_set_error(async, async->error);
+		return;
+	}
+
+	result = device_async_transfer_result(transfer);
+	if (result < 0) {
+		fprintf(stderr, "SN %s FPGA #%d async setup_io error: %d\n",
+			async->device->ztex_device->snString, fpga->num, result);
+		device_async_set_error(async, result);
+		return;
+	}
+	fpga->cmd_count++;
+
+	struct fpga_status fpga_status;
+	int len = transfer->actual_length;
+	if (len > sizeof(fpga_status))
+		len = sizeof(fpga_status);
+	memcpy(&fpga_status, libusb_control_transfer_get_data(transfer), len);
+	result = fpga_update_status(fpga, &fpga_status, len);
+	if (result < 0) {
+		device_async_set_error(async, result);
+		return;
+	}
+
+	result = fpga_check_io_state(fpga);
+	if (result < 0) {
+		device_async_set_error(async, result);
+		return;
+	}
+
+	fa->state = FPGA_ASYNC_RW;
+
+	result = device_async_submit_write(fa);
+	if (result < 0) {
+		device_async_set_error(async, result);
+		return;
+	}
+
+	// OUT and IN transfers go simultaneously
+	fa->read_limit = fpga->rd.read_limit;
+	fa->rd_received = 0;
+	if (fa->read_limit) {
+		result = device_async_submit_read(fa);
+		if (result < 0) {
+			device_async_set_error(async, result);
+			return;
+		}
+	}
+
+	if (!fa->wr_count && !fa->rd_count)
+		device_async_fpga_done(fa);
+}
+
+void device_async_wr_callback(struct libusb_transfer *transfer)
+{
+	struct async_transfer *xfer = transfer->user_data;
+	struct fpga_async *fa = xfer->fpga_async;
+	struct device_async *async = fa->device_async;
+	struct fpga *fpga = fa->fpga;
+
+	xfer->active = 0;
+	xfer->actual_len = transfer->actual_length;
+	fa->wr_count--;
+	async->in_flight--;
+	if (async->error) {
+		device_async_set_error(async, async->error);
+		return;
+	}
+
+	int result = device_async_transfer_result(transfer);
+	if (DEBUG) printf("#%d async write: result=%d tx=%d/%d\n",
+			fpga->num, result, xfer->actual_len, xfer->len);
+	if (result < 0) {
+		device_async_set_error(async, result);
+		return;
+	}
+	if (xfer->actual_len != xfer->len) {
+		device_async_set_error(async, ERR_WR_PARTIAL);
+		return;
+	}
+
+	if (fa->wr_count)
+		return;
+
+	// All OUT transfers completed.
+	// Let pkt_comm register data transmit (clear buffers etc)
+	pkt_comm_output_completed(fpga->comm, fa->output_len, 0);
+	async->data_transferred = 1;
+	fa->wr_chunks = 0;
+
+	if (!fa->rd_count)
+		device_async_fpga_done(fa);
+}
+
+void device_async_rd_callback(struct libusb_transfer *transfer)
+{
+	struct async_transfer *xfer = transfer->user_data;
+	struct fpga_async *fa = xfer->fpga_async;
+	struct device_async *async = fa->device_async;
+	struct fpga *fpga = fa->fpga;
+
+	xfer->active = 0;
+	xfer->actual_len = transfer->actual_length;
+	fa->rd_count--;
+	async->in_flight--;
+	if (async->error) {
+		device_async_set_error(async, async->error);
+		return;
+	}
+
+	int result = device_async_transfer_result(transfer);
+	if (DEBUG) printf("#%d async read: result=%d, rx=%d/%d\n",
+			fpga->num, result, xfer->actual_len, xfer->len);
+	if (result < 0) {
+		device_async_set_error(async, result);
+		return;
+	}
+
+	if (fa->rd_count)
+		return;
+
+	// All IN transfers completed. Data is sequential in the stream;
+	// if some transfer was short, remove gaps between chunks.
+	int received = fa->rd_received;
+	int i;
+	for (i = 0; i < fa->rd_chunks; i++) {
+		struct async_transfer *chunk = &fa->rd[i];
+		if (received != chunk->offset && chunk->actual_len)
+			memmove(fa->input_buf + received, fa->input_buf + chunk->offset,
+					chunk->actual_len);
+		received += chunk->actual_len;
+	}
+
+	if (received == fa->rd_received) {
+		device_async_set_error(async, ERR_RD_ZEROREAD);
+		return;
+	}
+	fa->rd_received = received;
+
+	if (received != fa->read_limit) { // partial read
+		if (DEBUG) printf("#%d async PARTIAL READ: %d of %d\n",
+				fpga->num, received, fa->read_limit);
+		fpga->rd.partial_read_count++;
+		result = device_async_submit_read(fa);
+		if (result < 0)
+			device_async_set_error(async, result);
+		return;
+	}
+
+	// Read completed.
+	// Let pkt_comm handle data (process packets, place into input queue)
+	fa->rd_chunks = 0;
+	result = pkt_comm_input_completed(fpga->comm, fa->read_limit, 0);
+	if (result < 0) {
+		device_async_set_error(async, result);
+		return;
+	}
+	async->data_transferred = 1;
+
+	if (!fa->wr_count)
+		device_async_fpga_done(fa);
+}
+
+
+///////////////////////////////////////////////////////////////////
+//
+// Perform read/write operations on the device
+// using asynchronous I/O engine.
+//
+// - If the device is idle, r/w pass over all FPGAs is started
+// - Waits for USB events (for any device), processes completions
+// - Returns result when r/w pass on the device is finished
+//
+// Return values:
+// <0 - error (expecting caller to invalidate / reset the device)
+// 0 - no data was actually send or received, or r/w pass is in progress
+// >0 - success, some data was sent or received
+//
+///////////////////////////////////////////////////////////////////
+
+int device_pkt_rw_async(struct device *device)
+{
+	// Asynchronous engine is for USB only
+	if (device->transport != &device_transport_usb)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	struct device_async *async = device->async;
+	if (!async) {
+		async = device_async_new(device);
+		if (!async)
+			return -1;
+	}
+
+	// Stream mode: input that waited for space in input queue
+	if (async->stream) {
+		int result = device_stream_process(async);
+		if (result < 0)
+			device_async_set_error(async, result);
+	}
+
+	if (!async->active && !async->pass_done)
+		device_async_start(async);
+
+	if (async->active || async->stream) {
+		struct timeval tv = { 0, ASYNC_WAIT_USEC };
+		int result = libusb_handle_events_timeout(NULL, &tv);
+		if (result < 0 && result != LIBUSB_ERROR_INTERRUPTED) {
+			fprintf(stderr, "device_pkt_rw_async(): libusb_handle_events: %d (%s)\n",
+					result, libusb_strerror(result));
+			return result;
+		}
+	}
+
+	if (!async->pass_done)
+		return 0;
+	return device_async_result(async);
+}
+
+// Reports the result of finished r/w pass
+int device_async_result(struct device_async *async)
+{
+	async->pass_done = 0;
+	gettimeofday(&async->pass_time, NULL);
+	if (async->error)
+		return async->error;
+	if (async->stream_data) {
+		async->stream_data = 0;
+		async->data_transferred = 1;
+	}
+	return async->data_transferred;
+}
+
+
+///////////////////////////////////////////////////////////////////
+//
+// Event loop integration
+//
+// Application polls descriptors from device_get_pollfds()
+// with timeout from device_list_next_timeout(),
+// then calls device_list_advance().
+//
+///////////////////////////////////////////////////////////////////
+
+void device_async_notify_callback(struct libusb_transfer *transfer)
+{
+	struct device_async *async = transfer->user_data;
+	async->notify_active = 0;
+
+	int result = device_async_transfer_result(transfer);
+	if (!result && transfer->actual_length >= 2)
+		async->notify_events |= transfer->buffer[0] | transfer->buffer[1] << 8;
+	else if (result && result != LIBUSB_ERROR_INTERRUPTED) {
+		// Idle device is polled every device_async_idle_usec
+		fprintf(stderr, "SN %s: notification: %d (%s), disabled\n",
+			async->device->ztex_device->snString, result, libusb_strerror(result));
+		async->device->notify = 0;
+	}
+}
+
+int device_async_notify_submit(struct device_async *async)
+{
+	struct device *device = async->device;
+	if (!device->notify || async->notify_active)
+		return 0;
+
+	// No timeout, the transfer is cancelled by device_async_delete()
+	libusb_fill_interrupt_transfer(async->notify_transfer, device->handle, 0x81,
+			async->notify_buf, sizeof(async->notify_buf),
+			device_async_notify_callback, async, 0);
+	int result = libusb_submit_transfer(async->notify_transfer);
+	if (result < 0)
+		return result;
+	async->notify_active = 1;
+	return 0;
+}
+
+int device_async_next_pass_usec(struct device *device)
+{
+	struct device_async *async = device->async;
+	if (!async || async->pass_done)
+		return 0;
+	if (async->active)
+		return -1;
+	if (async->data_transferred)
+		return 0;
+
+	// Output held by pkt_comm (output_flush_usec) goes out
+	// when it's due
+	int hold_usec = -1;
+	int num;
+	for (num = 0; num < device->num_of_fpgas; num++) {
+		struct pkt_comm *comm = device->fpga[num].comm;
+		if (!pkt_comm_has_output_data(comm))
+			continue;
+		int usec = pkt_comm_output_hold_usec(comm);
+		if (!usec)
+			return 0;
+		if (hold_usec < 0 || usec < hold_usec)
+			hold_usec = usec;
+	}
+
+	// Nothing to send. Poll FPGAs for output every device_async_idle_usec,
+	// with notification: when the device reports an event
+	if (async->notify_events)
+		return 0;
+	int idle_usec = async->notify_active ? device_async_notify_usec
+			: device_async_idle_usec;
+
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	long long elapsed = (tv.tv_sec - async->pass_time.tv_sec) * 1000000LL
+			+ tv.tv_usec - async->pass_time.tv_usec;
+	if (elapsed >= idle_usec)
+		return 0;
+	if (hold_usec >= 0 && hold_usec < idle_usec - elapsed)
+		return hold_usec;
+	return idle_usec - elapsed;
+}
+
+int device_async_advance(struct device *device)
+{
+	if (device->transport != &device_transport_usb)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	struct device_async *async = device->async;
+	if (!async) {
+		async = device_async_new(device);
+		if (!async)
+			return -1;
+	}
+
+	int result = device_async_notify_submit(async);
+	if (result < 0)
+		return result;
+
+	if (async->stream) {
+		result = device_stream_process(async);
+		if (result < 0)
+			device_async_set_error(async, result);
+	}
+
+	if (!async->active && !async->pass_done
+			&& !device_async_next_pass_usec(device))
+		device_async_start(async);
+
+	if (!async->pass_done)
+		return 0;
+	return device_async_result(async);
+}
+
+int device_get_pollfds(struct pollfd *fds, int max_fds)
+{
+	const struct libusb_pollfd **pollfds = libusb_get_pollfds(NULL);
+	if (!pollfds) {
+		fprintf(stderr, "device_get_pollfds(): libusb_get_pollfds failed\n");
+		return -1;
+	}
+
+	int count = 0;
+	int i;
+	for (i = 0; pollfds[i] && count < max_fds; i++) {
+		fds[count].fd = pollfds[i]->fd;
+		fds[count].events = pollfds[i]->events;
+		fds[count].revents = 0;
+		count++;
+	}
+	libusb_free_pollfds(pollfds);
+	return count;
+}
+
+int device_list_next_timeout(struct device_list *device_list)
+{
+	int usec = ztex_scan_next_usec();
+
+	struct timeval tv;
+	if (libusb_get_next_timeout(NULL, &tv) == 1) {
+		long long libusb_usec = tv.tv_sec * 1000000LL + tv.tv_usec;
+		if (libusb_usec < usec)
+			usec = libusb_usec;
+	}
+
+	struct device *device;
+	for (device = device_list->device; device; device = device->next) {
+		if (!device_valid(device) || device->transport != &device_transport_usb)
+			continue;
+		int pass_usec = device_async_next_pass_usec(device);
+		if (pass_usec >= 0 && pass_usec < usec)
+			usec = pass_usec;
+	}
+	return usec;
+}
+
+int device_list_advance(struct device_list *device_list)
+{
+	// Process USB events that are ready
+	struct timeval tv = { 0, 0 };
+	int result = libusb_handle_events_timeout(NULL, &tv);
+	if (result < 0 && result != LIBUSB_ERROR_INTERRUPTED) {
+		fprintf(stderr, "device_list_advance(): libusb_handle_events: %d (%s)\n",
+				result, libusb_strerror(result));
+		return result;
+	}
+
+	int count = 0;
+	struct device *device;
+	for (device = device_list->device; device; device = device->next) {
+		// Devices on other transports have no descriptors to poll,
+		// the caller performs r/w on them with device_pkt_rw()
+		if (!device_valid(device) || device->transport != &device_transport_usb)
+			continue;
+
+		result = device_async_advance(device);
+		if (result < 0) {
+			fprintf(stderr, "SN %s device_async_advance(): %d (%s)\n",
+				device->ztex_device->snString, result, libusb_strerror(result) );
+			device_invalidate(device);
+			continue;
+		}
+		if (result > 0)
+			count++;
+	}
+	return count;
+}
+
+
+///////////////////////////////////////////////////////////////////
+//
+// Stream mode. The selected FPGA has output limit off and pushes
+// output into EP2 as it comes, IN transfers are kept posted.
+// There's no output limit request per read: output of the FPGA
+// is a segment ended with zero-length packet when the host switches
+// to other FPGA (VR 0x93). Within a segment, boundaries of packets
+// are from pkt_comm framing, packets can be split between segments.
+//
+///////////////////////////////////////////////////////////////////
+
+int device_stream_owner_push(struct device_async *async, int num)
+{
+	if (async->stream_owner_count == STREAM_OWNERS_MAX)
+		return -1;
+	async->stream_owner[(async->stream_owner_first + async->stream_owner_count)
+			% STREAM_OWNERS_MAX] = num;
+	async->stream_owner_count++;
+	return 0;
+}
+
+int device_stream_input(struct device_async *async,
+		struct stream_transfer *xfer)
+{
+	while (xfer->offset < xfer->len) {
+		// Data after ZLP is from FPGA the host switches to,
+		// VR 0x93 reply may come after the data
+		if (!async->stream_owner_count)
+			return 0;
+		struct fpga *fpga = &async->device->fpga[
+				async->stream_owner[async->stream_owner_first] ];
+		struct pkt_comm *comm = fpga->comm;
+
+		unsigned char *input_buf = pkt_comm_input_get_buf(comm);
+		if (comm->error)
+			return -1;
+		if (!input_buf)
+			return 0;
+
+		int len = xfer->len - xfer->offset;
+		if (len > comm->params->input_max_len)
+			len = comm->params->input_max_len;
+		memcpy(input_buf, xfer->buf + xfer->offset, len);
+		int result = pkt_comm_input_completed(comm, len, 0);
+		if (result < 0)
+			return result;
+
+		xfer->offset += len;
+		fpga->rd.read_count++;
+		async->stream_data = 1;
+	}
+
+	if (xfer->zlp) {
+		if (!async->stream_owner_count) {
+			fprintf(stderr, "SN %s stream: zero-length packet"
+				" with no segment expected\n", async->device->ztex_device->snString);
+			return -1;
+		}
+		async->stream_owner_first = (async->stream_owner_first + 1)
+				% STREAM_OWNERS_MAX;
+		async->stream_owner_count--;
+		xfer->zlp = 0;
+	}
+	return 1;
+}
+
+void device_stream_rd_callback(struct libusb_transfer *transfer);
+
+int device_stream_submit(struct stream_transfer *xfer)
+{
+	struct device_async *async = xfer->device_async;
+
+	// No timeout, the transfer is cancelled when stream mode is disabled
+	libusb_fill_bulk_transfer(xfer->transfer, async->device->handle, 0x82,
+			xfer->buf, STREAM_READ_LEN, device_stream_rd_callback, xfer, 0);
+	int result = libusb_submit_transfer(xfer->transfer);
+	if (result < 0)
+		return result;
+	xfer->active = 1;
+	async->stream_in_flight++;
+	return 0;
+}
+
+void device_stream_rd_callback(struct libusb_transfer *transfer)
+{
+	struct stream_transfer *xfer = transfer->user_data;
+	struct device_async *async = xfer->device_async;
+
+	xfer->active = 0;
+	async->stream_in_flight--;
+	if (async->error || !async->stream)
+		return;
+
+	int result = device_async_transfer_result(transfer);
+	if (result < 0) {
+		fprintf(stderr, "SN %s stream read error: %d (%s)\n",
+			async->device->ztex_device->snString, result, libusb_strerror(result));
+		device_async_set_error(async, result);
+		return;
+	}
+
+	// Transfer ends with a short packet or when it's full.
+	// Short packet from FPGA (PKTEND) isn't a multiple of 512 bytes.
+	xfer->len = transfer->actual_length;
+	xfer->offset = 0;
+	xfer->zlp = xfer->len < transfer->length && !(xfer->len % 512);
+	xfer->done = 1;
+
+	result = device_stream_process(async);
+	if (result < 0)
+		device_async_set_error(async, result);
+}
+
+int device_stream_process(struct device_async *async)
+{
+	while (async->stream) {
+		struct stream_transfer *xfer = &async->stream_rd[async->stream_rd_next];
+		if (!xfer->done)
+			break;
+
+		int result = device_stream_input(async, xfer);
+		if (result <= 0)
+			return result;
+
+		xfer->done = 0;
+		result = device_stream_submit(xfer);
+		if (result < 0)
+			return result;
+		async->stream_rd_next = (async->stream_rd_next + 1) % STREAM_TRANSFERS;
+	}
+	return 0;
+}
+
+void device_stream_switch_callback(struct libusb_transfer *transfer);
+
+// Stream mode: FPGAs are visited starting with the one after the
+// streaming FPGA, so the pass ends on the streaming one and it
+// remains selected. The streaming FPGA isn't visited if there's
+// no output data for it. An FPGA which input in the host
+// is full isn't switched to, that would hold IN transfers.
+void device_stream_next_fpga(struct device_async *async)
+{
+	struct device *device = async->device;
+
+	for ( ; async->fpga_num < device->num_of_fpgas; async->fpga_num++) {
+		int num = (async->stream_first + async->fpga_num) % device->num_of_fpgas;
+		struct fpga_async *fa = &async->fpga[num];
+		struct fpga *fpga = fa->fpga;
+
+		// Process input that waited for space in input queue
+		pkt_comm_input_get_buf(fpga->comm);
+		if (fpga->comm->error) {
+			device_async_set_error(async, -1);
+			return;
+		}
+
+		if (num == async->stream_fpga) {
+			if (!pkt_comm_has_output_data(fpga->comm))
+				continue;
+		} else {
+			if (pkt_comm_input_full(fpga->comm))
+				continue;
+			// Segments of previous switches aren't received yet
+			if (async->stream_owner_count == STREAM_OWNERS_MAX)
+				break;
+		}
+
+		// Switch to the FPGA (or status of the streaming FPGA) in 1 request
+		libusb_fill_control_setup(fa->setup_buf, 0xc0, 0x93, num, 0,
+				sizeof(struct fpga_status));
+		libusb_fill_control_transfer(fa->setup_transfer, device->handle, fa->setup_buf,
+				device_stream_switch_callback, fa, USB_CMD_TIMEOUT);
+		int result = libusb_submit_transfer(fa->setup_transfer);
+		if (result < 0) {
+			fprintf(stderr, "SN %s FPGA #%d stream switch error: %d\n",
+				device->ztex_device->snString, fpga->num, result);
+			device_async_set_error(async, result);
+			return;
+		}
+		fa->setup_active = 1;
+		fa->state = FPGA_ASYNC_SETUP_IO;
+		async->in_flight++;
+		return;
+	}
+
+	// All FPGAs processed
+	async->active = 0;
+	async->pass_done = 1;
+}
+
+void device_stream_switch_callback(struct libusb_transfer *transfer)
+{
+	struct fpga_async *fa = transfer->user_data;
+	struct device_async *async = fa->device_async;
+	struct fpga *fpga = fa->fpga;
+	int result;
+
+	fa->setup_active = 0;
+	async->in_flight--;
+	if (async->error) {
+		device_async_set_error(async, async->error);
+		return;
+	}
+
+	result = device_async_transfer_result(transfer);
+	if (result < 0) {
+		fprintf(stderr, "SN %s FPGA #%d stream switch error: %d\n",
+			async->device->ztex_device->snString, fpga->num, result);
+		device_async_set_error(async, result);
+		return;
+	}
+	fpga->cmd_count++;
+
+	int len = transfer->actual_length;
+	if (!len) {
+		// Output of the streaming FPGA isn't ended yet (EP2 buffers
+		// are full). The switch is repeated at next r/w pass.
+		if (DEBUG) printf("#%d stream: switch isn't completed\n", fpga->num);
+		fa->state = FPGA_ASYNC_IDLE;
+		async->active = 0;
+		async->pass_done = 1;
+		return;
+	}
+
+	if (fpga->num != async->stream_fpga) {
+		device_stream_owner_push(async, fpga->num);
+		async->stream_fpga = fpga->num;
+		async->device->selected_fpga = fpga->num;
+		// Data from the FPGA may have come before the reply
+		result = device_stream_process(async);
+		if (result < 0) {
+			device_async_set_error(async, result);
+			return;
+		}
+	}
+
+	struct fpga_status fpga_status;
+	if (len > sizeof(fpga_status))
+		len = sizeof(fpga_status);
+	memcpy(&fpga_status, libusb_control_transfer_get_data(transfer), len);
+	result = fpga_update_status(fpga, &fpga_status, len);
+	if (result < 0) {
+		device_async_set_error(async, result);
+		return;
+	}
+
+	// The status isn't preceded by I/O timeout wait: output limit is off
+	// (IO_STATE_LIMIT_NOT_DONE while there's output), Slave FIFO
+	// may have input not read by the FPGA yet. input_free doesn't
+	// account for that input - no write then.
+	if (fpga->wr.io_state.io_state & IO_STATE_SFIFO_NOT_EMPTY)
+		fpga->wr.credit = 0;
+	fpga->wr.io_state.io_state &= ~(IO_STATE_LIMIT_NOT_DONE
+			| IO_STATE_SFIFO_NOT_EMPTY);
+	result = fpga_check_io_state(fpga);
+	if (result < 0) {
+		device_async_set_error(async, result);
+		return;
+	}
+
+	fa->state = FPGA_ASYNC_RW;
+	if (fpga->wr.credit > 0) {
+		result = device_async_submit_write(fa);
+		if (result < 0) {
+			device_async_set_error(async, result);
+			return;
+		}
+	}
+
+	if (!fa->wr_count)
+		device_async_fpga_done(fa);
+}
+
+void device_stream_delete(struct device_async *async)
+{
+	if (!async->stream_rd)
+		return;
+
+	async->stream = 0;
+	int i;
+	for (i = 0; i < STREAM_TRANSFERS; i++)
+		if (async->stream_rd[i].active)
+			libusb_cancel_transfer(async->stream_rd[i].transfer);
+	while (async->stream_in_flight) {
+		int result = libusb_handle_events(NULL);
+		if (result < 0 && result != LIBUSB_ERROR_INTERRUPTED)
+			break;
+	}
+
+	for (i = 0; i < STREAM_TRANSFERS; i++)
+		if (async->stream_rd[i].transfer)
+			libusb_free_transfer(async->stream_rd[i].transfer);
+	free(async->stream_rd);
+	async->stream_rd = NULL;
+	async->stream_fpga = -1;
+	async->stream_owner_count = 0;
+}
+
+// Ends the output of the streaming FPGA, passes the rest of the data
+// to pkt_comm, disables stream mode in the firmware.
+int device_stream_disable(struct device_async *async)
+{
+	struct device *device = async->device;
+	struct fpga_status fpga_status;
+	int result;
+	int i;
+
+	// While EP2 buffers are full, the firmware replies with 0 bytes:
+	// IN transfers take the data, the request is repeated
+	for (i = 0; ; i++) {
+		result = device->transport->control(device, 0x93, 0xFF, 0,
+				(unsigned char *)&fpga_status, sizeof(fpga_status));
+		if (result < 0)
+			return result;
+		if (result > 0)
+			break;
+		if (i == STREAM_END_RETRIES)
+			return LIBUSB_ERROR_TIMEOUT;
+
+		struct timeval tv = { 0, ASYNC_WAIT_USEC };
+		result = libusb_handle_events_timeout(NULL, &tv);
+		if (result < 0 && result != LIBUSB_ERROR_INTERRUPTED)
+			return result;
+	}
+	async->stream_fpga = -1;
+
+	// Data up to the last ZLP
+	for (i = 0; async->stream_owner_count; i++) {
+		if (async->error)
+			return async->error;
+		result = device_stream_process(async);
+		if (result < 0)
+			return result;
+		if (!async->stream_owner_count)
+			break;
+		if (i == STREAM_END_RETRIES)
+			return LIBUSB_ERROR_TIMEOUT;
+
+		struct timeval tv = { 0, ASYNC_WAIT_USEC };
+		result = libusb_handle_events_timeout(NULL, &tv);
+		if (result < 0 && result != LIBUSB_ERROR_INTERRUPTED)
+			return result;
+	}
+
+	result = device->transport->control(device, 0x92, 0, 0, NULL, 0);
+	if (result < 0)
+		return result;
+	device_stream_delete(async);
+	return 0;
+}
+
+int device_stream_enable(struct device *device, int enable)
+{
+	struct device_async *async = device->async;
+	int result;
+	int num, i;
+
+	if (!enable) {
+		if (!async || !async->stream)
+			return 0;
+		if (async->active)
+			return LIBUSB_ERROR_BUSY;
+		return device_stream_disable(async);
+	}
+
+	if (async && async->stream)
+		return 1;
+	if (device->transport != &device_transport_usb || device->mux
+			|| device->notify)
+		return 0;
+	// Capabilities are from fpga_test_get_id()
+	for (num = 0; num < device->num_of_fpgas; num++)
+		if (!(device->fpga[num].caps & FPGA_CAP_STREAM))
+			return 0;
+
+	if (!async) {
+		async = device_async_new(device);
+		if (!async)
+			return -1;
+	}
+	if (async->active)
+		return LIBUSB_ERROR_BUSY;
+
+	async->stream_rd = malloc(STREAM_TRANSFERS * sizeof(struct stream_transfer));
+	if (!async->stream_rd) {
+		fprintf(stderr, "device_stream_enable(): unable to allocate %d bytes\n",
+				(int)(STREAM_TRANSFERS * sizeof(struct stream_transfer)));
+		return -1;
+	}
+	for (i = 0; i < STREAM_TRANSFERS; i++) {
+		struct stream_transfer *xfer = &async->stream_rd[i];
+		xfer->device_async = async;
+		xfer->done = 0;
+		xfer->active = 0;
+		xfer->transfer = libusb_alloc_transfer(0);
+	}
+	for (i = 0; i < STREAM_TRANSFERS; i++)
+		if (!async->stream_rd[i].transfer) {
+			fprintf(stderr, "device_stream_enable(): libusb_alloc_transfer failed\n");
+			device_stream_delete(async);
+			return -1;
+		}
+
+	result = device->transport->control(device, 0x92, device->num_of_fpgas,
+			0, NULL, 0);
+	// The firmware doesn't support stream mode
+	if (result == LIBUSB_ERROR_PIPE) {
+		device_stream_delete(async);
+		return 0;
+	}
+	if (result < 0) {
+		device_stream_delete(async);
+		return result;
+	}
+
+	async->stream = 1;
+	async->stream_fpga = -1;
+	async->stream_rd_next = 0;
+	async->stream_owner_first = 0;
+	async->stream_owner_count = 0;
+	async->stream_data = 0;
+	for (i = 0; i < STREAM_TRANSFERS; i++) {
+		result = device_stream_submit(&async->stream_rd[i]);
+		if (result < 0)
+			return result;
+	}
+	return 1;
+}
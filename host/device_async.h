@@ -0,0 +1,182 @@
+// ***************************************************************
+//
+// Asynchronous I/O engine for packet communication (pkt_comm)
+//
+// * Built on libusb_submit_transfer()
+// * Several OUT and IN transfers are kept in flight per device
+// * Each FPGA has a completion-driven state machine:
+//   SETUP_IO (VR 0x8C) -> RW (OUT & IN transfers) -> next FPGA
+// * FPGAs of one device are processed one at a time. All FPGAs
+//   share the Slave FIFO and the chip select, the firmware switches
+//   to other FPGA regardless of data left in EP2/EP6 buffers.
+//   If transfers to FPGA n+1 were queued while IN transfers from n
+//   are in flight, data would go to (come from) the wrong FPGA.
+//   Overlap within the device is between OUT and IN transfers
+//   of the selected FPGA, up to ASYNC_TRANSFERS_MAX in each direction.
+// * Transfers to different devices are performed simultaneously
+// * With notification enabled, an interrupt transfer (EP1 IN)
+//   is kept in flight, idle device is visited when it reports an event
+// * Stream mode (device_stream_enable()): IN transfers are kept
+//   posted regardless of r/w pass. The FPGA selected with VR 0x93
+//   has output limit off, its output goes as it comes. Before
+//   the switch to other FPGA, the firmware ends the output with
+//   zero-length packet. IN transfer that ends with ZLP (a multiple
+//   of 512 bytes, less than requested) ends the segment of the FPGA;
+//   within a segment, packet boundaries are from pkt_comm framing.
+//   R/w pass: VR 0x93 (switch, status) -> OUT transfers -> next FPGA.
+//
+// Application uses device_pkt_rw_async() (see device.h)
+// instead of device_pkt_rw().
+//
+// ***************************************************************
+
+// Max. number of transfers in flight in each direction
+#define ASYNC_TRANSFERS_MAX	4
+
+// Bulk transfers are split into chunks of no less than that size.
+// Must be a multiple of USB max. packet size (512).
+#define ASYNC_CHUNK_LEN	4096
+
+// Stream mode: number of IN transfers kept posted and their length.
+// Must be a multiple of USB max. packet size (512), no more than 16 KB
+// (libusb on Linux splits larger transfers, short packet handling
+// then differs).
+#define STREAM_TRANSFERS	4
+#define STREAM_READ_LEN		16384
+
+// Stream mode: max. number of segments expected (the current one
+// and switches which ZLP wasn't received for)
+#define STREAM_OWNERS_MAX	8
+
+// Stream mode: VR 0x93 is repeated that many times (with events
+// processed for ASYNC_WAIT_USEC in between) when stream mode is disabled
+#define STREAM_END_RETRIES	100
+
+// fpga_async.state
+#define FPGA_ASYNC_IDLE		0
+#define FPGA_ASYNC_SETUP_IO	1
+#define FPGA_ASYNC_RW		2
+
+struct async_transfer {
+	struct libusb_transfer *transfer;
+	struct fpga_async *fpga_async;
+	int offset;			// offset in the data buffer
+	int len;
+	int actual_len;
+	int active;			// submitted, completion not processed yet
+};
+
+struct fpga_async {
+	struct fpga *fpga;
+	struct device_async *device_async;
+	int state;
+
+	// VR 0x8C: fpga_select_setup_io()
+	struct libusb_transfer *setup_transfer;
+	unsigned char setup_buf[LIBUSB_CONTROL_SETUP_SIZE + sizeof(struct fpga_status)];
+	int setup_active;
+
+	// write: data from pkt_comm_get_output_data()
+	unsigned char *output_data;
+	int output_len;
+	int wr_chunks;		// number of OUT transfers submitted
+	int wr_count;		// number of OUT transfers in flight
+	struct async_transfer wr[ASYNC_TRANSFERS_MAX];
+
+	// read: buffer from pkt_comm_input_get_buf()
+	unsigned char *input_buf;
+	int read_limit;
+	int rd_received;	// bytes received in previous rounds
+	int rd_chunks;		// number of IN transfers submitted in current round
+	int rd_count;		// number of IN transfers in flight
+	struct async_transfer rd[ASYNC_TRANSFERS_MAX];
+};
+
+struct stream_transfer {
+	struct libusb_transfer *transfer;
+	struct device_async *device_async;
+	int len;			// bytes received
+	int offset;			// bytes passed to pkt_comm
+	int zlp;			// ended with zero-length packet
+	int done;			// completed, data isn't processed yet
+	int active;			// submitted, completion not processed yet
+	unsigned char buf[STREAM_READ_LEN];
+};
+
+struct device_async {
+	struct device *device;
+	int fpga_num;		// FPGA currently processed
+	int active;			// r/w pass is in progress
+	int pass_done;		// r/w pass finished, result not reported yet
+	int in_flight;		// total number of transfers in flight
+	int error;
+	int data_transferred;
+	struct timeval pass_time;	// time the result of last r/w pass was reported
+	struct fpga_async fpga[DEVICE_FPGAS_MAX];
+
+	// notification (device_notify_enable()), not a part of r/w pass
+	struct libusb_transfer *notify_transfer;
+	unsigned char notify_buf[64];
+	int notify_active;		// submitted, completion not processed yet
+	int notify_events;		// reported after the last r/w pass started
+
+	// stream mode (device_stream_enable()), IN transfers aren't
+	// a part of r/w pass
+	int stream;				// stream mode is enabled
+	int stream_fpga;		// FPGA selected with the last switch, -1 if none
+	int stream_first;		// r/w pass starts with that FPGA
+	struct stream_transfer *stream_rd;	// STREAM_TRANSFERS, NULL if disabled
+	int stream_rd_next;		// processed next (in order of submission)
+	int stream_in_flight;
+	// FPGAs the segments are from, the first one is current
+	int stream_owner[STREAM_OWNERS_MAX];
+	int stream_owner_first;
+	int stream_owner_count;
+	int stream_data;		// data passed to pkt_comm after last result
+};
+
+// Creates engine state for the device (stored in device->async)
+struct device_async *device_async_new(struct device *device);
+
+// Cancels transfers in flight, waits for cancellation
+// and deletes engine state. Invoked from device_invalidate().
+void device_async_delete(struct device *device);
+
+// Converts transfer status into libusb error code
+int device_async_transfer_result(struct libusb_transfer *transfer);
+
+// Reports the result of finished r/w pass
+int device_async_result(struct device_async *async);
+
+// Keeps interrupt transfer for notification in flight
+// if notification is enabled
+int device_async_notify_submit(struct device_async *async);
+
+// Returns microseconds until next r/w pass on the device is due:
+// 0 if there's output data or previous pass transferred some data,
+// -1 if r/w pass is in progress (waits for USB events).
+int device_async_next_pass_usec(struct device *device);
+
+// Stream mode: adds FPGA the next segment is from.
+// Returns < 0 if there're STREAM_OWNERS_MAX segments already.
+int device_stream_owner_push(struct device_async *async, int num);
+
+// Stream mode: passes data of completed IN transfer to pkt_comm
+// of FPGA the current segment is from, ZLP ends the segment.
+// Returns 1 if the transfer is processed, 0 if it waits (FPGA's input
+// is full or switch to the FPGA isn't completed yet), < 0 on error.
+int device_stream_input(struct device_async *async,
+		struct stream_transfer *xfer);
+
+// Stream mode: processes completed IN transfers in order
+// of submission, resubmits them. Returns < 0 on error.
+int device_stream_process(struct device_async *async);
+
+// Stream mode: cancels IN transfers, waits for cancellation,
+// frees them. Invoked from device_async_delete().
+void device_stream_delete(struct device_async *async);
+
+// Starts r/w pass if it's due, doesn't wait for USB events.
+// Return values are same as for device_pkt_rw_async()
+// (LIBUSB_ERROR_NOT_SUPPORTED if the device isn't on USB transport).
+int device_async_advance(struct device *device);
@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <libusb-1.0/libusb.h>
+
+#include "ztex.h"
+#include "inouttraffic.h"
+#include "pkt_comm/pkt_comm.h"
+#include "pkt_comm/pkt_spsc_queue.h"
+#include "pkt_comm/pkt_pool.h"
+#include "device.h"
+#include "device_worker.h"
+
+
+// Moves packets between handoff queues and pkt_comm queues.
+// Worker is the consumer of output queues and the producer
+// of input queues.
+void worker_device_handoff(struct worker_device *wd)
+{
+	struct device *device = wd->device;
+	int i;
+	for (i = 0; i < device->num_of_fpgas; i++) {
+		struct pkt_comm *comm = device->fpga[i].comm;
+		struct pkt *pkt;
+
+		while (!pkt_queue_full(comm->output_queue, 1)
+				&& (pkt = pkt_spsc_queue_fetch(wd->output_queue[i])) )
+			pkt_queue_push(comm->output_queue, pkt);
+
+		while (!pkt_spsc_queue_full(wd->input_queue[i], 1)
+				&& (pkt = pkt_queue_fetch(comm->input_queue)) )
+			pkt_spsc_queue_push(wd->input_queue[i], pkt);
+	}
+}
+
+void *device_worker_thread(void *arg)
+{
+	struct device_worker *worker = arg;
+
+	while (!worker->stop) {
+		// Devices are added at the head of the list; worker
+		// is not affected by additions once it got the head.
+		pthread_mutex_lock(&worker->mutex);
+		struct worker_device *wd = worker->worker_device;
+		pthread_mutex_unlock(&worker->mutex);
+
+		int data_transferred = 0;
+		for ( ; wd; wd = wd->next) {
+			struct device *device = wd->device;
+			if (wd->error || !device_valid(device))
+				continue;
+
+			worker_device_handoff(wd);
+
+			int result = device_pkt_rw(device);
+			if (result < 0) {
+				fprintf(stderr, "SN %s device_pkt_rw(): %d (%s)\n",
+					device->ztex_device->snString, result, libusb_strerror(result) );
+				// Worker no longer touches the device,
+				// application thread invalidates it
+				// (device_worker_list_check())
+				__atomic_store_n(&wd->error, result, __ATOMIC_RELEASE);
+				continue;
+			}
+			if (result > 0)
+				data_transferred = 1;
+
+			// Results go to the application without waiting for next pass
+			worker_device_handoff(wd);
+		}
+
+		worker->loop_count++;
+		if (!data_transferred)
+			usleep(DEVICE_WORKER_IDLE_USEC);
+	}
+	return NULL;
+}
+
+struct device_worker *device_worker_new(int busnum)
+{
+	struct device_worker *worker = malloc(sizeof(struct device_worker));
+	if (!worker) {
+		fprintf(stderr, "device_worker_new(): unable to allocate %d bytes\n",
+				(int)sizeof(struct device_worker));
+		return NULL;
+	}
+	pthread_mutex_init(&worker->mutex, NULL);
+	worker->busnum = busnum;
+	worker->stop = 0;
+	worker->worker_device = NULL;
+	worker->next = NULL;
+	worker->loop_count = 0;
+	return worker;
+}
+
+void worker_device_delete(struct worker_device *wd)
+{
+	int i;
+	for (i = 0; i < DEVICE_FPGAS_MAX; i++) {
+		if (wd->output_queue[i])
+			pkt_spsc_queue_delete(wd->output_queue[i]);
+		if (wd->input_queue[i])
+			pkt_spsc_queue_delete(wd->input_queue[i]);
+	}
+	if (wd->device->worker == wd)
+		wd->device->worker = NULL;
+	free(wd);
+}
+
+int worker_device_new(struct device_worker *worker, struct device *device)
+{
+	struct worker_device *wd = malloc(sizeof(struct worker_device));
+	if (!wd) {
+		fprintf(stderr, "worker_device_new(): unable to allocate %d bytes\n",
+				(int)sizeof(struct worker_device));
+		return -1;
+	}
+	wd->device = device;
+	wd->worker = worker;
+	wd->error = 0;
+
+	int ok = 1;
+	int i;
+	for (i = 0; i < DEVICE_FPGAS_MAX; i++) {
+		wd->output_queue[i] = NULL;
+		wd->input_queue[i] = NULL;
+		if (i >= device->num_of_fpgas)
+			continue;
+		wd->output_queue[i] = pkt_spsc_queue_new(DEVICE_WORKER_QUEUE_SIZE);
+		wd->input_queue[i] = pkt_spsc_queue_new(DEVICE_WORKER_QUEUE_SIZE);
+		if (!wd->output_queue[i] || !wd->input_queue[i])
+			ok = 0;
+	}
+	if (!ok) {
+		worker_device_delete(wd);
+		return -1;
+	}
+
+	// Worker thread allocates input packets, application deletes them
+	for (i = 0; i < device->num_of_fpgas; i++)
+		pkt_pool_set_shared(device->fpga[i].comm->pool);
+
+	device->worker = wd;
+	pthread_mutex_lock(&worker->mutex);
+	wd->next = worker->worker_device;
+	worker->worker_device = wd;
+	pthread_mutex_unlock(&worker->mutex);
+	return 0;
+}
+
+struct device_worker_list *device_worker_list_new(struct device_list *device_list, int mode)
+{
+	struct device_worker_list *worker_list = malloc(sizeof(struct device_worker_list));
+	if (!worker_list) {
+		fprintf(stderr, "device_worker_list_new(): unable to allocate %d bytes\n",
+				(int)sizeof(struct device_worker_list));
+		return NULL;
+	}
+	worker_list->mode = mode;
+	worker_list->worker = NULL;
+
+	if (device_worker_list_add(worker_list, device_list) < 0) {
+		device_worker_list_delete(worker_list);
+		return NULL;
+	}
+	return worker_list;
+}
+
+int device_worker_list_add(struct device_worker_list *worker_list, struct device_list *device_list)
+{
+	int count = 0;
+	struct device *device;
+	for (device = device_list->device; device; device = device->next) {
+		if (!device_valid(device) || device->worker)
+			continue;
+
+		int busnum = device->ztex_device->busnum;
+		struct device_worker *worker = NULL;
+		if (worker_list->mode == DEVICE_WORKER_PER_BUS)
+			for (worker = worker_list->worker; worker; worker = worker->next)
+				if (worker->busnum == busnum)
+					break;
+
+		if (worker) {
+			if (worker_device_new(worker, device) < 0)
+				return -1;
+			count++;
+			continue;
+		}
+
+		worker = device_worker_new(worker_list->mode == DEVICE_WORKER_PER_BUS
+				? busnum : -1);
+		if (!worker)
+			return -1;
+		if (worker_device_new(worker, device) < 0) {
+			free(worker);
+			return -1;
+		}
+
+		int result = pthread_create(&worker->thread, NULL, device_worker_thread, worker);
+		if (result) {
+			fprintf(stderr, "device_worker_list_add(): pthread_create: %d\n", result);
+			worker_device_delete(worker->worker_device);
+			free(worker);
+			return -1;
+		}
+		worker->next = worker_list->worker;
+		worker_list->worker = worker;
+		count++;
+	}
+	return count;
+}
+
+int device_worker_list_check(struct device_worker_list *worker_list)
+{
+	int count = 0;
+	struct device_worker *worker;
+	for (worker = worker_list->worker; worker; worker = worker->next) {
+		pthread_mutex_lock(&worker->mutex);
+		struct worker_device *wd = worker->worker_device;
+		pthread_mutex_unlock(&worker->mutex);
+
+		for ( ; wd; wd = wd->next) {
+			if (!__atomic_load_n(&wd->error, __ATOMIC_ACQUIRE)
+					|| !device_valid(wd->device))
+				continue;
+			device_invalidate(wd->device);
+			count++;
+		}
+	}
+	return count;
+}
+
+void device_worker_list_delete(struct device_worker_list *worker_list)
+{
+	struct device_worker *worker, *worker_next;
+	for (worker = worker_list->worker; worker; worker = worker->next)
+		worker->stop = 1;
+
+	for (worker = worker_list->worker; worker; worker = worker_next) {
+		worker_next = worker->next;
+		pthread_join(worker->thread, NULL);
+
+		struct worker_device *wd, *wd_next;
+		for (wd = worker->worker_device; wd; wd = wd_next) {
+			wd_next = wd->next;
+			if (wd->error)
+				device_invalidate(wd->device);
+			worker_device_delete(wd);
+		}
+		pthread_mutex_destroy(&worker->mutex);
+		free(worker);
+	}
+	free(worker_list);
+}
+
+int fpga_worker_pkt_push(struct fpga *fpga, struct pkt *pkt)
+{
+	struct worker_device *wd = fpga->device->worker;
+	if (!wd || __atomic_load_n(&wd->error, __ATOMIC_ACQUIRE))
+		return -1;
+
+	return pkt_spsc_queue_push(wd->output_queue[fpga->num], pkt);
+}
+
+int fpga_worker_pkt_queue_full(struct fpga *fpga, int num)
+{
+	struct worker_device *wd = fpga->device->worker;
+	if (!wd)
+		return 1;
+
+	return pkt_spsc_queue_full(wd->output_queue[fpga->num], num);
+}
+
+struct pkt *fpga_worker_pkt_fetch(struct fpga *fpga)
+{
+	struct worker_device *wd = fpga->device->worker;
+	if (!wd || __atomic_load_n(&wd->error, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return pkt_spsc_queue_fetch(wd->input_queue[fpga->num]);
+}
@@ -0,0 +1,90 @@
+// ***************************************************************
+//
+// I/O worker threads
+//
+// * Each worker owns one device or all devices on one USB bus
+//   (ztex_device->busnum) and runs pkt_comm I/O loop itself.
+// * Application thread only pushes packets and fetches results,
+//   I/O on boards on different host controllers goes in parallel.
+// * Packets are passed via lock-free single-producer single-consumer
+//   handoff queues (pkt_comm/pkt_spsc_queue.h): one application thread
+//   pushes and fetches packets for a given FPGA, no mutex is taken.
+//   pkt_comm of a device serviced by worker is accessed
+//   by worker thread only.
+// * On I/O error worker stops servicing the device. The device
+//   is invalidated in application thread (device_worker_list_check()),
+//   so application can walk device_list while workers run.
+//   Application must not invalidate a device serviced by worker
+//   by other means.
+//
+// ***************************************************************
+
+// device_worker_list_new() modes
+#define DEVICE_WORKER_PER_DEVICE	0
+#define DEVICE_WORKER_PER_BUS		1
+
+// If no data was sent or received by any of worker's devices,
+// worker sleeps that long
+#define DEVICE_WORKER_IDLE_USEC	100
+
+// Capacity of handoff queues, packets
+#define DEVICE_WORKER_QUEUE_SIZE	1024
+
+// Device serviced by a worker
+struct worker_device {
+	struct device *device;
+	struct device_worker *worker;
+	struct worker_device *next;
+	// handoff queues between application and worker
+	struct pkt_spsc_queue *output_queue[DEVICE_FPGAS_MAX];
+	struct pkt_spsc_queue *input_queue[DEVICE_FPGAS_MAX];
+	int error;			// set by worker thread
+};
+
+struct device_worker {
+	pthread_t thread;
+	pthread_mutex_t mutex;	// protects list of devices
+	int busnum;			// -1 if worker owns single device
+	volatile int stop;
+	struct worker_device *worker_device;
+	struct device_worker *next;
+	uint64_t loop_count;
+};
+
+struct device_worker_list {
+	int mode;
+	struct device_worker *worker;
+};
+
+// Creates workers for valid devices in the list and starts threads.
+// mode: DEVICE_WORKER_PER_DEVICE or DEVICE_WORKER_PER_BUS
+struct device_worker_list *device_worker_list_new(struct device_list *device_list, int mode);
+
+// Adds valid devices from the list (e.g. from device_timely_scan())
+// to workers, starts threads if necessary.
+// Returns number of added devices, < 0 on error.
+int device_worker_list_add(struct device_worker_list *worker_list, struct device_list *device_list);
+
+// Invalidates devices where workers encountered I/O errors.
+// To be called from application thread that owns device_list.
+// Returns number of invalidated devices.
+int device_worker_list_check(struct device_worker_list *worker_list);
+
+// Stops threads, deletes workers. Packets remaining in handoff
+// queues are deleted. Devices where workers encountered errors
+// are invalidated, other devices remain in their current state.
+void device_worker_list_delete(struct device_worker_list *worker_list);
+
+// fpga_worker_pkt_*() functions for a given FPGA must be called
+// from one application thread.
+
+// Places packet into handoff queue for output to FPGA.
+// Returns -1 if queue is full or device is invalid.
+int fpga_worker_pkt_push(struct fpga *fpga, struct pkt *pkt);
+
+// returns false if handoff queue has space for 'num' more packets
+int fpga_worker_pkt_queue_full(struct fpga *fpga, int num);
+
+// Fetches packet received from FPGA.
+// Returns NULL if there're no packets or device is invalid.
+struct pkt *fpga_worker_pkt_fetch(struct fpga *fpga);
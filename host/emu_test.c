@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <signal.h>
+#include <libusb-1.0/libusb.h>
+
+#include "ztex.h"
+#include "inouttraffic.h"
+#include "pkt_comm/pkt_comm.h"
+#include "pkt_comm/word_list.h"
+#include "pkt_comm/word_gen.h"
+#include "pkt_comm/pkt_result.h"
+#include "device.h"
+#include "emulator.h"
+
+// Throughput of device_pkt_rw() with emulated boards:
+// USB latency and bandwidth, FPGA generation rate are modeled,
+// no hardware is required.
+//
+// Usage: emu_test [seconds [devices [cmd_latency_usec [bandwidth_MBps
+//		[result_batch [in_place [status_all [broadcast [mux [notify]]]]]]]]]]
+// With result_batch set, results are decoded into pkt_result_batch.
+// With in_place, output packets are built in the output ring.
+// status_all sets device_pkt_rw_status_all (default 1),
+// 2 is the same with firmware that doesn't support VR 0x8D.
+// With broadcast, same packets go to every FPGA (device_pkt_broadcast()).
+// With mux, FPGAs are switched by the firmware (device_mux_enable()).
+// With notify, the test waits for notification (device_wait_event())
+// when a pass over devices transferred nothing.
+
+// Notification thresholds; the test waits that long
+// if output is below the threshold
+#define NOTIFY_OUTPUT_BYTES	4096
+#define NOTIFY_INPUT_BYTES	16384
+#define NOTIFY_WAIT_MS		10
+
+volatile int signal_received = 0;
+
+void signal_handler(int signum)
+{
+	signal_received = 1;
+}
+
+struct device_bitstream bitstream_emu = {
+	0x0001,
+	"(emulated)",	// no upload takes place
+	{ 2, 32768, 32766 }
+};
+
+// Range [0-9]{insert_word}[0-9][0-9] (1000 per word)
+struct word_gen word_gen_word1k = {
+	3,
+	{
+		{ 10, 0, 48, 49, 50, 51, 52, 53, 54, 55, 56, 57 },
+		{ 10, 0, 48, 49, 50, 51, 52, 53, 54, 55, 56, 57 },
+		{ 10, 0, 48, 49, 50, 51, 52, 53, 54, 55, 56, 57 }
+	},
+	1, { 1 },	// insert word at position 1
+	0			// generate all
+};
+
+char *words[] = {
+	"aaaaa", "bbb", "cc", "dddddd", "e", "f", "g", "hh",
+	"iii", "jjjj", "kkkkk", "llll", "mmm", "nn", "p", "q",
+	NULL };
+
+int main(int argc, char **argv)
+{
+	int seconds = argc > 1 ? atoi(argv[1]) : 5;
+	int num_devices = argc > 2 ? atoi(argv[2]) : 1;
+	if (argc > 3)
+		emu_params.cmd_latency_usec = atoi(argv[3]);
+	if (argc > 4)
+		emu_params.bandwidth = atoi(argv[4]) * 1024 * 1024;
+	int result_batch = argc > 5 ? atoi(argv[5]) : 0;
+	int in_place = argc > 6 ? atoi(argv[6]) : 0;
+	int status_all = argc > 7 ? atoi(argv[7]) : 1;
+	device_pkt_rw_status_all = status_all > 0;
+	emu_params.no_status_all = status_all == 2;
+	int broadcast = argc > 8 ? atoi(argv[8]) : 0;
+	int mux = argc > 9 ? atoi(argv[9]) : 0;
+	int notify = argc > 10 ? atoi(argv[10]) : 0;
+	if (seconds <= 0 || num_devices <= 0 || emu_params.cmd_latency_usec < 0
+			|| emu_params.bandwidth <= 0) {
+		printf("Usage: %s [seconds [devices [cmd_latency_usec [bandwidth_MBps"
+				" [result_batch [in_place [status_all [broadcast [mux [notify]]]]]]]]]]\n",
+				argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	struct device_list *device_list = device_emu_list_new(num_devices,
+			DEVICE_FPGAS_MAX);
+	device_list_init(device_list, &bitstream_emu);
+	fprintf(stderr, "%d emulated device(s), cmd latency %d usec, %d MB/s, %d s.\n",
+			device_list_count(device_list), emu_params.cmd_latency_usec,
+			emu_params.bandwidth / 1024 / 1024, seconds);
+
+	struct device *device;
+	for (device = device_list->device; device; device = device->next) {
+		int num;
+		for (num = 0; num < device->num_of_fpgas; num++)
+			if (result_batch)
+				pkt_comm_set_result_batch(device->fpga[num].comm, 1);
+		if (mux && device_mux_enable(device, 1) <= 0)
+			fprintf(stderr, "SN %s: mux mode isn't enabled\n",
+					device->ztex_device->snString);
+		if (notify && device_notify_enable(device, NOTIFY_OUTPUT_BYTES,
+				NOTIFY_INPUT_BYTES) <= 0)
+			fprintf(stderr, "SN %s: notification isn't enabled\n",
+					device->ztex_device->snString);
+	}
+
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+
+	unsigned long long results = 0, bad_results = 0;
+	unsigned long long waits = 0;
+	int pkt_id = 0;
+
+	struct timeval tv0, tv1;
+	gettimeofday(&tv0, NULL);
+	clock_t clock0 = clock();
+
+	for ( ; ; ) {
+		int data_transferred = 0;
+		for (device = device_list->device; device; device = device->next) {
+			if (!device_valid(device))
+				continue;
+
+			// Keep each FPGA busy: word generator configuration
+			// followed by the word list
+			int num;
+			for (num = 0; num < device->num_of_fpgas; num++) {
+				struct pkt_comm *comm = broadcast ? device_broadcast_comm(device)
+						: device->fpga[num].comm;
+				if (!comm) {
+					printf("device_broadcast_comm() failed\n");
+					exit(EXIT_FAILURE);
+				}
+				while (in_place
+						&& !pkt_word_gen_output(comm, &word_gen_word1k, pkt_id)
+						&& !pkt_word_list_output(comm, words, 0))
+					pkt_id++;
+				while (!in_place && !pkt_queue_full(comm->output_queue, 2)) {
+					struct pkt *pkt = pkt_word_gen_new(&word_gen_word1k);
+					pkt->id = pkt_id++;
+					pkt_queue_push(comm->output_queue, pkt);
+					pkt_queue_push(comm->output_queue, pkt_word_list_new(words));
+				}
+			}
+
+			int result = device_pkt_rw(device);
+			if (result < 0) {
+				fprintf(stderr, "SN %s device_pkt_rw(): %d (%s)\n",
+					device->ztex_device->snString, result, libusb_strerror(result));
+				device_invalidate(device);
+				continue;
+			}
+			if (result > 0)
+				data_transferred = 1;
+
+			for (num = 0; num < device->num_of_fpgas; num++) {
+				struct pkt_result_batch *batch = device->fpga[num].comm->result_batch;
+				if (batch) {
+					results += batch->count;
+					pkt_result_batch_clear(batch);
+				}
+
+				struct pkt *inpkt;
+				while ( (inpkt = pkt_queue_fetch(device->fpga[num].comm->input_queue)) ) {
+					if (inpkt->type != 0x81 || inpkt->data_len != EMU_RESULT_DATA_LEN)
+						bad_results++;
+					results++;
+					pkt_delete(inpkt);
+				}
+			}
+		}
+
+		// Nothing to do: wait for some device to report an event
+		for (device = device_list->device; notify && !data_transferred
+				&& device; device = device->next) {
+			if (!device_valid(device))
+				continue;
+			int events = device_wait_event(device,
+					NOTIFY_WAIT_MS / device_list_count(device_list) + 1);
+			if (events < 0) {
+				fprintf(stderr, "SN %s device_wait_event(): %d (%s)\n",
+					device->ztex_device->snString, events, libusb_strerror(events));
+				device_invalidate(device);
+				continue;
+			}
+			waits++;
+			if (events)
+				break;
+		}
+
+		gettimeofday(&tv1, NULL);
+		if (signal_received || tv1.tv_sec - tv0.tv_sec >= seconds)
+			break;
+		if (!device_list_count(device_list))
+			break;
+	}
+
+	double cpu_sec = (double)(clock() - clock0) / CLOCKS_PER_SEC;
+	double sec = tv1.tv_sec - tv0.tv_sec + (tv1.tv_usec - tv0.tv_usec) / 1e6;
+
+	uint64_t cmd_count = 0, data_bytes = 0, credit_wr_count = 0;
+	for (device = device_list->device; device; device = device->next) {
+		int num;
+		for (num = 0; num < device->num_of_fpgas; num++) {
+			cmd_count += device->fpga[num].cmd_count;
+			data_bytes += device->fpga[num].sched.data_bytes;
+			credit_wr_count += device->fpga[num].wr.credit_wr_count;
+		}
+	}
+
+	printf("results: %llu (%llu bad), %.0f results/s, %.2f MB/s (wire)\n",
+			results, bad_results, results / sec,
+			results * EMU_RESULT_PKT_LEN / sec / 1048576);
+	printf("control transfers: %llu, %.1f per MB of bulk data,"
+			" %llu writes without status request\n",
+			(unsigned long long)cmd_count,
+			data_bytes ? cmd_count * 1048576.0 / data_bytes : 0,
+			(unsigned long long)credit_wr_count);
+	if (notify)
+		printf("waits for notification: %llu\n", waits);
+	printf("CPU time: %.2f s (%.1f%%)\n", cpu_sec, cpu_sec * 100 / sec);
+	return 0;
+}
@@ -0,0 +1,973 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <libusb-1.0/libusb.h>
+
+#include "ztex.h"
+#include "inouttraffic.h"
+#include "pkt_comm/pkt_comm.h"
+#include "pkt_comm/word_list.h"
+#include "pkt_comm/word_gen.h"
+#include "emulator.h"
+
+struct emu_params emu_params = {
+	250,				// cmd_latency_usec
+	125,				// bulk_latency_usec
+	30 * 1024 * 1024,	// bandwidth
+	20000000,			// words_per_sec
+	0x0001,				// bitstream_type
+	0,					// status_no_input_free
+	0					// no_status_all
+};
+
+
+long long emu_time_usec()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+// USB transfers to the device are sequential.
+// Transfer starts when previous one is done and takes 'usec'.
+void emu_usb_wait(struct emu_device *ed, long long usec)
+{
+	long long now = emu_time_usec();
+	if (ed->busy_until < now)
+		ed->busy_until = now;
+	ed->busy_until += usec;
+	if (ed->busy_until > now)
+		usleep(ed->busy_until - now);
+}
+
+long long emu_bulk_usec(int len)
+{
+	return emu_params.bulk_latency_usec
+			+ (long long)len * 1000000 / emu_params.bandwidth;
+}
+
+
+///////////////////////////////////////////////////////////////////
+//
+// Output FIFO
+//
+///////////////////////////////////////////////////////////////////
+
+void emu_output_write(struct emu_fpga *ef, unsigned char *data, int len)
+{
+	int pos = (ef->output_start + ef->output_len) % EMU_OUTPUT_FIFO_SIZE;
+	int len1 = EMU_OUTPUT_FIFO_SIZE - pos;
+	if (len1 > len)
+		len1 = len;
+	memcpy(ef->output_fifo + pos, data, len1);
+	memcpy(ef->output_fifo, data + len1, len - len1);
+	ef->output_len += len;
+}
+
+void emu_output_read(struct emu_fpga *ef, unsigned char *buf, int len)
+{
+	int len1 = EMU_OUTPUT_FIFO_SIZE - ef->output_start;
+	if (len1 > len)
+		len1 = len;
+	memcpy(buf, ef->output_fifo + ef->output_start, len1);
+	memcpy(buf + len1, ef->output_fifo, len - len1);
+	ef->output_start = (ef->output_start + len) % EMU_OUTPUT_FIFO_SIZE;
+	ef->output_len -= len;
+}
+
+// Serializes 0x81 result packet into output FIFO
+void emu_result_write(struct emu_fpga *ef, unsigned char *plaintext)
+{
+	unsigned char pkt[EMU_RESULT_PKT_LEN];
+	unsigned char *data = pkt + PKT_HEADER_LEN + PKT_CHECKSUM_LEN;
+
+	memset(pkt, 0, PKT_HEADER_LEN);
+	pkt[0] = PKT_COMM_VERSION;
+	pkt[1] = 0x81;
+	pkt[4] = EMU_RESULT_DATA_LEN;
+	pkt[8] = ef->pkt_id;
+	pkt[9] = ef->pkt_id >> 8;
+	pkt_checksum(pkt + PKT_HEADER_LEN, pkt, PKT_HEADER_LEN);
+
+	memcpy(data, plaintext, WORD_MAX_LEN);
+	data[8] = ef->word_id;
+	data[9] = ef->word_id >> 8;
+	data[10] = ef->gen_id;
+	data[11] = ef->gen_id >> 8;
+	data[12] = ef->gen_id >> 16;
+	data[13] = ef->gen_id >> 24;
+	pkt_checksum(data + EMU_RESULT_DATA_LEN, data, EMU_RESULT_DATA_LEN);
+
+	emu_output_write(ef, pkt, EMU_RESULT_PKT_LEN);
+	ef->results++;
+}
+
+
+///////////////////////////////////////////////////////////////////
+//
+// Word generator and word list (application mode 2)
+//
+///////////////////////////////////////////////////////////////////
+
+// Loads word generator configuration (pkt_word_gen_new() format)
+// Returns < 0 if configuration is invalid
+int emu_word_gen_conf(struct emu_fpga *ef, struct pkt *pkt)
+{
+	unsigned char *data = (unsigned char *)pkt->data;
+	int len = pkt->data_len;
+	int offset = 0;
+	int i;
+
+	if (len < 1)
+		return -1;
+	ef->num_ranges = data[offset++];
+	if (ef->num_ranges > RANGES_MAX)
+		return -1;
+
+	for (i = 0; i < ef->num_ranges; i++) {
+		struct word_gen_char_range *range = &ef->ranges[i];
+		if (offset + 2 > len)
+			return -1;
+		range->num_chars = data[offset++];
+		range->start_idx = data[offset++];
+		if (!range->num_chars || range->num_chars > sizeof(range->chars)
+				|| range->start_idx >= range->num_chars
+				|| offset + range->num_chars > len)
+			return -1;
+		memcpy(range->chars, data + offset, range->num_chars);
+		offset += range->num_chars;
+	}
+
+	if (offset + 1 > len)
+		return -1;
+	ef->num_words = data[offset++];
+	if (ef->num_words > WORDS_INSERT_MAX
+			|| (!ef->num_words && !ef->num_ranges))
+		return -1;
+	if (ef->num_words) {
+		if (offset + 1 > len)
+			return -1;
+		ef->word_insert_pos = data[offset++];
+		if (ef->word_insert_pos > ef->num_ranges)
+			return -1;
+	}
+
+	if (offset + 5 != len || data[offset + 4] != 0xBB)
+		return -1;
+	ef->num_generate = data[offset] | data[offset + 1] << 8
+			| data[offset + 2] << 16 | (unsigned long)data[offset + 3] << 24;
+
+	ef->pkt_id = pkt->id;
+	ef->gen_active = 1;
+	ef->gen_running = 0;
+	return 0;
+}
+
+// Takes next word from the word list.
+// Returns 0 if the list is over.
+int emu_word_list_next(struct emu_fpga *ef)
+{
+	char *data = ef->word_list->data;
+	int len = ef->word_list->data_len;
+
+	// empty words are skipped
+	while (ef->word_list_offset < len && !data[ef->word_list_offset])
+		ef->word_list_offset++;
+	if (ef->word_list_offset >= len)
+		return 0;
+
+	ef->word_len = 0;
+	while (ef->word_list_offset < len && data[ef->word_list_offset]) {
+		if (ef->word_len < WORD_MAX_LEN)
+			ef->word[ef->word_len++] = data[ef->word_list_offset] & 0x7F;
+		else
+			ef->pkt_comm_status |= EMU_ERR_WORD_LIST_LEN;
+		ef->word_list_offset++;
+	}
+	ef->word_id = ef->word_count++;
+	return 1;
+}
+
+// Starts generation for next word.
+// Returns 0 if no word is available.
+int emu_word_gen_start(struct emu_fpga *ef)
+{
+	if (ef->num_words) {
+		if (!ef->word_list)
+			return 0;
+		if (!emu_word_list_next(ef)) {
+			// word list is over, so is the configuration
+			pkt_delete(ef->word_list);
+			ef->word_list = NULL;
+			ef->gen_active = 0;
+			return 0;
+		}
+	}
+	else {
+		ef->word_len = 0;
+		ef->word_id = 0;
+	}
+
+	// remaining range combinations, last range iterates fastest
+	unsigned long long total = 1, start = 0;
+	int i;
+	for (i = 0; i < ef->num_ranges; i++) {
+		ef->range_idx[i] = ef->ranges[i].start_idx;
+		total *= ef->ranges[i].num_chars;
+		start = start * ef->ranges[i].num_chars + ef->ranges[i].start_idx;
+	}
+	ef->gen_total = total - start;
+	if (ef->num_generate && ef->num_generate < ef->gen_total)
+		ef->gen_total = ef->num_generate;
+	ef->gen_id = 0;
+	ef->gen_running = 1;
+	return 1;
+}
+
+// Generates next word, writes result into output FIFO.
+// Returns 0 if there's no word to generate.
+int emu_word_gen_next(struct emu_fpga *ef)
+{
+	if (!ef->gen_running) {
+		if (!ef->gen_active || !emu_word_gen_start(ef))
+			return 0;
+	}
+
+	unsigned char plaintext[WORD_MAX_LEN];
+	int len = 0, i, j;
+	memset(plaintext, 0, WORD_MAX_LEN);
+	for (i = 0; i <= ef->num_ranges; i++) {
+		if (ef->num_words && i == ef->word_insert_pos)
+			for (j = 0; j < ef->word_len && len < WORD_MAX_LEN; j++)
+				plaintext[len++] = ef->word[j];
+		if (i < ef->num_ranges && len < WORD_MAX_LEN)
+			plaintext[len++] = ef->ranges[i].chars[ef->range_idx[i]];
+	}
+	emu_result_write(ef, plaintext);
+
+	if (++ef->gen_id < ef->gen_total) {
+		for (i = ef->num_ranges - 1; i >= 0; i--) {
+			if (++ef->range_idx[i] < ef->ranges[i].num_chars)
+				break;
+			ef->range_idx[i] = 0;
+		}
+	}
+	else {
+		ef->gen_running = 0;
+		if (!ef->num_words)
+			ef->gen_active = 0;
+	}
+	return 1;
+}
+
+// Input packet is processed, its bytes leave input FIFO
+void emu_input_release(struct emu_fpga *ef, struct pkt *pkt)
+{
+	ef->input_bytes -= PKT_HEADER_LEN + 2 * PKT_CHECKSUM_LEN + pkt->data_len;
+	if (ef->input_bytes < 0)
+		ef->input_bytes = 0;
+}
+
+// Takes input packets while word generator is able to accept them
+void emu_fpga_process_input(struct emu_fpga *ef)
+{
+	if (ef->pkt_comm_status)
+		return;
+
+	// process data left in the buffer (input queue was full)
+	pkt_comm_input_get_buf(ef->comm);
+
+	for ( ; ; ) {
+		if (!ef->inpkt)
+			ef->inpkt = pkt_queue_fetch(ef->comm->input_queue);
+		struct pkt *pkt = ef->inpkt;
+		if (!pkt)
+			break;
+
+		if (pkt->type == PKT_TYPE_WORD_GEN) {
+			// previous configuration is in progress
+			if (ef->gen_active)
+				break;
+			if (emu_word_gen_conf(ef, pkt) < 0)
+				ef->pkt_comm_status |= EMU_ERR_WORD_GEN_CONF;
+			emu_input_release(ef, pkt);
+			pkt_delete(pkt);
+		}
+		else if (pkt->type == PKT_TYPE_WORD_LIST) {
+			if (!ef->gen_active || !ef->num_words || ef->word_list)
+				break;
+			ef->word_list = pkt;
+			ef->word_list_offset = 0;
+			ef->word_count = 0;
+			emu_input_release(ef, pkt);
+		}
+		else if (pkt->type == 3) {
+			// PKT_TYPE_CONFIG: accepted, not used by the model
+			emu_input_release(ef, pkt);
+			pkt_delete(pkt);
+		}
+		else {
+			ef->pkt_comm_status |= EMU_ERR_INPKT_TYPE;
+			emu_input_release(ef, pkt);
+			pkt_delete(pkt);
+		}
+		ef->inpkt = NULL;
+	}
+
+	if (!ef->inpkt && !ef->comm->input_pkt && !ef->comm->input_buf_len
+			&& !ef->comm->input_queue->count)
+		ef->input_bytes = 0;
+}
+
+// Advances FPGA state to 'now'
+void emu_fpga_update(struct emu_fpga *ef, long long now)
+{
+	double words = (now - ef->update_time) * (double)emu_params.words_per_sec / 1e6;
+	ef->update_time = now;
+	if (ef->app_mode != 2 || ef->pkt_comm_status)
+		return;
+
+	emu_fpga_process_input(ef);
+	ef->gen_budget += words;
+	while (ef->gen_budget >= 1
+			&& EMU_OUTPUT_FIFO_SIZE - ef->output_len >= EMU_RESULT_PKT_LEN) {
+		if (!emu_word_gen_next(ef)) {
+			emu_fpga_process_input(ef);
+			if (!emu_word_gen_next(ef)) {
+				// idle
+				ef->gen_budget = 0;
+				break;
+			}
+		}
+		ef->gen_budget -= 1;
+	}
+	// output FIFO is full
+	if (ef->gen_budget > EMU_OUTPUT_FIFO_SIZE / EMU_RESULT_PKT_LEN)
+		ef->gen_budget = EMU_OUTPUT_FIFO_SIZE / EMU_RESULT_PKT_LEN;
+}
+
+void emu_notify_update(struct emu_device *ed);
+
+void emu_device_update(struct device *device)
+{
+	struct emu_device *ed = device->transport_data;
+	long long now = emu_time_usec();
+	int i;
+	for (i = 0; i < device->num_of_fpgas; i++)
+		emu_fpga_update(&ed->fpga[i], now);
+	emu_notify_update(ed);
+}
+
+// Resets FPGA to post-configuration state (VC 0x8B)
+void emu_fpga_reset(struct emu_fpga *ef)
+{
+	if (ef->inpkt)
+		pkt_delete(ef->inpkt);
+	if (ef->word_list)
+		pkt_delete(ef->word_list);
+	ef->inpkt = NULL;
+	ef->word_list = NULL;
+
+	// new FPGA side pkt_comm flushes input FIFO
+	struct pkt_comm_params *params = ef->comm->params;
+	pkt_comm_delete(ef->comm);
+	ef->comm = pkt_comm_new(params);
+
+	ef->input_bytes = 0;
+	ef->output_start = 0;
+	ef->output_len = 0;
+	ef->output_limit = 0;
+	ef->gen_active = 0;
+	ef->gen_running = 0;
+	ef->gen_budget = 0;
+	ef->app_mode = 0;
+	ef->pkt_comm_status = 0;
+	ef->output_limit_enable = 1;
+	ef->hs_io_enable = 1;
+}
+
+
+///////////////////////////////////////////////////////////////////
+//
+// Vendor requests and commands
+//
+///////////////////////////////////////////////////////////////////
+
+int emu_select(struct device *device, int num)
+{
+	struct emu_device *ed = device->transport_data;
+	if (num < 0 || num >= device->num_of_fpgas)
+		return LIBUSB_ERROR_PIPE;
+	if (ed->selected_fpga != num) {
+		ed->selected_fpga = num;
+		ed->fpga[num].hs_io_enable = 1;
+	}
+	device->selected_fpga = num;
+	return 0;
+}
+
+// Input FIFO free space, bytes
+int emu_input_free(struct emu_fpga *ef)
+{
+	if (!pkt_comm_input_get_buf(ef->comm))
+		return 0;
+	return EMU_INPUT_FIFO_SIZE - ef->input_bytes;
+}
+
+// VR 0x84
+void emu_get_io_state(struct emu_fpga *ef, unsigned char *buf)
+{
+	memset(buf, 0, sizeof(struct fpga_io_state));
+	buf[0] = IO_STATE_INPUT_FREE_VALID | IO_STATE_LISTEN;
+	if (emu_input_free(ef) < EMU_INPUT_PROG_FULL)
+		buf[0] |= IO_STATE_INPUT_PROG_FULL;
+	buf[3] = ef->pkt_comm_status;
+}
+
+// VR 0x92 (part of VR 0x8C): input FIFO free space in words
+void emu_get_input_free(struct emu_fpga *ef, unsigned char *buf)
+{
+	int free = emu_input_free(ef) / INPUT_WORD_WIDTH;
+	buf[0] = free;
+	buf[1] = free >> 8;
+}
+
+// VR 0x85: FPGA sends no more than registered amount
+void emu_reg_output_limit(struct emu_fpga *ef, unsigned char *buf)
+{
+	int limit = ef->output_len;
+	if (limit > EMU_OUTPUT_LIMIT_MAX)
+		limit = EMU_OUTPUT_LIMIT_MAX;
+	limit &= ~(OUTPUT_WORD_WIDTH - 1);
+	ef->output_limit = limit;
+	buf[0] = (limit / OUTPUT_WORD_WIDTH);
+	buf[1] = (limit / OUTPUT_WORD_WIDTH) >> 8;
+}
+
+int emu_device_control(struct device *device, int cmd, int value, int index,
+		unsigned char *buf, int length)
+{
+	struct emu_device *ed = device->transport_data;
+	emu_usb_wait(ed, emu_params.cmd_latency_usec);
+	emu_device_update(device);
+
+	struct emu_fpga *ef = &ed->fpga[ed->selected_fpga];
+	int result;
+
+	switch (cmd) {
+	case 0x8E:
+		return emu_select(device, value);
+
+	case 0x8C:
+		if (!buf || length < sizeof(struct fpga_status))
+			return LIBUSB_ERROR_OVERFLOW;
+		result = emu_select(device, value);
+		if (result < 0)
+			return result;
+		ef = &ed->fpga[value];
+		emu_get_io_state(ef, buf);
+		emu_reg_output_limit(ef, buf + sizeof(struct fpga_io_state));
+		if (emu_params.status_no_input_free)
+			return FPGA_STATUS_LEN_MIN;
+		emu_get_input_free(ef, buf + sizeof(struct fpga_io_state) + 2);
+		return sizeof(struct fpga_status);
+
+	case 0x8D: {
+		if (emu_params.no_status_all
+				|| value <= 0 || value > device->num_of_fpgas)
+			return LIBUSB_ERROR_PIPE;
+		if (!buf || length < value * sizeof(struct fpga_status))
+			return LIBUSB_ERROR_OVERFLOW;
+		int status_len = emu_params.status_no_input_free
+				? FPGA_STATUS_LEN_MIN : sizeof(struct fpga_status);
+		int num;
+		for (num = 0; num < value; num++) {
+			unsigned char *fpga_buf = buf + num * status_len;
+			emu_select(device, num);
+			ef = &ed->fpga[num];
+			emu_get_io_state(ef, fpga_buf);
+			if (index & 1 << num)
+				emu_reg_output_limit(ef, fpga_buf + sizeof(struct fpga_io_state));
+			else
+				memset(fpga_buf + sizeof(struct fpga_io_state), 0, 2);
+			if (status_len > FPGA_STATUS_LEN_MIN)
+				emu_get_input_free(ef, fpga_buf + sizeof(struct fpga_io_state) + 2);
+		}
+		return value * status_len;
+	}
+
+	// Highest FPGA in the mask is selected, others listen
+	case 0x8F: {
+		if (value >= 1 << device->num_of_fpgas)
+			return LIBUSB_ERROR_PIPE;
+		int num, selected = ed->selected_fpga;
+		for (num = 0; num < device->num_of_fpgas; num++)
+			if (value & 1 << num)
+				selected = num;
+		ed->broadcast_mask = value & ~(1 << selected);
+		return emu_select(device, selected);
+	}
+
+	// Mux mode on FPGAs 0 .. value-1, 0 disables
+	case 0x90: {
+		if (value > device->num_of_fpgas)
+			return LIBUSB_ERROR_PIPE;
+		int num, count = value ? value : ed->mux_num;
+		for (num = 0; num < count; num++) {
+			emu_select(device, num);
+			ed->fpga[num].mux_received = 0;
+		}
+		ed->mux_num = value;
+		ed->mux_next = 0;
+		ed->mux_out_len = 0;
+		ed->mux_in_tag_len = 0;
+		ed->mux_in_remain = 0;
+		return 0;
+	}
+
+	// Notification: output threshold (words); input threshold
+	// (256-word units), number of FPGAs
+	case 0x91:
+		if ((index >> 8) > device->num_of_fpgas)
+			return LIBUSB_ERROR_PIPE;
+		ed->notify_num = 0;
+		ed->notify_output = value * OUTPUT_WORD_WIDTH;
+		ed->notify_input = (index & 0xFF) * 256 * INPUT_WORD_WIDTH;
+		ed->notify_sent[0] = 0;
+		ed->notify_sent[1] = 0;
+		ed->notify_num = index >> 8;
+		return 0;
+
+	case 0x84:
+		if (!buf || length < sizeof(struct fpga_io_state))
+			return LIBUSB_ERROR_OVERFLOW;
+		emu_get_io_state(ef, buf);
+		return sizeof(struct fpga_io_state);
+
+	case 0x85:
+		if (!buf || length < 2)
+			return LIBUSB_ERROR_OVERFLOW;
+		emu_reg_output_limit(ef, buf);
+		return 2;
+
+	case 0x8B:
+		emu_fpga_reset(ef);
+		return 0;
+
+	case 0x88:
+		if (!buf || length < 8)
+			return LIBUSB_ERROR_OVERFLOW;
+		buf[0] = value ^ 0x5A;
+		buf[1] = (value >> 8) ^ 0x5A;
+		buf[2] = index ^ 0x5A;
+		buf[3] = (index >> 8) ^ 0x5A;
+		buf[4] = ef->num;
+		buf[5] = FPGA_CAP_MUX;
+		buf[6] = emu_params.bitstream_type;
+		buf[7] = emu_params.bitstream_type >> 8;
+		return 8;
+
+	case 0x82:
+		ef->app_mode = value;
+		return 0;
+
+	case 0x80:
+		ef->hs_io_enable = value;
+		return 0;
+
+	case 0x86:
+		ef->output_limit_enable = value;
+		return 0;
+
+	default:
+		return LIBUSB_ERROR_PIPE;
+	}
+}
+
+
+///////////////////////////////////////////////////////////////////
+//
+// Transport
+//
+///////////////////////////////////////////////////////////////////
+
+int emu_fpga_select(struct fpga *fpga)
+{
+	return emu_device_control(fpga->device, 0x8E, fpga->num, 0, NULL, 0);
+}
+
+int emu_fpga_status(struct fpga *fpga, struct fpga_status *fpga_status)
+{
+	return emu_device_control(fpga->device, 0x8C, fpga->num, 0,
+			(unsigned char *)fpga_status, sizeof(struct fpga_status));
+}
+
+int emu_device_status_all(struct device *device, int reg_mask,
+		struct fpga_status *fpga_status)
+{
+	return emu_device_control(device, 0x8D, device->num_of_fpgas, reg_mask,
+			(unsigned char *)fpga_status,
+			device->num_of_fpgas * sizeof(struct fpga_status));
+}
+
+// Listening FPGA receives data written to the selected FPGA.
+// It doesn't stop the transfer; data that doesn't fit is lost.
+void emu_fpga_listen(struct emu_fpga *ef, unsigned char *data, int len)
+{
+	unsigned char *buf = pkt_comm_input_get_buf(ef->comm);
+	if (emu_input_free(ef) < len) {
+		ef->pkt_comm_status |= EMU_ERR_INPKT_CHECKSUM;
+		return;
+	}
+	memcpy(buf, data, len);
+	if (pkt_comm_input_completed(ef->comm, len, 0) < 0)
+		ef->pkt_comm_status |= EMU_ERR_INPKT_CHECKSUM;
+	ef->input_bytes += len;
+	emu_fpga_process_input(ef);
+}
+
+// Mux mode: every FPGA receives the data, keeps frames tagged
+// with its number
+void emu_mux_write(struct emu_device *ed, unsigned char *data, int len)
+{
+	int offset = 0;
+	int num;
+
+	while (offset < len) {
+		int chunk = len - offset;
+
+		if (!ed->mux_in_remain) {
+			if (chunk > MUX_TAG_OUT_LEN - ed->mux_in_tag_len)
+				chunk = MUX_TAG_OUT_LEN - ed->mux_in_tag_len;
+			memcpy(ed->mux_in_tag + ed->mux_in_tag_len, data + offset, chunk);
+			ed->mux_in_tag_len += chunk;
+			offset += chunk;
+			if (ed->mux_in_tag_len < MUX_TAG_OUT_LEN)
+				break;
+
+			ed->mux_in_tag_len = 0;
+			unsigned char *tag = ed->mux_in_tag;
+			if (tag[1] != MUX_TAG)
+				for (num = 0; num < ed->mux_num; num++)
+					ed->fpga[num].pkt_comm_status |= EMU_ERR_INPKT_CHECKSUM;
+			ed->mux_in_num = tag[0];
+			ed->mux_in_remain = (tag[2] | tag[3] << 8) * INPUT_WORD_WIDTH;
+			continue;
+		}
+
+		if (chunk > ed->mux_in_remain)
+			chunk = ed->mux_in_remain;
+		if (ed->mux_in_num < ed->mux_num) {
+			struct emu_fpga *ef = &ed->fpga[ed->mux_in_num];
+			emu_fpga_listen(ef, data + offset, chunk);
+			ef->mux_received += chunk;
+		}
+		offset += chunk;
+		ed->mux_in_remain -= chunk;
+	}
+}
+
+// Data goes to the selected FPGA. Partial write if input FIFO is full.
+int emu_fpga_write(struct fpga *fpga, unsigned char *data, int len, int *transferred)
+{
+	struct emu_device *ed = fpga->device->transport_data;
+	emu_usb_wait(ed, emu_bulk_usec(len));
+	emu_device_update(fpga->device);
+
+	if (ed->mux_num) {
+		emu_mux_write(ed, data, len);
+		*transferred = len;
+		return 0;
+	}
+
+	struct emu_fpga *ef = &ed->fpga[ed->selected_fpga];
+	*transferred = 0;
+	if (!ef->hs_io_enable)
+		return LIBUSB_ERROR_TIMEOUT;
+
+	int free = emu_input_free(ef);
+	unsigned char *buf = pkt_comm_input_get_buf(ef->comm);
+	if (free <= 0)
+		return LIBUSB_ERROR_TIMEOUT;
+
+	int accepted = len > free ? free : len;
+	memcpy(buf, data, accepted);
+	if (pkt_comm_input_completed(ef->comm, accepted, 0) < 0)
+		ef->pkt_comm_status |= EMU_ERR_INPKT_CHECKSUM;
+	ef->input_bytes += accepted;
+	*transferred = accepted;
+
+	int num;
+	for (num = 0; num < fpga->device->num_of_fpgas; num++)
+		if (ed->broadcast_mask & 1 << num)
+			emu_fpga_listen(&ed->fpga[num], data, accepted);
+
+	emu_fpga_process_input(ef);
+	return accepted == len ? 0 : LIBUSB_ERROR_TIMEOUT;
+}
+
+// Mux mode: FPGA outputs a tag followed by the data
+// (the firmware has registered output limit).
+// Returns data length.
+int emu_mux_frame(struct emu_device *ed, struct emu_fpga *ef)
+{
+	int len = ef->output_len;
+	if (len > EMU_OUTPUT_LIMIT_MAX)
+		len = EMU_OUTPUT_LIMIT_MAX;
+	if (len > EMU_MUX_OUT_SIZE - ed->mux_out_len - MUX_TAG_IN_LEN)
+		len = EMU_MUX_OUT_SIZE - ed->mux_out_len - MUX_TAG_IN_LEN;
+	len &= ~(OUTPUT_WORD_WIDTH - 1);
+
+	unsigned char *tag = ed->mux_out + ed->mux_out_len;
+	int words = len / OUTPUT_WORD_WIDTH;
+	int free = emu_input_free(ef) / INPUT_WORD_WIDTH;
+	int received = ef->mux_received / INPUT_WORD_WIDTH;
+	tag[0] = ef->num | (ef->pkt_comm_status ? MUX_TAG_ERROR : 0);
+	tag[1] = MUX_TAG;
+	tag[2] = words;
+	tag[3] = words >> 8;
+	tag[4] = free;
+	tag[5] = free >> 8;
+	tag[6] = received;
+	tag[7] = received >> 8;
+	emu_output_read(ef, tag + MUX_TAG_IN_LEN, len);
+	ed->mux_out_len += MUX_TAG_IN_LEN + len;
+	return len;
+}
+
+// Mux mode: there are no short packets, the read completes
+// when FPGAs selected in turn have output enough frames
+int emu_mux_read(struct device *device, unsigned char *buf, int len,
+		int *transferred)
+{
+	struct emu_device *ed = device->transport_data;
+	if (len > EMU_MUX_OUT_SIZE - MUX_TAG_IN_LEN - EMU_OUTPUT_LIMIT_MAX)
+		len = EMU_MUX_OUT_SIZE - MUX_TAG_IN_LEN - EMU_OUTPUT_LIMIT_MAX;
+
+	int round_len = 0;
+	while (ed->mux_out_len < len) {
+		round_len += emu_mux_frame(ed, &ed->fpga[ed->mux_next]);
+		if (++ed->mux_next < ed->mux_num)
+			continue;
+
+		// FPGAs had no output: time goes on
+		ed->mux_next = 0;
+		if (!round_len) {
+			emu_usb_wait(ed, ed->mux_num * EMU_MUX_FRAME_USEC);
+			emu_device_update(device);
+		}
+		round_len = 0;
+	}
+
+	memcpy(buf, ed->mux_out, len);
+	memmove(ed->mux_out, ed->mux_out + len, ed->mux_out_len - len);
+	ed->mux_out_len -= len;
+	*transferred = len;
+
+	emu_usb_wait(ed, emu_bulk_usec(len));
+	return 0;
+}
+
+// FPGA sends no more than registered output limit
+// (unless output limit is disabled)
+int emu_fpga_read(struct fpga *fpga, unsigned char *buf, int len, int *transferred)
+{
+	struct emu_device *ed = fpga->device->transport_data;
+	emu_device_update(fpga->device);
+	if (ed->mux_num)
+		return emu_mux_read(fpga->device, buf, len, transferred);
+
+	struct emu_fpga *ef = &ed->fpga[ed->selected_fpga];
+	*transferred = 0;
+
+	int avail = ef->output_limit_enable ? ef->output_limit : ef->output_len;
+	if (len > avail)
+		len = avail;
+	if (!ef->hs_io_enable || !len) {
+		emu_usb_wait(ed, USB_RW_TIMEOUT * 1000);
+		return LIBUSB_ERROR_TIMEOUT;
+	}
+
+	emu_output_read(ef, buf, len);
+	if (ef->output_limit_enable)
+		ef->output_limit -= len;
+	*transferred = len;
+
+	emu_usb_wait(ed, emu_bulk_usec(len));
+	return 0;
+}
+
+// Notification: FPGAs with output not registered yet
+// and with free input space over the thresholds
+void emu_notify_events(struct emu_device *ed, int *events)
+{
+	int num;
+	events[0] = events[1] = 0;
+	for (num = 0; num < ed->notify_num; num++) {
+		struct emu_fpga *ef = &ed->fpga[num];
+		int avail = ef->output_len - ef->output_limit;
+		if (ed->notify_output && avail >= ed->notify_output)
+			events[0] |= 1 << num;
+		if (ed->notify_input && emu_input_free(ef) >= ed->notify_input)
+			events[1] |= 1 << num;
+	}
+}
+
+// The firmware checks FPGAs in the background (no checks in mux mode):
+// states that are gone are reported again
+void emu_notify_update(struct emu_device *ed)
+{
+	if (!ed->notify_num || ed->mux_num)
+		return;
+	int found[2];
+	emu_notify_events(ed, found);
+	ed->notify_sent[0] &= found[0];
+	ed->notify_sent[1] &= found[1];
+}
+
+// Interrupt transfer: message is sent when there are new events
+int emu_device_wait_event(struct device *device, unsigned char *events,
+		int timeout_ms)
+{
+	struct emu_device *ed = device->transport_data;
+	long long deadline = emu_time_usec() + timeout_ms * 1000LL;
+
+	for ( ; ; ) {
+		if (ed->notify_num && !ed->mux_num) {
+			emu_device_update(device);
+			int found[2];
+			emu_notify_events(ed, found);
+			if (found[0] != ed->notify_sent[0] || found[1] != ed->notify_sent[1]) {
+				events[0] = found[0];
+				events[1] = found[1];
+				ed->notify_sent[0] = found[0];
+				ed->notify_sent[1] = found[1];
+				return 0;
+			}
+		}
+
+		long long now = emu_time_usec();
+		if (now >= deadline)
+			return LIBUSB_ERROR_TIMEOUT;
+		usleep(deadline - now < EMU_NOTIFY_POLL_USEC
+				? deadline - now : EMU_NOTIFY_POLL_USEC);
+	}
+}
+
+void emu_device_invalidate(struct device *device)
+{
+}
+
+void emu_device_delete(struct device *device)
+{
+	struct emu_device *ed = device->transport_data;
+	int i;
+	for (i = 0; i < device->num_of_fpgas; i++) {
+		struct emu_fpga *ef = &ed->fpga[i];
+		if (ef->comm)
+			pkt_comm_delete(ef->comm);
+		if (ef->inpkt)
+			pkt_delete(ef->inpkt);
+		if (ef->word_list)
+			pkt_delete(ef->word_list);
+	}
+	free(ed);
+	device->transport_data = NULL;
+}
+
+struct device_transport device_transport_emu = {
+	"emulator",
+	emu_fpga_select,
+	emu_fpga_status,
+	emu_device_status_all,
+	emu_fpga_write,
+	emu_fpga_read,
+	emu_device_control,
+	emu_device_invalidate,
+	emu_device_delete,
+	EMU_INPUT_PROG_FULL,
+	emu_device_wait_event
+};
+
+
+struct device *device_emu_new(int num, int num_of_fpgas)
+{
+	if (num_of_fpgas <= 0 || num_of_fpgas > DEVICE_FPGAS_MAX) {
+		fprintf(stderr, "device_emu_new(): bad num_of_fpgas %d\n", num_of_fpgas);
+		return NULL;
+	}
+
+	struct emu_device *ed = malloc(sizeof(struct emu_device));
+	if (!ed) {
+		fprintf(stderr, "device_emu_new(): unable to allocate %d bytes\n",
+				(int)sizeof(struct emu_device));
+		return NULL;
+	}
+	memset(ed, 0, sizeof(struct emu_device));
+	ed->ztex_device.busnum = -1;
+	ed->ztex_device.devnum = num;
+	ed->ztex_device.num_of_fpgas = num_of_fpgas;
+	ed->ztex_device.valid = 1;
+	snprintf(ed->ztex_device.snString, ZTEX_SNSTRING_LEN, "EMU%07d", num);
+
+	// FPGA side receives up to the size of input FIFO
+	ed->params.alignment = OUTPUT_WORD_WIDTH;
+	ed->params.output_max_len = OUTPUT_WORD_WIDTH;
+	ed->params.input_max_len = EMU_INPUT_FIFO_SIZE;
+
+	struct device *device = malloc(sizeof(struct device));
+	if (!device) {
+		fprintf(stderr, "device_emu_new(): unable to allocate %d bytes\n",
+				(int)sizeof(struct device));
+		free(ed);
+		return NULL;
+	}
+	memset(device, 0, sizeof(struct device));
+	device->ztex_device = &ed->ztex_device;
+	device->handle = NULL;
+	device->num_of_fpgas = num_of_fpgas;
+	device->selected_fpga = 0;
+	device->transport = &device_transport_emu;
+	device->transport_data = ed;
+	device->valid = 1;
+
+	long long now = emu_time_usec();
+	int i;
+	for (i = 0; i < num_of_fpgas; i++) {
+		struct fpga *fpga = &device->fpga[i];
+		fpga->device = device;
+		fpga->num = i;
+		fpga->valid = 1;
+
+		// Inouttraffic bitstreams have hs_io disabled by default
+		struct emu_fpga *ef = &ed->fpga[i];
+		ef->num = i;
+		ef->output_limit_enable = 1;
+		ef->update_time = now;
+		ef->comm = pkt_comm_new(&ed->params);
+		if (!ef->comm) {
+			device_delete(device);
+			return NULL;
+		}
+	}
+	device->num_of_valid_fpgas = num_of_fpgas;
+	return device;
+}
+
+struct device_list *device_emu_list_new(int count, int num_of_fpgas)
+{
+	struct device_list *device_list = device_list_new(NULL);
+	if (!device_list)
+		return NULL;
+
+	int i;
+	for (i = 0; i < count; i++) {
+		struct device *device = device_emu_new(i, num_of_fpgas);
+		if (!device)
+			continue;
+		device_list_add(device_list, device);
+	}
+	return device_list;
+}
@@ -0,0 +1,152 @@
+// ***************************************************************
+//
+// Software emulator of ZTEX 1.15y board with inouttraffic
+// firmware and bitstream (struct device_transport)
+//
+// * Vendor requests and commands used by the host:
+//   0x80, 0x82, 0x84, 0x85, 0x86, 0x88, 0x8B, 0x8C, 0x8D, 0x8E, 0x8F, 0x90,
+//   0x91
+// * EP6 OUT / EP2 IN bulk transfers to the selected FPGA:
+//   32 KB input FIFO with prog_full when less than 16 KB is free,
+//   free space is reported with VR 0x8C,
+//   32 KB output FIFO, no more than 32766 bytes in 1 read
+//   (output limit registered with VR 0x85 / 0x8C)
+// * Listen mode (VC 0x8F): FPGAs in broadcast mask also receive data
+//   written to the selected FPGA; data that doesn't fit is lost
+// * Mux mode (VC 0x90): tagged frames (MUX_TAG) in both directions,
+//   selection of FPGAs in turn by the firmware takes EMU_MUX_FRAME_USEC
+// * Notification (VC 0x91): interrupt endpoint, the firmware checks
+//   FPGAs every EMU_NOTIFY_POLL_USEC
+// * Software model of pkt_comm.v application mode 2:
+//   word_gen (0x02) and word_list (0x01) input packets,
+//   0x81 result packets
+// * USB latency and bandwidth, FPGA generation rate are configurable
+//   with 'emu_params', so device_pkt_rw() throughput is realistic
+//
+// Requires pkt_comm/word_gen.h.
+// Emulated devices are initialized like real ones with
+// device_list_init() (no bitstream upload takes place).
+//
+// ***************************************************************
+
+// FPGA FIFO sizes, bytes
+#define EMU_INPUT_FIFO_SIZE		32768
+#define EMU_INPUT_PROG_FULL		16384	// prog_full if free space is less than that
+#define EMU_OUTPUT_FIFO_SIZE	32768
+#define EMU_OUTPUT_LIMIT_MAX	32766
+
+// Mux mode: firmware selects next FPGA and registers output limit
+#define EMU_MUX_FRAME_USEC		5
+// Bulk IN stream: frames not read yet
+#define EMU_MUX_OUT_SIZE		(65536 + MUX_TAG_IN_LEN + EMU_OUTPUT_LIMIT_MAX)
+
+// Notification: the firmware checks FPGAs once per USB frame
+#define EMU_NOTIFY_POLL_USEC	1000
+
+// 0x81 result packet: 10-byte header, 14 bytes data, 2 checksums
+#define EMU_RESULT_DATA_LEN		14
+#define EMU_RESULT_PKT_LEN		32
+
+// FPGA's pkt_comm_status bits (pkt_comm.v)
+#define EMU_ERR_INPKT_CHECKSUM	0x01
+#define EMU_ERR_INPKT_TYPE		0x04
+#define EMU_ERR_WORD_LIST_LEN	0x20
+#define EMU_ERR_WORD_GEN_CONF	0x40
+
+struct emu_params {
+	int cmd_latency_usec;	// control transfer
+	int bulk_latency_usec;	// bulk transfer, in addition to transmit time
+	int bandwidth;			// bulk transfers, bytes/s
+	int words_per_sec;		// word generator rate (each FPGA)
+	unsigned short bitstream_type;
+	// VR 0x8C, 0x8D replies without input_free (older firmware)
+	int status_no_input_free;
+	// VR 0x8D stalls (inouttraffic.ihx in the repository)
+	int no_status_all;
+};
+
+// Defaults: 250, 125, 30 MB/s, 20M words/s, 0x0001, 0, 0
+extern struct emu_params emu_params;
+
+struct emu_fpga {
+	int num;
+	int hs_io_enable;
+	int output_limit_enable;
+	int app_mode;
+	unsigned char pkt_comm_status;
+
+	// Input FIFO: data is parsed into packets on write;
+	// bytes are released when packets are processed
+	struct pkt_comm *comm;
+	int input_bytes;
+	struct pkt *inpkt;		// packet waiting for processing
+
+	// Output FIFO
+	unsigned char output_fifo[EMU_OUTPUT_FIFO_SIZE];
+	int output_start;
+	int output_len;
+	int output_limit;		// registered output limit, bytes
+
+	// Word generator
+	int gen_active;			// configuration loaded
+	int gen_running;		// generating for current word
+	int num_ranges;
+	struct word_gen_char_range ranges[RANGES_MAX];
+	int num_words;
+	int word_insert_pos;
+	unsigned long num_generate;
+	unsigned short pkt_id;
+	int range_idx[RANGES_MAX];
+	unsigned long long gen_id;
+	unsigned long long gen_total;
+
+	// Word list
+	struct pkt *word_list;
+	int word_list_offset;
+	int word_count;
+	unsigned short word_id;
+	unsigned char word[WORD_MAX_LEN];
+	int word_len;
+
+	unsigned int mux_received;	// bytes received in mux mode
+
+	long long update_time;	// usec
+	double gen_budget;		// words FPGA could have generated
+	uint64_t results;
+};
+
+struct emu_device {
+	// device->ztex_device points here (serial number for messages)
+	struct ztex_device ztex_device;
+	struct pkt_comm_params params;	// FPGA side pkt_comm parameters
+	long long busy_until;		// USB is busy until that time, usec
+	int selected_fpga;
+	int broadcast_mask;		// FPGAs in listen mode (VC 0x8F)
+
+	// Mux mode (VC 0x90)
+	int mux_num;			// 0: disabled
+	int mux_next;			// FPGA to output next frame
+	unsigned char mux_out[EMU_MUX_OUT_SIZE];
+	int mux_out_len;
+	unsigned char mux_in_tag[MUX_TAG_OUT_LEN];
+	int mux_in_tag_len;
+	int mux_in_num;			// FPGA the frame is for
+	int mux_in_remain;		// frame data bytes not received yet
+
+	// Notification (VC 0x91)
+	int notify_num;			// 0: disabled
+	int notify_output;		// output threshold, bytes
+	int notify_input;		// input FIFO free space threshold, bytes
+	int notify_sent[2];		// events reported
+	struct emu_fpga fpga[DEVICE_FPGAS_MAX];
+};
+
+extern struct device_transport device_transport_emu;
+
+// Creates emulated device with 'num_of_fpgas' FPGAs.
+// 'num' is used in device's serial number.
+struct device *device_emu_new(int num, int num_of_fpgas);
+
+// Creates list of 'count' emulated devices,
+// initialization with device_list_init() is required
+struct device_list *device_emu_list_new(int count, int num_of_fpgas);
@@ -8,6 +8,8 @@
 #include "ztex.h"
 #include "inouttraffic.h"
 #include "pkt_comm/pkt_comm.h"
+#include "device.h"
+#include "device_async.h"
 
 
 int DEBUG = 0;
@@ -64,6 +66,88 @@ int fpga_hs_io_enable(struct libusb_device_handle *handle, int enable)
 }
 
 
+// =======================================================================
+//
+// USB link layer (struct device_transport)
+//
+// =======================================================================
+
+int usb_fpga_select(struct fpga *fpga)
+{
+	return vendor_command(fpga->device->handle, 0x8E, fpga->num, 0, NULL, 0);
+}
+
+int usb_fpga_status(struct fpga *fpga, struct fpga_status *fpga_status)
+{
+	return vendor_request(fpga->device->handle, 0x8C, fpga->num, 0,
+		(unsigned char *)fpga_status, sizeof(struct fpga_status));
+}
+
+int usb_device_status_all(struct device *device, int reg_mask,
+		struct fpga_status *fpga_status)
+{
+	return vendor_request(device->handle, 0x8D, device->num_of_fpgas, reg_mask,
+		(unsigned char *)fpga_status,
+		device->num_of_fpgas * sizeof(struct fpga_status));
+}
+
+int usb_fpga_write(struct fpga *fpga, unsigned char *data, int len, int *transferred)
+{
+	return libusb_bulk_transfer(fpga->device->handle, 0x06, data, len,
+			transferred, USB_RW_TIMEOUT);
+}
+
+int usb_fpga_read(struct fpga *fpga, unsigned char *buf, int len, int *transferred)
+{
+	return libusb_bulk_transfer(fpga->device->handle, 0x82, buf, len,
+			transferred, USB_RW_TIMEOUT);
+}
+
+int usb_device_control(struct device *device, int cmd, int value, int index,
+		unsigned char *buf, int length)
+{
+	if (buf && length)
+		return vendor_request(device->handle, cmd, value, index, buf, length);
+	else
+		return vendor_command(device->handle, cmd, value, index, NULL, 0);
+}
+
+int usb_device_wait_event(struct device *device, unsigned char *events,
+		int timeout_ms)
+{
+	unsigned char buf[64];
+	int transferred;
+	int result = libusb_interrupt_transfer(device->handle, 0x81, buf,
+			sizeof(buf), &transferred, timeout_ms);
+	if (result < 0)
+		return result;
+	if (transferred < 2)
+		return LIBUSB_ERROR_IO;
+	events[0] = buf[0];
+	events[1] = buf[1];
+	return 0;
+}
+
+void usb_device_invalidate(struct device *device)
+{
+	libusb_release_interface(device->handle, 0);
+}
+
+struct device_transport device_transport_usb = {
+	"usb",
+	usb_fpga_select,
+	usb_fpga_status,
+	usb_device_status_all,
+	usb_fpga_write,
+	usb_fpga_read,
+	usb_device_control,
+	usb_device_invalidate,
+	NULL,
+	FPGA_INPUT_CREDIT,
+	usb_device_wait_event
+};
+
+
 // =======================================================================
 //
 // Following functions all use 'struct device' and 'struct fpga'
@@ -81,22 +165,37 @@ struct device *device_new(struct ztex_device *ztex_device)
 	device->num_of_fpgas = ztex_device->num_of_fpgas;
 	device->selected_fpga = ztex_device->selected_fpga;
 	device->num_of_valid_fpgas = 0;
+	device->transport = &device_transport_usb;
+	device->transport_data = NULL;
+	device->status_all_unsupported = 0;
 
 	int i;
 	for (i = 0; i < device->num_of_fpgas; i++) {
 		device->fpga[i].device = device;
 		device->fpga[i].num = i;
 		device->fpga[i].valid = 0;
+		device->fpga[i].caps = 0;
 		device->fpga[i].wr.io_state_valid = 0;
 		device->fpga[i].wr.io_state_timeout_count = 0;
 		device->fpga[i].wr.wr_count = 0;
+		device->fpga[i].wr.credit = 0;
+		device->fpga[i].wr.credit_wr_count = 0;
 		device->fpga[i].rd.read_limit_valid = 0;
 		device->fpga[i].rd.read_count = 0;
 		device->fpga[i].rd.partial_read_count = 0;
 		device->fpga[i].cmd_count = 0;
+		memset(&device->fpga[i].sched, 0, sizeof(struct fpga_sched));
+		device->fpga[i].duplex_wr = NULL;
+		device->fpga[i].duplex_rd = NULL;
 		// packet-based communication
 		device->fpga[i].comm = NULL;
 	}
+	device->async = NULL;
+	device->worker = NULL;
+	device->broadcast = NULL;
+	device->broadcast_mode = DEVICE_BROADCAST_UNKNOWN;
+	device->mux = NULL;
+	device->notify = 0;
 
 	int result;
 	//if (usb_set_configuration(handle, 1) < 0) {
@@ -121,6 +220,8 @@ struct device *device_new(struct ztex_device *ztex_device)
 void device_delete(struct device *device)
 {
 	device_invalidate(device);
+	if (device->transport->delete)
+		device->transport->delete(device);
 	free(device);
 }
 
@@ -132,13 +233,25 @@ void device_invalidate(struct device *device)
 		return;
 	device->valid = 0;
 
+	// in-flight transfers must complete before pkt_comm is deleted
+	if (device->async)
+		device_async_delete(device);
+
 	int i;
 	for (i = 0; i < device->num_of_fpgas; i++) {
+		fpga_rw_duplex_delete(&device->fpga[i]);
 		if (device->fpga[i].comm)
 			pkt_comm_delete(device->fpga[i].comm);
+		device->fpga[i].comm = NULL;
 	}
+	if (device->broadcast)
+		pkt_comm_delete(device->broadcast);
+	device->broadcast = NULL;
+	free(device->mux);
+	device->mux = NULL;
+	device->notify = 0;
 
-	libusb_release_interface(device->handle, 0);
+	device->transport->invalidate(device);
 	ztex_device_invalidate(device->ztex_device);
 }
 
@@ -260,15 +373,19 @@ int fpga_test_get_id(struct fpga *fpga)
 	struct fpga_echo_request echo;
 	echo.out[0] = random();
 	echo.out[1] = random();
-	int result = vendor_request(fpga->device->handle, 0x88, echo.out[0], echo.out[1],
-		(unsigned char *)&echo.reply, sizeof(echo.reply));
+	int result = fpga->device->transport->control(fpga->device, 0x88,
+		echo.out[0], echo.out[1], (unsigned char *)&echo.reply, sizeof(echo.reply));
 	int test_ok =
 		(echo.reply.data[0] ^ MAGIC_W) == echo.out[0]
 		&& (echo.reply.data[1] ^ MAGIC_W) == echo.out[1];
-	if (test_ok)
+	if (test_ok) {
 		fpga->bitstream_type = echo.reply.bitstream_type;
-	else
+		fpga->caps = echo.reply.caps;
+	}
+	else {
 		fpga->bitstream_type = 0;
+		fpga->caps = 0;
+	}
 
 	if (DEBUG) {
 		printf("fpga_test_get_id(%d): request 0x%04X 0x%04X, reply 0x%04X 0x%04X",
@@ -297,7 +414,10 @@ int device_check_bitstream_type(struct device *device, unsigned short bitstream_
 	int i;
 	for (i = 0; i < device->num_of_fpgas; i++) {
 		int result;
-		result = ztex_select_fpga(device->ztex_device, i);//fpga_select(&device->fpga[i]);
+		if (device->transport == &device_transport_usb)
+			result = ztex_select_fpga(device->ztex_device, i);//fpga_select(&device->fpga[i]);
+		else
+			result = fpga_select(&device->fpga[i]);
 		if (result < 0)
 			return result;
 		result = fpga_test_get_id(&device->fpga[i]);
@@ -386,7 +506,7 @@ int device_list_check_bitstreams(struct device_list *device_list, unsigned short
 
 int fpga_set_app_mode(struct fpga *fpga, int app_mode)
 {
-	int result = vendor_command(fpga->device->handle, 0x82, app_mode, 0, NULL, 0);
+	int result = fpga->device->transport->control(fpga->device, 0x82, app_mode, 0, NULL, 0);
 	fpga->cmd_count++;
 	if (DEBUG) printf("fpga_set_app_mode(%d): %d\n", fpga->num, app_mode);
 	return result;
@@ -444,12 +564,14 @@ int device_list_fpga_reset(struct device_list *device_list)
 // unlike ztex_select_fpga(), it waits for I/O timeout
 int fpga_select(struct fpga *fpga)
 {
-	int result = vendor_command(fpga->device->handle, 0x8E, fpga->num, 0, NULL, 0);
+	int result = fpga->device->transport->select(fpga);
 	fpga->cmd_count++;
 	if (DEBUG) printf("fpga_select(%d): %d\n", fpga->num, result);
 	if (result < 0) {
 		printf("fpga_select(%d): %s\n", fpga->num, libusb_strerror(result));
+		return result;
 	}
+	fpga->device->selected_fpga = fpga->num;
 	return result;
 }
 
@@ -457,24 +579,117 @@ int fpga_select(struct fpga *fpga)
 int fpga_select_setup_io(struct fpga *fpga)
 {
 	struct fpga_status fpga_status;
-	int result = vendor_request(fpga->device->handle, 0x8C, fpga->num, 0,
-		(unsigned char *)&fpga_status, sizeof(fpga_status));
+	int result = fpga->device->transport->status(fpga, &fpga_status);
 	fpga->cmd_count++;
 	if (result < 0)
 		return result;
-	fpga_status.read_limit *= OUTPUT_WORD_WIDTH;
+	fpga->device->selected_fpga = fpga->num;
+	return fpga_update_status(fpga, &fpga_status, result);
+}
+
+int fpga_setup_output_limit(struct fpga *fpga)
+{
+	unsigned char output_limit[2] = {0,0};
+	int result = fpga->device->transport->control(fpga->device, 0x85, 0, 0,
+			output_limit, 2);
+	fpga->cmd_count++;
+	if (result < 0)
+		return result;
+	fpga->rd.read_limit = OUTPUT_WORD_WIDTH
+			* (unsigned int)((output_limit[1] << 8) + output_limit[0]);
+	fpga->rd.read_limit_valid = 1;
+	if (DEBUG) printf("fpga_setup_output_limit(%d): limit %u\n",
+			fpga->num, fpga->rd.read_limit);
+	return result;
+}
+
+// stores reply to VR 0x8C in 'struct fpga'
+int fpga_update_status(struct fpga *fpga, struct fpga_status *fpga_status, int len)
+{
+	if (len < FPGA_STATUS_LEN_MIN) {
+		fprintf(stderr, "fpga_update_status(%d): reply %d bytes\n",
+				fpga->num, len);
+		return LIBUSB_ERROR_IO;
+	}
+	// input_free isn't there, even if the bitstream supports it
+	if (len < sizeof(struct fpga_status))
+		fpga_status->io_state.io_state &= ~IO_STATE_INPUT_FREE_VALID;
+
+	fpga_status->read_limit *= OUTPUT_WORD_WIDTH;
 	if (DEBUG) {
-		struct fpga_io_state *io_state = &fpga_status.io_state;
-		printf("fpga_select_setup_io(%d): state 0x%02x 0x%02x 0x%02x - 0x%02x 0x%02x 0x%02x, limit %u\n",
+		struct fpga_io_state *io_state = &fpga_status->io_state;
+		printf("fpga_select_setup_io(%d): state 0x%02x 0x%02x 0x%02x - 0x%02x 0x%02x 0x%02x, limit %u, free %u\n",
 			fpga->num,
 			io_state->io_state, io_state->timeout, io_state->app_status,
 			io_state->pkt_comm_status, io_state->debug2, io_state->debug3,
-			fpga_status.read_limit);
+			fpga_status->read_limit, fpga_status->input_free);
 	}
-	fpga->wr.io_state = fpga_status.io_state;
+	fpga->wr.io_state = fpga_status->io_state;
 	fpga->wr.io_state_valid = 1;
-	fpga->rd.read_limit = fpga_status.read_limit;
+	if (fpga_status->io_state.io_state & IO_STATE_INPUT_FREE_VALID) {
+		fpga->wr.credit = fpga_status->input_free * INPUT_WORD_WIDTH;
+		if (fpga->wr.credit)
+			fpga->wr.io_state.io_state &= ~IO_STATE_INPUT_PROG_FULL;
+		else
+			fpga->wr.io_state.io_state |= IO_STATE_INPUT_PROG_FULL;
+	}
+	else
+		fpga->wr.credit = fpga_status->io_state.io_state & IO_STATE_INPUT_PROG_FULL
+				? 0 : fpga->device->transport->input_credit;
+	fpga->rd.read_limit = fpga_status->read_limit;
 	fpga->rd.read_limit_valid = 1;
+	return 0;
+}
+
+int device_status_all_supported(struct device *device)
+{
+	return device->transport->status_all && !device->status_all_unsupported;
+}
+
+int device_select_setup_io(struct device *device, int reg_mask)
+{
+	struct fpga_status fpga_status[DEVICE_FPGAS_MAX];
+	int result;
+	int num;
+
+	if (!device_status_all_supported(device)) {
+		for (num = 0; num < device->num_of_fpgas; num++) {
+			if (!(reg_mask & 1 << num))
+				continue;
+			result = fpga_select_setup_io(&device->fpga[num]);
+			if (result < 0)
+				return result;
+			device->fpga[num].sched.status_valid = 1;
+		}
+		return 0;
+	}
+
+	result = device->transport->status_all(device, reg_mask, fpga_status);
+	device->fpga[device->num_of_fpgas - 1].cmd_count++;
+	// The firmware doesn't support VR 0x8D
+	if (result == LIBUSB_ERROR_PIPE) {
+		device->status_all_unsupported = 1;
+		if (!reg_mask)
+			return result;
+		return device_select_setup_io(device, reg_mask);
+	}
+	if (result < 0)
+		return result;
+	device->selected_fpga = device->num_of_fpgas - 1;
+
+	// Replies are FPGA_STATUS_LEN_MIN bytes each if the firmware
+	// doesn't report input_free
+	int len = result / device->num_of_fpgas;
+	if (len > sizeof(struct fpga_status))
+		len = sizeof(struct fpga_status);
+	for (num = 0; num < device->num_of_fpgas; num++) {
+		struct fpga_status status;
+		memcpy(&status, (unsigned char *)fpga_status + num * len, len);
+		int result_update = fpga_update_status(&device->fpga[num], &status, len);
+		if (result_update < 0)
+			return result_update;
+		device->fpga[num].sched.status_valid = 1;
+	}
 	return result;
 }
 
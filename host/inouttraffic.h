@@ -11,6 +11,7 @@
 #define DEVICE_FPGAS_MAX 4
 
 #define OUTPUT_WORD_WIDTH 2
+#define INPUT_WORD_WIDTH 2
 
 extern int DEBUG;
 
@@ -29,9 +30,27 @@ struct fpga_io_state {
 
 // fpga_io_state.io_state
 #define IO_STATE_INPUT_PROG_FULL 0x01
+// Bitstream guarantees that much free space in input FIFO
+// when IO_STATE_INPUT_PROG_FULL is deasserted
+#define FPGA_INPUT_CREDIT 16384
 #define IO_STATE_LIMIT_NOT_DONE 0x02
 #define IO_STATE_OUTPUT_ERR_OVERFLOW 0x04
 #define IO_STATE_SFIFO_NOT_EMPTY 0x08
+// Bitstream reports free space in input FIFO (fpga_status.input_free)
+#define IO_STATE_INPUT_FREE_VALID 0x40
+// Bitstream supports listen mode (broadcast write, VC 0x8F)
+#define IO_STATE_LISTEN 0x80
+
+// Mux mode: data in both directions goes in frames, each frame starts
+// with a tag. Host -> FPGA: FPGA number, MUX_TAG, data length
+// in 16-bit words. FPGA -> host: FPGA number (MUX_TAG_ERROR bit
+// if FPGA reports an error), MUX_TAG, data length, input FIFO free space
+// and words received since mux mode was enabled (modulo 2**16).
+// 16-bit values are little-endian.
+#define MUX_TAG 0xA5
+#define MUX_TAG_ERROR 0x80
+#define MUX_TAG_OUT_LEN 4
+#define MUX_TAG_IN_LEN 8
 
 // used by VR 0x88, fpga_test_get_id() 
 struct fpga_echo_request {
@@ -39,11 +58,17 @@ struct fpga_echo_request {
 	struct {
 		unsigned short data[2];
 		unsigned char fpga_id;
-		unsigned char reserved;
+		unsigned char caps; // 0 from older firmware or bitstream
 		unsigned short bitstream_type;
 	} reply;
 };
 
+// fpga_echo_request.reply.caps (VCR 0x98)
+// Bitstream supports mux mode (VC 0x90, device_mux_enable())
+#define FPGA_CAP_MUX 0x01
+// Bitstream supports stream mode (VC 0x92, device_stream_enable())
+#define FPGA_CAP_STREAM 0x02
+
 // Requests 'struct fpga_io_state' fro currently selected FPGA
 int fpga_get_io_state(struct libusb_device_handle *handle, struct fpga_io_state *io_state);
 
@@ -72,8 +97,14 @@ int fpga_output_limit_enable(struct libusb_device_handle *handle, int enable);
 struct fpga_status {
 	struct fpga_io_state io_state;
 	unsigned short read_limit;
+	// in INPUT_WORD_WIDTH words, valid if IO_STATE_INPUT_FREE_VALID
+	unsigned short input_free;
 };
 
+// Firmware before input_free was added replies with io_state
+// and read_limit only
+#define FPGA_STATUS_LEN_MIN	8
+
 struct fpga_wr {
 	struct fpga_io_state io_state;
 	int io_state_valid; // io_state was taken from other source
@@ -81,6 +112,8 @@ struct fpga_wr {
 	int io_state_timeout_count;
 	int wr_done;
 	uint64_t wr_count;
+	int credit; // bytes FPGA accepts without status request
+	uint64_t credit_wr_count; // writes performed without status request
 	unsigned char *buf; // used only by test.c
 	int len;
 };
@@ -95,20 +128,77 @@ struct fpga_rd {
 	int len;
 };
 
+// device_pkt_rw() scheduler state
+struct fpga_sched {
+	int read_limit;		// read_limit at last status
+	int input_full;		// FPGA input was full at last visit
+	int idle_skip;		// skip that many visits (FPGA was idle)
+	int skip_count;
+	uint64_t data_bytes;	// bytes written and read by device_pkt_rw()
+	int status_valid;	// status was taken by device_select_setup_io(), not used yet
+	int stay;			// FPGA remains selected after full read
+};
+
 struct fpga {
 	struct device *device;
 	//struct fpga_id fpga_id;
 	unsigned short bitstream_type;
+	unsigned char caps; // FPGA_CAP_*, from fpga_test_get_id()
 	int num;
 	int valid; // actually not used; on a valid device all FPGA's are OK
 	struct fpga_wr wr;
 	struct fpga_rd rd;
 	uint64_t cmd_count;
 	uint64_t data_out,data_in; // specific for advanced_test.c
+	struct fpga_sched sched;
+	// fpga_rw_duplex() transfers, allocated at first use;
+	// 'done' is set when transfer isn't submitted
+	struct libusb_transfer *duplex_wr, *duplex_rd;
+	int duplex_wr_done, duplex_rd_done;
 	
 	struct pkt_comm *comm;
 };
 
+// Link layer for packet communication (pkt_comm).
+// device_transport_usb is used by default;
+// other implementations are in-process loopback (loopback.h)
+// and board emulator (emulator.h).
+// Functions return libusb error codes.
+struct device_transport {
+	char *name;
+	// select FPGA (VC 0x8E)
+	int (*select)(struct fpga *fpga);
+	// select FPGA, get io_state, register output limit (VR 0x8C).
+	// read_limit is in OUTPUT_WORD_WIDTH words
+	int (*status)(struct fpga *fpga, struct fpga_status *fpga_status);
+	// same as 'status' on FPGAs 0 .. num_of_fpgas-1 in 1 request (VR 0x8D),
+	// output limit is registered on FPGAs from 'reg_mask' only.
+	// The last FPGA remains selected. NULL if not supported
+	int (*status_all)(struct device *device, int reg_mask,
+			struct fpga_status *fpga_status);
+	// write to / read from selected FPGA
+	int (*write)(struct fpga *fpga, unsigned char *data, int len, int *transferred);
+	int (*read)(struct fpga *fpga, unsigned char *buf, int len, int *transferred);
+	// vendor request (if 'buf' and 'length' are set) or vendor command.
+	// Used by initialization functions (VC 0x8B, VR 0x88, VC 0x82)
+	int (*control)(struct device *device, int cmd, int value, int index,
+			unsigned char *buf, int length);
+	// invoked by device_invalidate()
+	void (*invalidate)(struct device *device);
+	// invoked by device_delete(), can be NULL
+	void (*delete)(struct device *device);
+	// bytes FPGA accepts when input isn't prog_full
+	// (unless status reports actual free space, IO_STATE_INPUT_FREE_VALID);
+	// 0 if link layer requires status request before each write
+	int input_credit;
+	// waits for notification message (2 bytes, VC 0x91) from interrupt
+	// endpoint, LIBUSB_ERROR_TIMEOUT if there's none. NULL if not supported
+	int (*wait_event)(struct device *device, unsigned char *events,
+			int timeout_ms);
+};
+
+extern struct device_transport device_transport_usb;
+
 struct device {
 	struct ztex_device *ztex_device;
 	struct device *next;
@@ -118,8 +208,28 @@ struct device {
 	int num_of_valid_fpgas; // actually not used; on a valid device all FPGA's are OK
 	int num_of_fpgas;
 	int selected_fpga;
+	struct device_transport *transport;
+	void *transport_data;
+	// the firmware doesn't support VR 0x8D (device_select_setup_io())
+	int status_all_unsupported;
+	// state of asynchronous I/O engine (device_async.c)
+	struct device_async *async;
+	// I/O worker servicing the device (device_worker.c)
+	struct worker_device *worker;
+	// packets for every FPGA of the device (device_pkt_broadcast())
+	struct pkt_comm *broadcast;
+	int broadcast_mode;
+	// mux mode state (device_mux_enable()), NULL if disabled
+	struct device_mux *mux;
+	// notification is enabled (device_notify_enable())
+	int notify;
 };
 
+// device->broadcast_mode, determined before the first broadcast write
+#define DEVICE_BROADCAST_UNKNOWN	0
+#define DEVICE_BROADCAST_LISTEN		1	// 1 write, other FPGAs listen
+#define DEVICE_BROADCAST_COPY		2	// packets are copied to each FPGA
+
 struct device_list {
 	struct device *device;
 	struct ztex_dev_list *ztex_dev_list;
@@ -173,7 +283,7 @@ int device_check_bitstream_type(struct device *device, unsigned short bitstream_
 // Returns: number of devices with bitstreams uploaded
 int device_list_check_bitstreams(struct device_list *device_list, unsigned short BITSTREAM_TYPE, const char *filename);
 
-// tests if bitstream from currently selected FPGA is operational and gets bitstream_type
+// tests if bitstream from currently selected FPGA is operational and gets bitstream_type, caps
 // Returns:
 // < 0 on I/O error
 // 0 bitstream isn't operational or unable to get bitstream_type
@@ -198,6 +308,36 @@ int fpga_select(struct fpga *fpga);
 // combines fpga_select(), fpga_get_io_state(), fpga_setup_output() in 1 USB request
 int fpga_select_setup_io(struct fpga *fpga);
 
+// registers output limit on the selected FPGA (VR 0x85) via link layer,
+// stores it in fpga->rd.read_limit. Status and input credit aren't updated
+int fpga_setup_output_limit(struct fpga *fpga);
+
+// stores reply to VR 0x8C of 'len' bytes (received by
+// fpga_select_setup_io() or asynchronously) in 'struct fpga'.
+// If the bitstream reports input free space, that becomes input credit
+// and IO_STATE_INPUT_PROG_FULL in fpga->wr.io_state is set only
+// if there's no free space. If the reply is without input_free
+// (FPGA_STATUS_LEN_MIN bytes), credit is based on IO_STATE_INPUT_PROG_FULL.
+// Returns < 0 if the reply is too short.
+int fpga_update_status(struct fpga *fpga, struct fpga_status *fpga_status, int len);
+
+// fpga_select_setup_io() on all FPGAs of the device in 1 USB request
+// (VR 0x8D, performs requests one by one if link layer doesn't support it).
+// Output limit is registered only on FPGAs from 'reg_mask' (bit 0: FPGA #0),
+// other FPGAs get read_limit 0 (if link layer doesn't support VR 0x8D,
+// status of other FPGAs isn't updated). Sets fpga->sched.status_valid
+// on updated FPGAs. Registered output limit must be read before
+// the next status request on that FPGA.
+// If the firmware stalls VR 0x8D (older firmware such as
+// inouttraffic.ihx in the repository), device->status_all_unsupported
+// is set, requests are performed one by one from then on. With empty
+// 'reg_mask' there's nothing to do that way, LIBUSB_ERROR_PIPE is returned.
+int device_select_setup_io(struct device *device, int reg_mask);
+
+// Status of all FPGAs in 1 request (VR 0x8D) is available:
+// link layer supports it and the firmware didn't stall the request
+int device_status_all_supported(struct device *device);
+
 // in OUTPUT_WORD_WIDTH words, default 0.
 // fpga_setup_output() would return 0 if amount in output buffer is less than limit_min.
 // if limit_min is greater than output buffer size, limit_min equal to buffer size is used.
@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libusb-1.0/libusb.h>
+
+#include "ztex.h"
+#include "inouttraffic.h"
+#include "pkt_comm/pkt_comm.h"
+#include "loopback.h"
+
+
+void loopback_echo(struct pkt_comm *comm)
+{
+	struct pkt *pkt;
+	while (!pkt_queue_full(comm->output_queue, 1)
+			&& (pkt = pkt_queue_fetch(comm->input_queue)) )
+		pkt_queue_push(comm->output_queue, pkt);
+}
+
+void (*loopback_process)(struct pkt_comm *comm) = loopback_echo;
+
+
+int loopback_fpga_select(struct fpga *fpga)
+{
+	fpga->device->selected_fpga = fpga->num;
+	return 0;
+}
+
+int loopback_fpga_status(struct fpga *fpga, struct fpga_status *fpga_status)
+{
+	struct loopback_device *ld = fpga->device->transport_data;
+	struct loopback_fpga *lf = &ld->fpga[fpga->num];
+
+	fpga->device->selected_fpga = fpga->num;
+	memset(fpga_status, 0, sizeof(struct fpga_status));
+
+	loopback_process(lf->comm);
+
+	// FPGA side input buffer is full
+	if (!pkt_comm_input_get_buf(lf->comm))
+		fpga_status->io_state.io_state |= IO_STATE_INPUT_PROG_FULL;
+	if (lf->comm->error)
+		fpga_status->io_state.pkt_comm_status = 1;
+
+	// Register output limit
+	int len = 0;
+	pkt_comm_get_output_data(lf->comm, &len);
+	lf->read_limit = len;
+	fpga_status->read_limit = len / OUTPUT_WORD_WIDTH;
+	return sizeof(struct fpga_status);
+}
+
+int loopback_device_status_all(struct device *device, int reg_mask,
+		struct fpga_status *fpga_status)
+{
+	int num;
+	for (num = 0; num < device->num_of_fpgas; num++) {
+		loopback_fpga_status(&device->fpga[num], &fpga_status[num]);
+		if (!(reg_mask & 1 << num)) {
+			struct loopback_device *ld = device->transport_data;
+			ld->fpga[num].read_limit = 0;
+			fpga_status[num].read_limit = 0;
+		}
+	}
+	return device->num_of_fpgas * sizeof(struct fpga_status);
+}
+
+int loopback_fpga_write(struct fpga *fpga, unsigned char *data, int len, int *transferred)
+{
+	struct loopback_device *ld = fpga->device->transport_data;
+	struct loopback_fpga *lf = &ld->fpga[fpga->num];
+
+	*transferred = 0;
+	unsigned char *buf = pkt_comm_input_get_buf(lf->comm);
+	if (!buf || len > lf->comm->params->input_max_len)
+		return LIBUSB_ERROR_OVERFLOW;
+
+	memcpy(buf, data, len);
+	if (pkt_comm_input_completed(lf->comm, len, 0) < 0)
+		return LIBUSB_ERROR_IO;
+	*transferred = len;
+
+	loopback_process(lf->comm);
+	return 0;
+}
+
+int loopback_fpga_read(struct fpga *fpga, unsigned char *buf, int len, int *transferred)
+{
+	struct loopback_device *ld = fpga->device->transport_data;
+	struct loopback_fpga *lf = &ld->fpga[fpga->num];
+
+	// FPGA sends no more than registered output limit
+	if (len > lf->read_limit)
+		len = lf->read_limit;
+	*transferred = 0;
+	if (!len)
+		return LIBUSB_ERROR_TIMEOUT;
+
+	int output_len = 0;
+	unsigned char *output_data = pkt_comm_get_output_data(lf->comm, &output_len);
+	if (!output_data || output_len < len)
+		return LIBUSB_ERROR_IO;
+
+	memcpy(buf, output_data, len);
+	pkt_comm_output_completed(lf->comm, len, 0);
+	lf->read_limit -= len;
+	*transferred = len;
+	return 0;
+}
+
+// Initialization functions are not supported
+int loopback_device_control(struct device *device, int cmd, int value, int index,
+		unsigned char *buf, int length)
+{
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+void loopback_device_invalidate(struct device *device)
+{
+	struct loopback_device *ld = device->transport_data;
+	int i;
+	for (i = 0; i < device->num_of_fpgas; i++) {
+		if (ld->fpga[i].comm)
+			pkt_comm_delete(ld->fpga[i].comm);
+		ld->fpga[i].comm = NULL;
+	}
+}
+
+void loopback_device_delete(struct device *device)
+{
+	free(device->transport_data);
+	device->transport_data = NULL;
+}
+
+struct device_transport device_transport_loopback = {
+	"loopback",
+	loopback_fpga_select,
+	loopback_fpga_status,
+	loopback_device_status_all,
+	loopback_fpga_write,
+	loopback_fpga_read,
+	loopback_device_control,
+	loopback_device_invalidate,
+	loopback_device_delete,
+	0,	// input accepts 1 transfer per status request
+	NULL
+};
+
+
+struct device *device_loopback_new(int num, int num_of_fpgas, struct pkt_comm_params *params)
+{
+	if (num_of_fpgas <= 0 || num_of_fpgas > DEVICE_FPGAS_MAX) {
+		fprintf(stderr, "device_loopback_new(): bad num_of_fpgas %d\n", num_of_fpgas);
+		return NULL;
+	}
+
+	struct loopback_device *ld = malloc(sizeof(struct loopback_device));
+	if (!ld) {
+		fprintf(stderr, "device_loopback_new(): unable to allocate %d bytes\n",
+				(int)sizeof(struct loopback_device));
+		return NULL;
+	}
+	memset(ld, 0, sizeof(struct loopback_device));
+	ld->ztex_device.busnum = -1;
+	ld->ztex_device.devnum = num;
+	ld->ztex_device.num_of_fpgas = num_of_fpgas;
+	ld->ztex_device.valid = 1;
+	snprintf(ld->ztex_device.snString, ZTEX_SNSTRING_LEN, "LOOP%06d", num);
+
+	ld->params.alignment = params->alignment;
+	ld->params.output_max_len = params->input_max_len;
+	ld->params.input_max_len = params->output_max_len;
+
+	struct device *device = malloc(sizeof(struct device));
+	if (!device) {
+		fprintf(stderr, "device_loopback_new(): unable to allocate %d bytes\n",
+				(int)sizeof(struct device));
+		free(ld);
+		return NULL;
+	}
+	memset(device, 0, sizeof(struct device));
+	device->ztex_device = &ld->ztex_device;
+	device->handle = NULL;
+	device->num_of_fpgas = num_of_fpgas;
+	device->selected_fpga = 0;
+	device->transport = &device_transport_loopback;
+	device->transport_data = ld;
+	device->valid = 1;
+
+	int i;
+	for (i = 0; i < num_of_fpgas; i++) {
+		struct fpga *fpga = &device->fpga[i];
+		fpga->device = device;
+		fpga->num = i;
+		fpga->valid = 1;
+		fpga->comm = pkt_comm_new(params);
+		ld->fpga[i].comm = pkt_comm_new(&ld->params);
+		if (!fpga->comm || !ld->fpga[i].comm) {
+			device_delete(device);
+			return NULL;
+		}
+	}
+	device->num_of_valid_fpgas = num_of_fpgas;
+	return device;
+}
+
+struct device_list *device_loopback_list_new(int count, int num_of_fpgas, struct pkt_comm_params *params)
+{
+	struct device_list *device_list = device_list_new(NULL);
+	if (!device_list)
+		return NULL;
+
+	int i;
+	for (i = 0; i < count; i++) {
+		struct device *device = device_loopback_new(i, num_of_fpgas, params);
+		if (!device)
+			continue;
+		device_list_add(device_list, device);
+	}
+	return device_list;
+}
@@ -0,0 +1,44 @@
+// ***************************************************************
+//
+// In-process loopback link layer (struct device_transport)
+//
+// * No hardware is involved. FPGA side of packet communication
+//   is another pkt_comm instance for each FPGA.
+// * Data written to FPGA is parsed into packets, packets are
+//   processed with loopback_process() (echo by default),
+//   results are read back by the host.
+// * Used to measure and tune host CPU cost of the packet path
+//   (device_pkt_rw(), pkt_comm) without boards attached.
+//
+// ***************************************************************
+
+struct loopback_fpga {
+	struct pkt_comm *comm;	// FPGA side
+	int read_limit;			// output limit registered by status request
+};
+
+struct loopback_device {
+	// device->ztex_device points here (serial number for messages)
+	struct ztex_device ztex_device;
+	// FPGA side pkt_comm parameters (input and output swapped)
+	struct pkt_comm_params params;
+	struct loopback_fpga fpga[DEVICE_FPGAS_MAX];
+};
+
+extern struct device_transport device_transport_loopback;
+
+// Processes packets on FPGA side: takes packets from comm->input_queue,
+// places results into comm->output_queue.
+// Default: loopback_echo()
+extern void (*loopback_process)(struct pkt_comm *comm);
+
+// Sends input packets back unchanged
+void loopback_echo(struct pkt_comm *comm);
+
+// Creates loopback device with 'num_of_fpgas' FPGAs.
+// Host side pkt_comm is created with 'params'.
+// 'num' is used in device's serial number.
+struct device *device_loopback_new(int num, int num_of_fpgas, struct pkt_comm_params *params);
+
+// Creates list of 'count' loopback devices
+struct device_list *device_loopback_list_new(int count, int num_of_fpgas, struct pkt_comm_params *params);
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <signal.h>
+#include <libusb-1.0/libusb.h>
+
+#include "ztex.h"
+#include "inouttraffic.h"
+#include "pkt_comm/pkt_comm.h"
+#include "pkt_comm/pkt_pool.h"
+#include "device.h"
+#include "loopback.h"
+
+// Host CPU cost of the packet path: packets go through
+// device_pkt_rw() and pkt_comm to loopback devices and back.
+// With in_place, output packets are built in the output ring
+// (pkt_comm_output_reserve()) instead of the output queue.
+//
+// Usage: loopback_test [seconds [data_len [devices [zero_copy [flush_usec [in_place]]]]]]
+
+volatile int signal_received = 0;
+
+void signal_handler(int signum)
+{
+	signal_received = 1;
+}
+
+struct pkt_comm_params pkt_comm_params_test = {
+	2, 16384, 32766
+};
+
+int main(int argc, char **argv)
+{
+	int seconds = argc > 1 ? atoi(argv[1]) : 5;
+	int data_len = argc > 2 ? atoi(argv[2]) : 14;
+	int num_devices = argc > 3 ? atoi(argv[3]) : 1;
+	int zero_copy = argc > 4 ? atoi(argv[4]) : 0;
+	int flush_usec = argc > 5 ? atoi(argv[5]) : 0;
+	int in_place = argc > 6 ? atoi(argv[6]) : 0;
+	if (seconds <= 0 || data_len <= 0 || num_devices <= 0 || flush_usec < 0) {
+		printf("Usage: %s [seconds [data_len [devices [zero_copy [flush_usec [in_place]]]]]]\n",
+				argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	struct device_list *device_list = device_loopback_list_new(num_devices,
+			DEVICE_FPGAS_MAX, &pkt_comm_params_test);
+	fprintf(stderr, "%d loopback device(s), data_len %d, %d s.%s\n",
+			device_list_count(device_list), data_len, seconds,
+			zero_copy ? " Zero-copy input." : "");
+
+	struct device *device;
+	for (device = device_list->device; device; device = device->next) {
+		int num;
+		for (num = 0; num < device->num_of_fpgas; num++) {
+			pkt_comm_set_input_zero_copy(device->fpga[num].comm, zero_copy);
+			pkt_comm_set_output_flush_usec(device->fpga[num].comm, flush_usec);
+		}
+	}
+
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+
+	unsigned long long pkt_out = 0, pkt_in = 0, bytes_in = 0;
+	int pkt_id = 0;
+
+	struct timeval tv0, tv1;
+	gettimeofday(&tv0, NULL);
+	clock_t clock0 = clock();
+
+	for ( ; ; ) {
+		for (device = device_list->device; device; device = device->next) {
+			if (!device_valid(device))
+				continue;
+
+			int num;
+			for (num = 0; num < device->num_of_fpgas; num++) {
+				struct pkt_comm *comm = device->fpga[num].comm;
+				unsigned char *out;
+				while (in_place && (out = pkt_comm_output_reserve(comm, data_len)) ) {
+					memset(out, pkt_id, data_len);
+					pkt_comm_output_commit(comm, 1, pkt_id++, data_len);
+					pkt_out++;
+				}
+				while (!in_place && !pkt_queue_full(comm->output_queue, 1)) {
+					char *data = malloc(data_len);
+					memset(data, pkt_id, data_len);
+					struct pkt *outpkt = pkt_new(1, data, data_len);
+					outpkt->id = pkt_id++;
+					pkt_queue_push(comm->output_queue, outpkt);
+					pkt_out++;
+				}
+			}
+
+			int result = device_pkt_rw(device);
+			if (result < 0) {
+				fprintf(stderr, "SN %s device_pkt_rw(): %d\n",
+					device->ztex_device->snString, result);
+				device_invalidate(device);
+				continue;
+			}
+
+			for (num = 0; num < device->num_of_fpgas; num++) {
+				struct pkt *inpkt;
+				while ( (inpkt = pkt_queue_fetch(device->fpga[num].comm->input_queue)) ) {
+					pkt_in++;
+					bytes_in += inpkt->data_len;
+					pkt_delete(inpkt);
+				}
+			}
+		}
+
+		gettimeofday(&tv1, NULL);
+		if (signal_received || tv1.tv_sec - tv0.tv_sec >= seconds)
+			break;
+		if (!device_list_count(device_list))
+			break;
+	}
+
+	double cpu_sec = (double)(clock() - clock0) / CLOCKS_PER_SEC;
+	double sec = tv1.tv_sec - tv0.tv_sec + (tv1.tv_usec - tv0.tv_usec) / 1e6;
+	printf("packets out: %llu, in: %llu, %.0f packets/s, %.2f MB/s (data)\n",
+			pkt_out, pkt_in, pkt_in / sec, bytes_in / sec / 1048576);
+	printf("CPU time: %.2f s, %.3f usec per packet\n",
+			cpu_sec, pkt_in ? cpu_sec * 1e6 / pkt_in : 0);
+
+	device = device_list->device;
+	if (device && device_valid(device))
+		pkt_pool_print_stats(device->fpga[0].comm->pool);
+	return 0;
+}
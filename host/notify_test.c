@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <libusb-1.0/libusb.h>
+
+#include "ztex.h"
+#include "inouttraffic.h"
+#include "pkt_comm/pkt_comm.h"
+#include "pkt_comm/word_list.h"
+#include "pkt_comm/word_gen.h"
+#include "device.h"
+#include "emulator.h"
+
+// Checks notification (device_notify_enable()): emulated board
+// with 1 FPGA, slow word generation. After the input is written,
+// the test blocks in device_wait_event() and reads results only
+// when the interrupt endpoint reports output ready (or at the timeout,
+// for the rest of output below the threshold).
+// All results must come back, every wakeup must report output
+// and come before the timeout.
+//
+// Usage: notify_test [words [words_per_sec]]
+
+struct device_bitstream bitstream_emu = {
+	0x0001,
+	"(emulated)",	// no upload takes place
+	{ 2, 32768, 32766 }
+};
+
+// 1 candidate per word from the word list
+struct word_gen word_gen_1 = {
+	1,
+	{
+		{ 1, 0, 48 }
+	},
+	1, { 1 },	// insert word at position 1
+	0			// generate all
+};
+
+// Output threshold: the FPGA reports output ready after that many results
+#define NOTIFY_RESULTS		128
+#define NOTIFY_WAIT_MS		1000
+
+long long time_usec()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+// 1 pass of device_pkt_rw(), results are fetched
+int device_rw(struct device *device, unsigned long long *results,
+		unsigned long long *bad_results)
+{
+	int result = device_pkt_rw(device);
+	if (result < 0) {
+		printf("device_pkt_rw(): %d (%s)\n", result, libusb_strerror(result));
+		return result;
+	}
+
+	struct pkt *inpkt;
+	while ( (inpkt = pkt_queue_fetch(device->fpga[0].comm->input_queue)) ) {
+		if (inpkt->type != 0x81 || inpkt->data_len != EMU_RESULT_DATA_LEN)
+			(*bad_results)++;
+		(*results)++;
+		pkt_delete(inpkt);
+	}
+	return result;
+}
+
+int main(int argc, char **argv)
+{
+	int num_words = argc > 1 ? atoi(argv[1]) : 1024;
+	emu_params.words_per_sec = argc > 2 ? atoi(argv[2]) : 20000;
+	if (num_words <= 0 || emu_params.words_per_sec <= 0) {
+		printf("Usage: %s [words [words_per_sec]]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	struct device_list *device_list = device_emu_list_new(1, 1);
+	device_list_init(device_list, &bitstream_emu);
+	struct device *device = device_list->device;
+	if (!device_valid(device)) {
+		printf("Emulated device isn't initialized\n");
+		exit(EXIT_FAILURE);
+	}
+	struct fpga *fpga = &device->fpga[0];
+
+	if (device_notify_enable(device, NOTIFY_RESULTS * EMU_RESULT_PKT_LEN, 0) != 1) {
+		printf("device_notify_enable() failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	char **words = malloc((num_words + 1) * sizeof(char *));
+	char *words_data = malloc(num_words * 8);
+	if (!words || !words_data) {
+		printf("malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	int i;
+	for (i = 0; i < num_words; i++) {
+		words[i] = words_data + i * 8;
+		sprintf(words[i], "w%d", i);
+	}
+	words[num_words] = NULL;
+
+	pkt_queue_push(fpga->comm->output_queue, pkt_word_gen_new(&word_gen_1));
+	pkt_queue_push(fpga->comm->output_queue, pkt_word_list_new(words));
+
+	unsigned long long results = 0, bad_results = 0;
+	int wakeups = 0, blocked = 0, bad_wakeups = 0, timeouts = 0;
+	long long wait_usec = 0;
+
+	// Write the input
+	while (pkt_comm_has_output_data(fpga->comm)) {
+		if (device_rw(device, &results, &bad_results) < 0)
+			exit(EXIT_FAILURE);
+	}
+
+	while (results < num_words && timeouts < 2) {
+		// Nothing to do: block until the FPGA has output ready.
+		// The rest of output below the threshold is read at the timeout.
+		long long usec0 = time_usec();
+		int events = device_wait_event(device, NOTIFY_WAIT_MS);
+		long long usec = time_usec() - usec0;
+		if (events < 0) {
+			printf("device_wait_event(): %d (%s)\n", events, libusb_strerror(events));
+			exit(EXIT_FAILURE);
+		}
+		if (!events)
+			timeouts++;
+		else {
+			wakeups++;
+			wait_usec += usec;
+			if (usec >= 1000)
+				blocked++;
+			if (!(events & DEVICE_EVENT_OUTPUT(0)) || usec >= NOTIFY_WAIT_MS * 1000LL)
+				bad_wakeups++;
+		}
+
+		if (device_rw(device, &results, &bad_results) < 0)
+			exit(EXIT_FAILURE);
+	}
+
+	printf("results: %llu of %d (%llu bad), wakeups: %d (%d bad, %d after"
+			" blocking, %.1f ms avg.), timeouts: %d, control transfers: %llu\n",
+			results, num_words, bad_results, wakeups, bad_wakeups, blocked,
+			wakeups ? wait_usec / 1000.0 / wakeups : 0, timeouts,
+			(unsigned long long)fpga->cmd_count);
+
+	if (results != num_words || bad_results || !blocked || bad_wakeups) {
+		printf("FAILED\n");
+		exit(EXIT_FAILURE);
+	}
+	return 0;
+}
@@ -0,0 +1,288 @@
+#include <string.h>
+
+#include "pkt_comm.h"
+#include "pkt_checksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PKT_CHECKSUM_X86
+#include <immintrin.h>
+#endif
+
+
+int pkt_checksum_supported_always(void)
+{
+	return 1;
+}
+
+// Original implementation: one byte at a time
+PKT_CHECKSUM_TYPE pkt_checksum_sum_bytewise(unsigned char *data, int len)
+{
+	PKT_CHECKSUM_TYPE checksum = 0;
+	PKT_CHECKSUM_TYPE checksum_tmp = 0;
+	int checksum_byte_count = 0;
+
+	int i;
+	for (i = 0; i < len; i++) {
+		checksum_tmp |= data[i] << 8 * checksum_byte_count;
+		if (++checksum_byte_count == PKT_CHECKSUM_LEN) {
+			checksum += checksum_tmp;
+			checksum_tmp = 0;
+			checksum_byte_count = 0;
+		}
+	}
+	return checksum + checksum_tmp;
+}
+
+PKT_CHECKSUM_TYPE pkt_checksum_copy_sum_bytewise(unsigned char *dst,
+		unsigned char *src, int len)
+{
+	memcpy(dst, src, len);
+	return pkt_checksum_sum_bytewise(dst, len);
+}
+
+// Sum of the last (len % 4) bytes
+PKT_CHECKSUM_TYPE pkt_checksum_sum_tail(unsigned char *data, int len)
+{
+	PKT_CHECKSUM_TYPE checksum_tmp = 0;
+	int i;
+	for (i = 0; i < len; i++)
+		checksum_tmp |= data[i] << 8 * i;
+	return checksum_tmp;
+}
+
+// Word at a time, independent from host byte order
+PKT_CHECKSUM_TYPE pkt_checksum_sum_scalar(unsigned char *data, int len)
+{
+	PKT_CHECKSUM_TYPE checksum = 0;
+	int i;
+	for (i = 0; i + 4 <= len; i += 4)
+		checksum += data[i] | (data[i+1] << 8) | (data[i+2] << 16)
+				| ((PKT_CHECKSUM_TYPE)data[i+3] << 24);
+	return checksum + pkt_checksum_sum_tail(data + i, len - i);
+}
+
+PKT_CHECKSUM_TYPE pkt_checksum_copy_sum_scalar(unsigned char *dst,
+		unsigned char *src, int len)
+{
+	PKT_CHECKSUM_TYPE checksum = 0;
+	int i;
+	for (i = 0; i + 4 <= len; i += 4) {
+		dst[i] = src[i]; dst[i+1] = src[i+1];
+		dst[i+2] = src[i+2]; dst[i+3] = src[i+3];
+		checksum += src[i] | (src[i+1] << 8) | (src[i+2] << 16)
+				| ((PKT_CHECKSUM_TYPE)src[i+3] << 24);
+	}
+	memcpy(dst + i, src + i, len - i);
+	return checksum + pkt_checksum_sum_tail(src + i, len - i);
+}
+
+#ifdef PKT_CHECKSUM_X86
+
+// x86 is little-endian: a 32-bit load gives the word
+PKT_CHECKSUM_TYPE pkt_checksum_sum_words(unsigned char *data, int len)
+{
+	PKT_CHECKSUM_TYPE checksum = 0, word;
+	int i;
+	for (i = 0; i + 4 <= len; i += 4) {
+		memcpy(&word, data + i, 4);
+		checksum += word;
+	}
+	return checksum + pkt_checksum_sum_tail(data + i, len - i);
+}
+
+PKT_CHECKSUM_TYPE pkt_checksum_copy_sum_words(unsigned char *dst,
+		unsigned char *src, int len)
+{
+	PKT_CHECKSUM_TYPE checksum = 0, word;
+	int i;
+	for (i = 0; i + 4 <= len; i += 4) {
+		memcpy(&word, src + i, 4);
+		memcpy(dst + i, &word, 4);
+		checksum += word;
+	}
+	memcpy(dst + i, src + i, len - i);
+	return checksum + pkt_checksum_sum_tail(src + i, len - i);
+}
+
+int pkt_checksum_supported_sse2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("sse2")))
+PKT_CHECKSUM_TYPE pkt_checksum_sum_sse2(unsigned char *data, int len)
+{
+	// short data (e.g. packet headers)
+	if (len < 32)
+		return pkt_checksum_sum_words(data, len);
+
+	__m128i sum0 = _mm_setzero_si128();
+	__m128i sum1 = _mm_setzero_si128();
+	int i;
+	for (i = 0; i + 32 <= len; i += 32) {
+		sum0 = _mm_add_epi32(sum0, _mm_loadu_si128((__m128i *)(data + i)));
+		sum1 = _mm_add_epi32(sum1, _mm_loadu_si128((__m128i *)(data + i + 16)));
+	}
+	sum0 = _mm_add_epi32(sum0, sum1);
+	sum0 = _mm_add_epi32(sum0, _mm_shuffle_epi32(sum0, _MM_SHUFFLE(1, 0, 3, 2)));
+	sum0 = _mm_add_epi32(sum0, _mm_shuffle_epi32(sum0, _MM_SHUFFLE(2, 3, 0, 1)));
+
+	return (PKT_CHECKSUM_TYPE)_mm_cvtsi128_si32(sum0)
+			+ pkt_checksum_sum_words(data + i, len - i);
+}
+
+__attribute__((target("sse2")))
+PKT_CHECKSUM_TYPE pkt_checksum_copy_sum_sse2(unsigned char *dst,
+		unsigned char *src, int len)
+{
+	if (len < 32)
+		return pkt_checksum_copy_sum_words(dst, src, len);
+
+	__m128i sum0 = _mm_setzero_si128();
+	__m128i sum1 = _mm_setzero_si128();
+	int i;
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m128i data0 = _mm_loadu_si128((__m128i *)(src + i));
+		__m128i data1 = _mm_loadu_si128((__m128i *)(src + i + 16));
+		_mm_storeu_si128((__m128i *)(dst + i), data0);
+		_mm_storeu_si128((__m128i *)(dst + i + 16), data1);
+		sum0 = _mm_add_epi32(sum0, data0);
+		sum1 = _mm_add_epi32(sum1, data1);
+	}
+	sum0 = _mm_add_epi32(sum0, sum1);
+	sum0 = _mm_add_epi32(sum0, _mm_shuffle_epi32(sum0, _MM_SHUFFLE(1, 0, 3, 2)));
+	sum0 = _mm_add_epi32(sum0, _mm_shuffle_epi32(sum0, _MM_SHUFFLE(2, 3, 0, 1)));
+
+	return (PKT_CHECKSUM_TYPE)_mm_cvtsi128_si32(sum0)
+			+ pkt_checksum_copy_sum_words(dst + i, src + i, len - i);
+}
+
+int pkt_checksum_supported_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+PKT_CHECKSUM_TYPE pkt_checksum_sum_avx2(unsigned char *data, int len)
+{
+	if (len < 64)
+		return pkt_checksum_sum_sse2(data, len);
+
+	__m256i sum0 = _mm256_setzero_si256();
+	__m256i sum1 = _mm256_setzero_si256();
+	int i;
+	for (i = 0; i + 64 <= len; i += 64) {
+		sum0 = _mm256_add_epi32(sum0, _mm256_loadu_si256((__m256i *)(data + i)));
+		sum1 = _mm256_add_epi32(sum1, _mm256_loadu_si256((__m256i *)(data + i + 32)));
+	}
+	sum0 = _mm256_add_epi32(sum0, sum1);
+	__m128i sum = _mm_add_epi32(_mm256_castsi256_si128(sum0),
+			_mm256_extracti128_si256(sum0, 1));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+
+	return (PKT_CHECKSUM_TYPE)_mm_cvtsi128_si32(sum)
+			+ pkt_checksum_sum_words(data + i, len - i);
+}
+
+__attribute__((target("avx2")))
+PKT_CHECKSUM_TYPE pkt_checksum_copy_sum_avx2(unsigned char *dst,
+		unsigned char *src, int len)
+{
+	if (len < 64)
+		return pkt_checksum_copy_sum_sse2(dst, src, len);
+
+	__m256i sum0 = _mm256_setzero_si256();
+	__m256i sum1 = _mm256_setzero_si256();
+	int i;
+	for (i = 0; i + 64 <= len; i += 64) {
+		__m256i data0 = _mm256_loadu_si256((__m256i *)(src + i));
+		__m256i data1 = _mm256_loadu_si256((__m256i *)(src + i + 32));
+		_mm256_storeu_si256((__m256i *)(dst + i), data0);
+		_mm256_storeu_si256((__m256i *)(dst + i + 32), data1);
+		sum0 = _mm256_add_epi32(sum0, data0);
+		sum1 = _mm256_add_epi32(sum1, data1);
+	}
+	sum0 = _mm256_add_epi32(sum0, sum1);
+	__m128i sum = _mm_add_epi32(_mm256_castsi256_si128(sum0),
+			_mm256_extracti128_si256(sum0, 1));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+
+	return (PKT_CHECKSUM_TYPE)_mm_cvtsi128_si32(sum)
+			+ pkt_checksum_copy_sum_words(dst + i, src + i, len - i);
+}
+
+#endif // PKT_CHECKSUM_X86
+
+// In order of preference, the last supported one is selected
+struct pkt_checksum_impl pkt_checksum_impls[] = {
+	{ "bytewise", pkt_checksum_supported_always, pkt_checksum_sum_bytewise,
+		pkt_checksum_copy_sum_bytewise },
+	{ "scalar", pkt_checksum_supported_always, pkt_checksum_sum_scalar,
+		pkt_checksum_copy_sum_scalar },
+#ifdef PKT_CHECKSUM_X86
+	{ "sse2", pkt_checksum_supported_sse2, pkt_checksum_sum_sse2,
+		pkt_checksum_copy_sum_sse2 },
+	{ "avx2", pkt_checksum_supported_avx2, pkt_checksum_sum_avx2,
+		pkt_checksum_copy_sum_avx2 },
+#endif
+	{ NULL }
+};
+
+struct pkt_checksum_impl *pkt_checksum_impl = NULL;
+
+struct pkt_checksum_impl *pkt_checksum_get_impl()
+{
+	if (pkt_checksum_impl)
+		return pkt_checksum_impl;
+
+	struct pkt_checksum_impl *impl, *best = pkt_checksum_impls;
+	for (impl = pkt_checksum_impls; impl->name; impl++)
+		if (impl->supported())
+			best = impl;
+	pkt_checksum_impl = best;
+	return best;
+}
+
+int pkt_checksum_set_impl(const char *name)
+{
+	struct pkt_checksum_impl *impl;
+	for (impl = pkt_checksum_impls; impl->name; impl++) {
+		if (strcmp(impl->name, name))
+			continue;
+		if (!impl->supported())
+			return -1;
+		pkt_checksum_impl = impl;
+		return 0;
+	}
+	return -1;
+}
+
+//
+// Calculate checksum of 'data' of length 'len'
+// If 'dst' is not NULL, place checksum there
+//
+PKT_CHECKSUM_TYPE pkt_checksum(unsigned char *dst, unsigned char *data, int len)
+{
+	PKT_CHECKSUM_TYPE checksum = ~pkt_checksum_get_impl()->sum(data, len);
+
+	int i;
+	for (i = 0; i < PKT_CHECKSUM_LEN; i++) {
+		if (dst)
+			dst[i] = checksum >> 8 * i;
+	}
+	return checksum;
+}
+
+PKT_CHECKSUM_TYPE pkt_checksum_copy(unsigned char *dst, unsigned char *src, int len)
+{
+	PKT_CHECKSUM_TYPE checksum = ~pkt_checksum_get_impl()->copy_sum(dst, src, len);
+
+	int i;
+	for (i = 0; i < PKT_CHECKSUM_LEN; i++)
+		dst[len + i] = checksum >> 8 * i;
+	return checksum;
+}
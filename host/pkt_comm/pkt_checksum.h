@@ -0,0 +1,45 @@
+// ***************************************************************
+//
+// Checksum kernels
+//
+// * pkt_checksum() sums 32-bit little-endian words; the last
+//   word is zero-padded if length is not a multiple of 4.
+// * pkt_checksum_copy() copies data and computes checksum
+//   in a single pass.
+// * Several implementations produce identical results.
+//   The fastest one supported by the CPU is selected on first use.
+//
+// ***************************************************************
+
+#ifndef _PKT_CHECKSUM_H_
+
+#include "pkt_comm.h"
+
+struct pkt_checksum_impl {
+	const char *name;
+	// returns non-zero if the CPU supports the implementation
+	int (*supported)(void);
+	// sum of words, not inverted
+	PKT_CHECKSUM_TYPE (*sum)(unsigned char *data, int len);
+	// copies 'len' bytes, returns sum of copied words
+	PKT_CHECKSUM_TYPE (*copy_sum)(unsigned char *dst, unsigned char *src, int len);
+};
+
+// Implementations, terminated with an entry with name NULL.
+// Entry 0 ("bytewise") is the reference implementation.
+extern struct pkt_checksum_impl pkt_checksum_impls[];
+
+// Copies 'len' bytes from 'src' to 'dst', places checksum after
+// the copied data (at dst + len). Returns the checksum.
+PKT_CHECKSUM_TYPE pkt_checksum_copy(unsigned char *dst, unsigned char *src, int len);
+
+// Implementation currently used by pkt_checksum()
+struct pkt_checksum_impl *pkt_checksum_get_impl();
+
+// Selects implementation by name. Returns -1 if it's unknown
+// or not supported by the CPU.
+int pkt_checksum_set_impl(const char *name);
+
+
+#define _PKT_CHECKSUM_H_
+#endif
@@ -8,6 +8,9 @@
 #include <unistd.h>
 
 #include "pkt_comm.h"
+#include "pkt_pool.h"
+#include "pkt_checksum.h"
+#include "pkt_result.h"
 
 
 void pkt_error(const char *s, ...) {
@@ -17,10 +20,11 @@ void pkt_error(const char *s, ...) {
 	va_end(ap);
 }
 
+// Packets are created and deleted by different threads (device_worker.h)
 int total_pkt_count=0;
 int get_pkt_count(void)
 {
-	return total_pkt_count;
+	return __atomic_load_n(&total_pkt_count, __ATOMIC_RELAXED);
 }
 
 struct pkt *pkt_new(int type, char *data, int data_len)
@@ -51,8 +55,11 @@ struct pkt *pkt_new(int type, char *data, int data_len)
 	pkt->partial_header_len = 0;
 	pkt->partial_data_len = 0;
 	pkt->header = NULL;
+	pkt->pool = NULL;
+	pkt->data_class = -1;
+	pkt->input_buf = NULL;
 	
-	total_pkt_count++;
+	__atomic_fetch_add(&total_pkt_count, 1, __ATOMIC_RELAXED);
 	return pkt;
 }
 
@@ -67,69 +74,64 @@ unsigned int pkt_get_id(struct pkt *pkt)
 
 void pkt_delete(struct pkt *pkt)
 {
-	if (pkt->data)
-		free(pkt->data);
+	if (pkt->input_buf)
+		pkt_input_buf_put(pkt->input_buf);
+	else if (pkt->data) {
+		if (pkt->data_class >= 0)
+			pkt_pool_free(pkt->pool, pkt->data, pkt->data_class);
+		else
+			free(pkt->data);
+	}
 	if (pkt->partial_header_len && pkt->header)
 		free(pkt->header);
-	free(pkt);
-	total_pkt_count--;
+	__atomic_fetch_sub(&total_pkt_count, 1, __ATOMIC_RELAXED);
+	if (pkt->pool)
+		pkt_pool_free(pkt->pool, pkt, PKT_POOL_CLASS_PKT);
+	else
+		free(pkt);
 }
 
-//
-// Create binary packet header in the area pointed to by *header
-//
-void pkt_create_header(struct pkt *pkt, unsigned char *header)
+struct pkt_input_buf *pkt_input_buf_new(int size)
 {
-	pkt->header = header;
-	
-	pkt->header[0] = pkt->version;
-	pkt->header[1] = pkt->type;
-	//pkt->header[2] = 0;
-	//pkt->header[3] = 0;
-	pkt->header[4] = pkt->data_len;
-	pkt->header[5] = pkt->data_len >> 8;
-	pkt->header[6] = pkt->data_len >> 16;
-	//pkt->header[7] = 0;
-	pkt->header[8] = pkt->id;
-	pkt->header[9] = pkt->id >> 8;
+	struct pkt_input_buf *buf = malloc(sizeof(struct pkt_input_buf) + size);
+	if (!buf) {
+		pkt_error("pkt_input_buf_new(): unable to allocate %d bytes\n",
+				(int)(sizeof(struct pkt_input_buf) + size));
+		return NULL;
+	}
+	buf->refs = 1;
+	buf->size = size;
+	return buf;
 }
 
-// Read checksum pointed to by 'src' and convert to integer type
-//
-PKT_CHECKSUM_TYPE pkt_checksum_read(unsigned char *src)
+void pkt_input_buf_put(struct pkt_input_buf *buf)
 {
-	return src[0] | (src[1] << 8) | (src[2] << 16) | (src[3] << 24);
+	if (!__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL))
+		free(buf);
 }
 
 //
-// Calculate checksum of 'data' of length 'len'
-// If 'dst' is not NULL, place checksum there
+// Create binary packet header in the area pointed to by *header
 //
-PKT_CHECKSUM_TYPE pkt_checksum(unsigned char *dst, unsigned char *data, int len)
+void pkt_create_header(unsigned char *header, int type, int data_len, int id)
 {
-	PKT_CHECKSUM_TYPE checksum = 0;
-	
-	PKT_CHECKSUM_TYPE checksum_tmp = 0;
-	int checksum_byte_count = 0;
+	header[0] = PKT_COMM_VERSION;
+	header[1] = type;
+	header[2] = 0;
+	header[3] = 0;
+	header[4] = data_len;
+	header[5] = data_len >> 8;
+	header[6] = data_len >> 16;
+	header[7] = 0;
+	header[8] = id;
+	header[9] = id >> 8;
+}
 
-	int i;
-	for (i = 0; i < len; i++) {
-		checksum_tmp |= data[i] << 8 * checksum_byte_count;
-		if (++checksum_byte_count == PKT_CHECKSUM_LEN) {
-			checksum += checksum_tmp;
-			checksum_tmp = 0;
-			checksum_byte_count = 0;
-		}
-	}
-	checksum += checksum_tmp;
-	
-	checksum = ~checksum;
-	
-	for (i = 0; i < PKT_CHECKSUM_LEN; i++) {
-		if (dst)
-			dst[i] = checksum >> 8 * i;
-	}
-	return checksum;
+// Read checksum pointed to by 'src' and convert to integer type
+//
+PKT_CHECKSUM_TYPE pkt_checksum_read(unsigned char *src)
+{
+	return src[0] | (src[1] << 8) | (src[2] << 16) | ((PKT_CHECKSUM_TYPE)src[3] << 24);
 }
 
 //
@@ -205,14 +207,21 @@ struct pkt_queue *pkt_queue_new()
 				sizeof(struct pkt_queue));
 		return NULL;
 	}
+	queue->pkt = malloc(PKT_QUEUE_INITIAL_SLOTS * sizeof(struct pkt *));
+	if (!queue->pkt) {
+		pkt_error("pkt_queue_new(): unable to allocate %d bytes\n",
+				(int)(PKT_QUEUE_INITIAL_SLOTS * sizeof(struct pkt *)));
+		free(queue);
+		return NULL;
+	}
+	queue->num_slots = PKT_QUEUE_INITIAL_SLOTS;
 	queue->count = 0;
+	queue->total_size = 0;
+	queue->max_count = PKT_QUEUE_MAX_COUNT_DEFAULT;
+	queue->max_bytes = PKT_QUEUE_MAX_BYTES_DEFAULT;
 	queue->empty_slot_idx = 0;
 	queue->first_pkt_idx = 0;
 	
-	int i;
-	for (i = 0; i < PKT_QUEUE_MAX; i++)
-		queue->pkt[i] = NULL;
-		
 	return queue;
 }
 
@@ -223,30 +232,67 @@ void pkt_queue_delete(struct pkt_queue *queue)
 		return;
 	}
 	
-	int i;
-	for (i = 0; i < PKT_QUEUE_MAX; i++) {
-		if (queue->pkt[i])
-			pkt_delete(queue->pkt[i]);
-	}
+	struct pkt *pkt;
+	while ( (pkt = pkt_queue_fetch(queue)) )
+		pkt_delete(pkt);
+	free(queue->pkt);
 	free(queue);
 }
 
+void pkt_queue_set_limits(struct pkt_queue *queue, int max_count, int max_bytes)
+{
+	queue->max_count = max_count;
+	queue->max_bytes = max_bytes;
+}
+
+// size of the packet over link layer
+int pkt_queue_pkt_size(struct pkt *pkt)
+{
+	return pkt->data_len + PKT_HEADER_LEN + 2 * PKT_CHECKSUM_LEN;
+}
+
+// doubles the number of slots, packets are placed from slot 0
+int pkt_queue_grow(struct pkt_queue *queue)
+{
+	int num_slots = queue->num_slots * 2;
+	struct pkt **pkt = malloc(num_slots * sizeof(struct pkt *));
+	if (!pkt) {
+		pkt_error("pkt_queue_grow(): unable to allocate %d bytes\n",
+				(int)(num_slots * sizeof(struct pkt *)));
+		return -1;
+	}
+
+	int i;
+	for (i = 0; i < queue->count; i++)
+		pkt[i] = queue->pkt[(queue->first_pkt_idx + i) % queue->num_slots];
+	free(queue->pkt);
+	queue->pkt = pkt;
+	queue->num_slots = num_slots;
+	queue->first_pkt_idx = 0;
+	queue->empty_slot_idx = queue->count;
+	return 0;
+}
+
 int pkt_queue_push(struct pkt_queue *queue, struct pkt *pkt)
 {
-	if (queue->count == PKT_QUEUE_MAX)
+	if (pkt_queue_full(queue, 1))
+		return -1;
+	if (queue->count == queue->num_slots && pkt_queue_grow(queue) < 0)
 		return -1;
 	
 	queue->pkt[queue->empty_slot_idx] = pkt;
-	if (++queue->empty_slot_idx == PKT_QUEUE_MAX)
+	if (++queue->empty_slot_idx == queue->num_slots)
 		queue->empty_slot_idx = 0;
 
 	queue->count++;
+	queue->total_size += pkt_queue_pkt_size(pkt);
 	return 0;
 }
 
 int pkt_queue_full(struct pkt_queue *queue, int num)
 {
-	return queue->count + num > PKT_QUEUE_MAX ? 1 : 0;
+	return queue->count + num > queue->max_count
+			|| queue->total_size >= queue->max_bytes ? 1 : 0;
 }
 
 struct pkt *pkt_queue_fetch(struct pkt_queue *queue)
@@ -255,28 +301,25 @@ struct pkt *pkt_queue_fetch(struct pkt_queue *queue)
 		return NULL;
 	
 	struct pkt *pkt = queue->pkt[queue->first_pkt_idx];
-	queue->pkt[queue->first_pkt_idx] = NULL;
 	queue->count--;
+	queue->total_size -= pkt_queue_pkt_size(pkt);
 
-	if (++queue->first_pkt_idx == PKT_QUEUE_MAX)
+	if (++queue->first_pkt_idx == queue->num_slots)
 		queue->first_pkt_idx = 0;
 
 	return pkt;
 }
 
-// Get total size (including headers and checksums) of all packets in queue
-int pkt_queue_get_total_size(struct pkt_queue *queue)
+struct pkt *pkt_queue_peek(struct pkt_queue *queue)
 {
-	int total_size = 0;
-
-	int i;
-	for (i = 0; i < PKT_QUEUE_MAX; i++)
-		if (queue->pkt[i]) {
-			total_size += queue->pkt[i]->data_len + PKT_HEADER_LEN;
-			total_size += 2 * PKT_CHECKSUM_LEN;
-		}
+	if (!queue->count)
+		return NULL;
+	return queue->pkt[queue->first_pkt_idx];
+}
 
-	return total_size;
+int pkt_queue_get_total_size(struct pkt_queue *queue)
+{
+	return queue->total_size;
 }
 
 // ****************************************************************
@@ -284,7 +327,8 @@ int pkt_queue_get_total_size(struct pkt_queue *queue)
 struct pkt_comm *pkt_comm_new(struct pkt_comm_params *params)
 {
 	if (params->output_max_len <= 0 || params->input_max_len <= 0
-			|| params->alignment < 0 || params->alignment > 256) {
+			|| params->alignment < 0 || params->alignment > 256
+			|| params->queue_max_count < 0 || params->queue_max_bytes < 0) {
 		pkt_error("pkt_comm_new(): wrong pkt_comm_params\n");
 		return NULL;
 	}
@@ -297,32 +341,67 @@ struct pkt_comm *pkt_comm_new(struct pkt_comm_params *params)
 	}
 	comm->params = params;
 
-	comm->output_queue = pkt_queue_new();
-	if (!comm->output_queue) {
-		free(comm);
-		return NULL;
-	}
-	comm->output_buf = NULL;
+	comm->output_ring_size = PKT_COMM_OUTPUT_RING_TRANSFERS * params->output_max_len;
+	if (comm->output_ring_size < PKT_COMM_OUTPUT_RING_MIN)
+		comm->output_ring_size = PKT_COMM_OUTPUT_RING_MIN;
+	// wrap-around happens at aligned offset
+	if (params->alignment)
+		comm->output_ring_size -= comm->output_ring_size % params->alignment;
+	comm->output_ring_head = 0;
+	comm->output_ring_tail = 0;
+	comm->output_ring_wrap = -1;
+	comm->output_reserve_offset = -1;
+	comm->output_pkt = NULL;
+	comm->output_flush_usec = 0;
+	comm->output_flush = 0;
+	comm->output_pending_since = 0;
+	comm->output_suspend = 0;
 
+	comm->input_buf_len = 0;
+	comm->input_pkt = NULL;
+	comm->input_zero_copy = 0;
+	comm->input_bufs_max = 1;
+	comm->input_fill = NULL;
+	comm->input_spare = NULL;
+	comm->input_pending_first = 0;
+	comm->input_pending_count = 0;
+	comm->result_batch = NULL;
+
+	// Any allocation failure goes to pkt_comm_delete(),
+	// it skips members that weren't allocated
+	comm->output_queue = pkt_queue_new();
 	comm->input_queue = pkt_queue_new();
-	if (!comm->input_queue) {
-		free(comm);
-		return NULL;
-	}
-	comm->input_buf = malloc(params->input_max_len);
-	if (!comm->input_buf) {
+	comm->output_ring = malloc(comm->output_ring_size);
+	if (!comm->output_ring)
 		pkt_error("pkt_comm_new(): unable to allocate %d bytes\n",
-				params->input_max_len);
-		free(comm);
+				comm->output_ring_size);
+	comm->input_ref = pkt_input_buf_new(params->input_max_len);
+	comm->input_buf = comm->input_ref ? comm->input_ref->data : NULL;
+	comm->pool = pkt_pool_new();
+
+	if (!comm->output_queue || !comm->input_queue || !comm->output_ring
+			|| !comm->input_ref || !comm->pool) {
+		pkt_comm_delete(comm);
 		return NULL;
 	}
-	comm->input_buf_len = 0;
-	comm->input_pkt = NULL;
+	pkt_comm_set_queue_limits(comm, params->queue_max_count,
+			params->queue_max_bytes);
 
 	comm->error = 0;
 	return comm;
 }
 
+void pkt_comm_set_queue_limits(struct pkt_comm *comm,
+		int max_count, int max_bytes)
+{
+	if (!max_count)
+		max_count = PKT_QUEUE_MAX_COUNT_DEFAULT;
+	if (!max_bytes)
+		max_bytes = PKT_QUEUE_MAX_BYTES_DEFAULT;
+	pkt_queue_set_limits(comm->output_queue, max_count, max_bytes);
+	pkt_queue_set_limits(comm->input_queue, max_count, max_bytes);
+}
+
 void pkt_comm_delete(struct pkt_comm *comm)
 {
 	if (!comm) {
@@ -330,13 +409,51 @@ void pkt_comm_delete(struct pkt_comm *comm)
 		return;
 	}
 	
-	pkt_queue_delete(comm->input_queue);
-	pkt_queue_delete(comm->output_queue);
-	free(comm->input_buf);
-	if (comm->output_buf)
-		free(comm->output_buf);
+	if (comm->input_queue)
+		pkt_queue_delete(comm->input_queue);
+	if (comm->output_queue)
+		pkt_queue_delete(comm->output_queue);
+	if (comm->input_ref)
+		pkt_input_buf_put(comm->input_ref);
+	for ( ; comm->input_pending_count; comm->input_pending_count--) {
+		pkt_input_buf_put(comm->input_pending[comm->input_pending_first].buf);
+		comm->input_pending_first = (comm->input_pending_first + 1)
+				% PKT_COMM_INPUT_BUFS_MAX;
+	}
+	if (comm->input_fill)
+		pkt_input_buf_put(comm->input_fill);
+	if (comm->input_spare)
+		pkt_input_buf_put(comm->input_spare);
+	free(comm->output_ring);
+	if (comm->output_pkt)
+		pkt_delete(comm->output_pkt);
 	if (comm->input_pkt)
 		pkt_delete(comm->input_pkt);
+	if (comm->result_batch)
+		pkt_result_batch_delete(comm->result_batch);
+	// packets still in use keep the pool
+	if (comm->pool)
+		pkt_pool_delete(comm->pool);
+	free(comm);
+}
+
+void pkt_comm_set_input_zero_copy(struct pkt_comm *comm, int enable)
+{
+	comm->input_zero_copy = enable;
+}
+
+int pkt_comm_set_result_batch(struct pkt_comm *comm, int enable)
+{
+	if (!enable) {
+		if (comm->result_batch)
+			pkt_result_batch_delete(comm->result_batch);
+		comm->result_batch = NULL;
+		return 0;
+	}
+	if (comm->result_batch)
+		return 0;
+	comm->result_batch = pkt_result_batch_new();
+	return comm->result_batch ? 0 : -1;
 }
 
 
@@ -346,111 +463,372 @@ void pkt_comm_delete(struct pkt_comm *comm)
 //
 // ******************************************************************
 
-// allocates output buffer
-// fetches all packets from output queue and puts them into output buffer
-// calculates checksums
-// deals with alignment issues
-//
-int pkt_comm_create_output_buf(struct pkt_comm *comm)
+// size of serialized packet in the output ring, including
+// alignment padding
+int pkt_comm_output_pkt_len(struct pkt_comm *comm, int data_len)
 {
-	// there's already output buffer
-	if (comm->output_buf) {
-		pkt_error("pkt_comm_create_output_buf(): buffer already created\n");
-		return -1;
+	int len = data_len + PKT_HEADER_LEN + 2 * PKT_CHECKSUM_LEN;
+	int align = comm->params->alignment;
+	if (align && len % align)
+		len += align - len % align;
+	return len;
+}
+
+// bytes in the ring waiting for transmission
+int pkt_comm_output_ring_used(struct pkt_comm *comm)
+{
+	if (comm->output_ring_wrap < 0)
+		return comm->output_ring_tail - comm->output_ring_head;
+	return comm->output_ring_wrap - comm->output_ring_head
+			+ comm->output_ring_tail;
+}
+
+// output data not yet transmitted, bytes
+int pkt_comm_output_pending(struct pkt_comm *comm)
+{
+	int pending = pkt_queue_get_total_size(comm->output_queue)
+			+ pkt_comm_output_ring_used(comm);
+	if (comm->output_pkt)
+		pending += pkt_comm_output_pkt_len(comm, comm->output_pkt->data_len)
+				- comm->output_pkt_offset;
+	return pending;
+}
+
+// contiguous free space at the tail of the ring for data that continues
+// the output stream; wraps around at the end of the ring.
+// Returns offset, -1 if the ring is full.
+int pkt_comm_output_ring_space(struct pkt_comm *comm, int *len)
+{
+	if (!pkt_comm_output_ring_used(comm)) {
+		comm->output_ring_head = 0;
+		comm->output_ring_tail = 0;
+		comm->output_ring_wrap = -1;
 	}
-	
-	// output queue empty, output buffer not created
-	if (!comm->output_queue->count)
-		return 0;
 
-	int size = pkt_queue_get_total_size(comm->output_queue);
-	if (!size)
-		return 0;
+	if (comm->output_ring_wrap >= 0) {
+		*len = comm->output_ring_head - comm->output_ring_tail;
+		return *len ? comm->output_ring_tail : -1;
+	}
+	if (comm->output_ring_tail < comm->output_ring_size) {
+		*len = comm->output_ring_size - comm->output_ring_tail;
+		return comm->output_ring_tail;
+	}
+	*len = comm->output_ring_head;
+	return *len ? 0 : -1;
+}
 
-	// alignment issue; pad with 0's
-	int align = comm->params->alignment;
-	int extra_zeroes = align && size % align ? align - size % align : 0;
-	size += extra_zeroes;
+// adds 'len' bytes at 'offset' to data for transmission
+void pkt_comm_output_ring_put(struct pkt_comm *comm, int offset, int len)
+{
+	// placed at the beginning of the ring
+	if (offset != comm->output_ring_tail)
+		comm->output_ring_wrap = comm->output_ring_tail;
+	comm->output_ring_tail = offset + len;
+}
 
-	comm->output_buf = malloc(size);
-	if (!comm->output_buf) {
-		pkt_error("pkt_comm_create_output_buf(): unable to allocate %d bytes\n", size);
-		return 0;
+// finds contiguous space for a packet, doesn't check output queue
+unsigned char *pkt_comm_output_ring_reserve(struct pkt_comm *comm, int data_len)
+{
+	const int max_len = PKT_MAX_LEN - PKT_HEADER_LEN - 2 * PKT_CHECKSUM_LEN;
+	if (data_len <= 0 || data_len > max_len) {
+		pkt_error("pkt_comm_output_reserve(): bad data_len %d\n", data_len);
+		return NULL;
 	}
-	comm->output_buf_size = size;
-	comm->output_buf_offset = 0;
-	
+
+	int len = pkt_comm_output_pkt_len(comm, data_len);
+	int offset;
+
+	if (!pkt_comm_output_ring_used(comm)) {
+		comm->output_ring_head = 0;
+		comm->output_ring_tail = 0;
+		comm->output_ring_wrap = -1;
+
+		// the only case the ring is reallocated
+		if (len > comm->output_ring_size) {
+			unsigned char *ring = malloc(len);
+			if (!ring) {
+				pkt_error("pkt_comm_output_reserve(): unable to allocate %d bytes\n",
+						len);
+				return NULL;
+			}
+			free(comm->output_ring);
+			comm->output_ring = ring;
+			comm->output_ring_size = len;
+		}
+	}
+
+	if (comm->output_ring_wrap < 0) {
+		if (comm->output_ring_size - comm->output_ring_tail >= len)
+			offset = comm->output_ring_tail;
+		else if (comm->output_ring_head >= len)
+			offset = 0;
+		else
+			return NULL;
+	} else {
+		if (comm->output_ring_head - comm->output_ring_tail >= len)
+			offset = comm->output_ring_tail;
+		else
+			return NULL;
+	}
+
+	comm->output_reserve_offset = offset;
+	comm->output_reserve_len = data_len;
+	return comm->output_ring + offset + PKT_HEADER_LEN + PKT_CHECKSUM_LEN;
+}
+
+// writes header with checksum and padding, data checksum
+// must be already in place
+void pkt_comm_output_ring_commit(struct pkt_comm *comm, int type, int id, int data_len)
+{
+	int offset = comm->output_reserve_offset;
+	unsigned char header[PKT_HEADER_LEN];
+	pkt_create_header(header, type, data_len, id);
+	pkt_checksum_copy(comm->output_ring + offset, header, PKT_HEADER_LEN);
+
+	int len = pkt_comm_output_pkt_len(comm, data_len);
+	int data_end = data_len + PKT_HEADER_LEN + 2 * PKT_CHECKSUM_LEN;
+	if (len > data_end)
+		memset(comm->output_ring + offset + data_end, 0, len - data_end);
+
+	pkt_comm_output_ring_put(comm, offset, len);
+	comm->output_reserve_offset = -1;
+}
+
+// copies part of data of the packet being streamed,
+// adds it to the checksum
+void pkt_comm_output_stream_data(struct pkt_comm *comm, unsigned char *dst,
+		int data_offset, int len)
+{
+	unsigned char *src = (unsigned char *)comm->output_pkt->data + data_offset;
 	int i;
-	for (i = 0; i < extra_zeroes; i++)
-		comm->output_buf[size - i - 1] = 0;
 
-	// fetch all packets from output queue and put them into output buffer
-	int offset = 0;
+	// complete the word started in the previous part
+	for (i = 0; i < len && (data_offset + i) % 4; i++) {
+		dst[i] = src[i];
+		comm->output_pkt_sum += (PKT_CHECKSUM_TYPE)src[i] << 8 * ((data_offset + i) % 4);
+	}
+	comm->output_pkt_sum += pkt_checksum_get_impl()->copy_sum(dst + i, src + i, len - i);
+}
+
+// serializes packet comm->output_pkt into available space in the ring,
+// the packet can be split anywhere.
+// Returns 1 when the packet is done.
+int pkt_comm_output_stream(struct pkt_comm *comm)
+{
+	struct pkt *pkt = comm->output_pkt;
+	const int data_start = PKT_HEADER_LEN + PKT_CHECKSUM_LEN;
+	int data_end = data_start + pkt->data_len;
+	int pkt_len = pkt_comm_output_pkt_len(comm, pkt->data_len);
+
+	while (comm->output_pkt_offset < pkt_len) {
+		int len;
+		int offset = pkt_comm_output_ring_space(comm, &len);
+		if (offset < 0)
+			return 0;
+
+		unsigned char *dst = comm->output_ring + offset;
+		int pos = comm->output_pkt_offset;
+
+		if (pos < data_start) {
+			unsigned char header[PKT_HEADER_LEN + PKT_CHECKSUM_LEN];
+			pkt_create_header(header, pkt->type, pkt->data_len, pkt->id);
+			pkt_checksum(header + PKT_HEADER_LEN, header, PKT_HEADER_LEN);
+			if (len > data_start - pos)
+				len = data_start - pos;
+			memcpy(dst, header + pos, len);
+
+		} else if (pos < data_end) {
+			if (len > data_end - pos)
+				len = data_end - pos;
+			pkt_comm_output_stream_data(comm, dst, pos - data_start, len);
+
+		} else {
+			// checksum and alignment padding
+			unsigned char trailer[PKT_CHECKSUM_LEN + 256] = { 0 };
+			PKT_CHECKSUM_TYPE checksum = ~comm->output_pkt_sum;
+			int i;
+			for (i = 0; i < PKT_CHECKSUM_LEN; i++)
+				trailer[i] = checksum >> 8 * i;
+			if (len > pkt_len - pos)
+				len = pkt_len - pos;
+			memcpy(dst, trailer + pos - data_end, len);
+		}
+
+		pkt_comm_output_ring_put(comm, offset, len);
+		comm->output_pkt_offset += len;
+	}
+
+	pkt_delete(pkt);
+	comm->output_pkt = NULL;
+	return 1;
+}
+
+// moves packets from output queue into the ring as space
+// becomes available (copies data and calculates checksum in the same pass)
+void pkt_comm_output_serialize(struct pkt_comm *comm)
+{
+	if (comm->output_pkt && !pkt_comm_output_stream(comm))
+		return;
+	if (comm->output_suspend)
+		return;
+
 	struct pkt *pkt;
-	while ( (pkt = pkt_queue_fetch(comm->output_queue)) ) {
+	while ( (pkt = pkt_queue_peek(comm->output_queue)) ) {
+		unsigned char *data = NULL;
+		int len = pkt_comm_output_pkt_len(comm, pkt->data_len);
+		if (len <= comm->output_ring_size)
+			data = pkt_comm_output_ring_reserve(comm, pkt->data_len);
+
+		// large packet is streamed in parts
+		if (!data && len > comm->params->output_max_len) {
+			pkt_queue_fetch(comm->output_queue);
+			comm->output_pkt = pkt;
+			comm->output_pkt_offset = 0;
+			comm->output_pkt_sum = 0;
+			if (!pkt_comm_output_stream(comm))
+				break;
+			continue;
+		}
+		if (!data)
+			break;
 
-		pkt_create_header(pkt, comm->output_buf + offset);
-		pkt_checksum(comm->output_buf + offset + PKT_HEADER_LEN,
-				comm->output_buf + offset, PKT_HEADER_LEN);
-		offset += PKT_HEADER_LEN + PKT_CHECKSUM_LEN;
-		
-		memcpy(comm->output_buf + offset, pkt->data, pkt->data_len);
-		pkt_checksum(comm->output_buf + offset + pkt->data_len,
-				comm->output_buf + offset, pkt->data_len);
-		offset += pkt->data_len + PKT_CHECKSUM_LEN;
+		pkt_checksum_copy(data, (unsigned char *)pkt->data, pkt->data_len);
+		pkt_comm_output_ring_commit(comm, pkt->type, pkt->id, pkt->data_len);
 
+		pkt_queue_fetch(comm->output_queue);
 		pkt_delete(pkt);
 	}
+}
+
+unsigned char *pkt_comm_output_reserve(struct pkt_comm *comm, int data_len)
+{
+	if (comm->output_suspend)
+		return NULL;
 
-	return size;
+	// keep the order of packets
+	if (comm->output_queue->count || comm->output_pkt) {
+		pkt_comm_output_serialize(comm);
+		if (comm->output_queue->count || comm->output_pkt)
+			return NULL;
+	}
+	return pkt_comm_output_ring_reserve(comm, data_len);
+}
+
+int pkt_comm_output_commit(struct pkt_comm *comm, int type, int id, int data_len)
+{
+	if (comm->output_reserve_offset < 0) {
+		pkt_error("pkt_comm_output_commit(): no reservation\n");
+		return -1;
+	}
+	if (data_len <= 0 || data_len > comm->output_reserve_len || type <= 0) {
+		pkt_error("pkt_comm_output_commit(): bad type %d or data_len %d\n",
+				type, data_len);
+		comm->output_reserve_offset = -1;
+		return -1;
+	}
+
+	unsigned char *data = comm->output_ring + comm->output_reserve_offset
+			+ PKT_HEADER_LEN + PKT_CHECKSUM_LEN;
+	pkt_checksum(data + data_len, data, data_len);
+	pkt_comm_output_ring_commit(comm, type, id, data_len);
+	return 0;
 }
 
-/*
-// Not tested
 int pkt_comm_has_output_data(struct pkt_comm *comm)
 {
-	// There's data in output buffer
-	if (comm->output_buf) {
-		if (comm->output_buf_offset >= comm->output_buf_size
-				|| !comm->output_buf_size) {
-			// Looks like internal error
-			pkt_error("pkt_comm_has_output_data: %d, %d\n",
-				comm->output_buf_offset, comm->output_buf_size);
-			return 0;
-		}
+	// There's data in output ring
+	if (pkt_comm_output_ring_used(comm) || comm->output_pkt)
 		return 1;
-	}
 	
 	// There's data in output queue
-	if (!comm->output_queue->count)
+	if (comm->output_queue->count)
 		return 1;
 	
 	return 0;
 }
-*/
+
+// Returns microseconds the output is held for, waiting for more data
+int pkt_comm_output_hold_usec(struct pkt_comm *comm)
+{
+	if (!comm->output_flush_usec || comm->output_flush
+			|| comm->output_suspend || !pkt_comm_has_output_data(comm))
+		return 0;
+
+	if (pkt_comm_output_pending(comm) >= comm->params->output_max_len)
+		return 0;
+
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	long long now = tv.tv_sec * 1000000LL + tv.tv_usec;
+	if (!comm->output_pending_since)
+		comm->output_pending_since = now;
+
+	long long elapsed = now - comm->output_pending_since;
+	if (elapsed >= comm->output_flush_usec)
+		return 0;
+	return comm->output_flush_usec - elapsed;
+}
 
 unsigned char *pkt_comm_get_output_data(struct pkt_comm *comm, int *len)
 {
-	if (!comm->output_buf) {
-		if (!pkt_comm_create_output_buf(comm)) {
-			// No output data
-			*len = 0;
-			return NULL;
-		}
+	// small output waits for more data, up to output_flush_usec
+	if (pkt_comm_output_hold_usec(comm) > 0) {
+		*len = 0;
+		return NULL;
+	}
+
+	pkt_comm_output_serialize(comm);
+
+	int used = pkt_comm_output_ring_used(comm);
+	if (!used) {
+		// No output data
+		*len = 0;
+		return NULL;
 	}
 
-	int size = comm->output_buf_size;
-	int offset = comm->output_buf_offset;
-	//printf("pkt: size %d off %d\n",size,offset);
-	if (size - offset <= comm->params->output_max_len) {
-		// TODO: check if there's data in output queue, add-up to buffer
-		// if remeining size is less than max.transfer size over link layer
-		*len = size - offset;
+	// contiguous data up to the end of the ring
+	int head = comm->output_ring_head;
+	int end = comm->output_ring_wrap < 0
+			? comm->output_ring_tail : comm->output_ring_wrap;
+	if (end - head <= comm->params->output_max_len) {
+		*len = end - head;
+		// all pending output goes in this transfer
+		if (*len == used && !comm->output_queue->count && !comm->output_pkt) {
+			comm->output_pending_since = 0;
+			comm->output_flush = 0;
+		}
 	} else {
 		*len = comm->params->output_max_len;
 	}
 
-	return comm->output_buf + offset;
+	// streamed packet can end anywhere
+	int align = comm->params->alignment;
+	if (align)
+		*len -= *len % align;
+	if (!*len)
+		return NULL;
+
+	return comm->output_ring + head;
+}
+
+void pkt_comm_set_output_flush_usec(struct pkt_comm *comm, int usec)
+{
+	comm->output_flush_usec = usec;
+}
+
+void pkt_comm_output_flush(struct pkt_comm *comm)
+{
+	comm->output_flush = 1;
+}
+
+void pkt_comm_set_output_suspend(struct pkt_comm *comm, int suspend)
+{
+	comm->output_suspend = suspend;
+}
+
+int pkt_comm_output_at_boundary(struct pkt_comm *comm)
+{
+	return !pkt_comm_output_ring_used(comm) && !comm->output_pkt;
 }
 
 
@@ -460,10 +838,11 @@ void pkt_comm_output_completed(struct pkt_comm *comm, int len, int error)
 	if (error)
 		return;
 	
-	comm->output_buf_offset += len;
-	if (comm->output_buf_offset >= comm->output_buf_size) {
-		free(comm->output_buf);
-		comm->output_buf = NULL;
+	comm->output_ring_head += len;
+	if (comm->output_ring_wrap >= 0
+			&& comm->output_ring_head >= comm->output_ring_wrap) {
+		comm->output_ring_head = 0;
+		comm->output_ring_wrap = -1;
 	}
 }
 
@@ -567,10 +946,22 @@ int pkt_comm_process_input_packet_data(struct pkt_comm *comm)
 	if (!comm->input_buf_len)
 		return 0;
 
+	int offset = comm->input_buf_offset;
+
+	// zero-copy: complete packet data is in the input buffer
+	if (!pkt->data && comm->input_zero_copy
+			&& pkt->data_len + PKT_CHECKSUM_LEN <= comm->input_buf_len - offset) {
+		pkt->data = (char *)comm->input_buf + offset;
+		pkt->input_buf = comm->input_ref;
+		__atomic_add_fetch(&comm->input_ref->refs, 1, __ATOMIC_RELAXED);
+	}
 	// no data in packet
-	if (!pkt->data) {
+	else if (!pkt->data) {
 		// allocate memory for packet data
-		pkt->data = malloc(pkt->data_len + PKT_CHECKSUM_LEN);
+		if (pkt->pool)
+			pkt->data = pkt_pool_data_alloc(pkt);
+		else
+			pkt->data = malloc(pkt->data_len + PKT_CHECKSUM_LEN);
 		if (!pkt->data) {
 			pkt_error("pkt_comm_process_input_packet_data: unable to allocate %d bytes\n",
 				pkt->data_len + PKT_CHECKSUM_LEN);
@@ -587,12 +978,12 @@ int pkt_comm_process_input_packet_data(struct pkt_comm *comm)
 		return -1;
 	}
 
-	int offset = comm->input_buf_offset;
 	int remains = pkt->data_len + PKT_CHECKSUM_LEN - pkt->partial_data_len ;
 
 	// packet completed
 	if (remains <= comm->input_buf_len - offset) {
-		memcpy(pkt->data + pkt->partial_data_len, comm->input_buf + offset, remains);
+		if (!pkt->input_buf)
+			memcpy(pkt->data + pkt->partial_data_len, comm->input_buf + offset, remains);
 		pkt->partial_data_len = 0;
 
 		PKT_CHECKSUM_TYPE checksum = pkt_checksum(NULL, (unsigned char *)pkt->data, pkt->data_len);
@@ -652,10 +1043,23 @@ int pkt_comm_process_input_buf(struct pkt_comm *comm)
 		if (pkt && pkt->header_ok && pkt->data && !pkt->partial_data_len) {
 			//printf("pkt_comm_process_input_buf: header_ok:%d data:%d partial_data_len:%d\n",
 			//	!!pkt->header_ok, !!pkt->data, pkt->partial_data_len);
-			if (pkt_queue_full(comm->input_queue, 1))
-				return 0;
-			// push packet into input queue
-			pkt_queue_push(comm->input_queue, pkt);
+			struct pkt_result_batch *batch = comm->result_batch;
+			if (batch && pkt->type == PKT_TYPE_RESULT) {
+				if (pkt_result_batch_full(batch))
+					return 0;
+				if (pkt_result_add_pkt(batch, pkt) < 0) {
+					pkt_error("pkt_comm_process_input_buf: bad result packet, data_len %d\n",
+							pkt->data_len);
+					return -1;
+				}
+				pkt_delete(pkt);
+			}
+			else {
+				if (pkt_queue_full(comm->input_queue, 1))
+					return 0;
+				// push packet into input queue
+				pkt_queue_push(comm->input_queue, pkt);
+			}
 			comm->input_pkt = NULL;
 		}
 
@@ -664,47 +1068,154 @@ int pkt_comm_process_input_buf(struct pkt_comm *comm)
 			return 0;
 
 		// skip padding zeroes
-		/*
-		 * OK - the device creates aligned packets only
-		 *
+		// (the device creates aligned packets only;
+		// padding appears with other link layers e.g. loopback)
 		if (pkt_comm_input_process_zeroes(comm) < 0)
 			return -1;
 		if (!comm->input_buf_len)
 			return 0;
-		*/
+
+		// run of result packets
+		if (comm->result_batch) {
+			int len = pkt_result_decode(comm->result_batch,
+					comm->input_buf + comm->input_buf_offset,
+					comm->input_buf_len - comm->input_buf_offset);
+			if (len < 0)
+				return -1;
+			if (len) {
+				comm->input_buf_offset += len;
+				if (comm->input_buf_offset == comm->input_buf_len)
+					comm->input_buf_len = 0;
+				pkt = NULL;
+				continue;
+			}
+		}
 
 		// expecting new input packet
-		pkt = pkt_new(0, NULL, 0);
+		pkt = pkt_pool_pkt_new(comm->pool, 0, NULL, 0);
+		if (!pkt)
+			return -1;
 		comm->input_pkt = pkt;
 
 	} // while(1) - process incoming packets
 }
 
+// Receive buffers are reused unless packets reference them
+struct pkt_input_buf *pkt_comm_input_buf_get(struct pkt_comm *comm)
+{
+	struct pkt_input_buf *buf = comm->input_spare;
+	if (buf) {
+		comm->input_spare = NULL;
+		return buf;
+	}
+	return pkt_input_buf_new(comm->params->input_max_len);
+}
+
+void pkt_comm_input_buf_release(struct pkt_comm *comm, struct pkt_input_buf *buf)
+{
+	if (!comm->input_spare
+			&& __atomic_load_n(&buf->refs, __ATOMIC_ACQUIRE) == 1)
+		comm->input_spare = buf;
+	else
+		pkt_input_buf_put(buf);
+}
+
+// Processes input buffer, then received buffers that wait
+// for space in input queue
+//
+int pkt_comm_input_process(struct pkt_comm *comm)
+{
+	while (1) {
+		if (comm->input_buf_len && pkt_comm_process_input_buf(comm) < 0)
+			return -1;
+		if (comm->input_buf_len || !comm->input_pending_count)
+			return 0;
+
+		// input buffer processed, the next one goes
+		struct pkt_input_pending *pending
+				= &comm->input_pending[comm->input_pending_first];
+		pkt_comm_input_buf_release(comm, comm->input_ref);
+		comm->input_ref = pending->buf;
+		comm->input_buf = pending->buf->data;
+		comm->input_buf_len = pending->len;
+		comm->input_buf_offset = 0;
+		comm->input_pending_first = (comm->input_pending_first + 1)
+				% PKT_COMM_INPUT_BUFS_MAX;
+		comm->input_pending_count--;
+	}
+}
+
 unsigned char *pkt_comm_input_get_buf(struct pkt_comm *comm)
 {
-	// input queue full
-	if (pkt_queue_full(comm->input_queue, 1))
-		return NULL;
-		
+	// buffer was already requested
+	if (comm->input_fill)
+		return comm->input_fill->data;
+
 	// input buffer not empty
 	// that's probably because input queue was full
 	// at time of processing
-	if (comm->input_buf_len) {
+	if (comm->input_buf_len || comm->input_pending_count) {
 		// try to process and empty it
-		if (pkt_comm_process_input_buf(comm) < 0) {
+		if (pkt_comm_input_process(comm) < 0) {
 			comm->error = 1;
 			return NULL;
 		}
+	}
+
+	// still not empty: receive into another buffer
+	// if input_bufs_max allows
+	if (comm->input_buf_len || comm->input_pending_count) {
+		if (1 + comm->input_pending_count >= comm->input_bufs_max)
+			return NULL;
+		comm->input_fill = pkt_comm_input_buf_get(comm);
+		if (!comm->input_fill) {
+			comm->error = 1;
+			return NULL;
+		}
+		return comm->input_fill->data;
+	}
+
+	// input queue full
+	if (comm->input_bufs_max == 1) {
+		if (pkt_queue_full(comm->input_queue, 1))
+			return NULL;
+		if (comm->result_batch && pkt_result_batch_full(comm->result_batch))
+			return NULL;
+	}
 
-		// still not empty
-		if (comm->input_buf_len)
+	// zero-copy: packets reference the buffer, switch to a new one
+	if (__atomic_load_n(&comm->input_ref->refs, __ATOMIC_ACQUIRE) > 1) {
+		struct pkt_input_buf *buf = pkt_comm_input_buf_get(comm);
+		if (!buf) {
+			comm->error = 1;
 			return NULL;
+		}
+		pkt_input_buf_put(comm->input_ref);
+		comm->input_ref = buf;
+		comm->input_buf = buf->data;
 	}
 
 	comm->input_buf_offset = 0;
 	return comm->input_buf;
 }
 
+int pkt_comm_input_full(struct pkt_comm *comm)
+{
+	if (comm->input_fill)
+		return 0;
+
+	if (comm->input_buf_len || comm->input_pending_count)
+		return 1 + comm->input_pending_count >= comm->input_bufs_max;
+
+	if (comm->input_bufs_max == 1) {
+		if (pkt_queue_full(comm->input_queue, 1))
+			return 1;
+		if (comm->result_batch && pkt_result_batch_full(comm->result_batch))
+			return 1;
+	}
+	return 0;
+}
+
 int pkt_comm_input_completed(struct pkt_comm *comm, int len, int error)
 {
 	//printf("input_completed %d %d\n", len, error);
@@ -719,12 +1230,36 @@ int pkt_comm_input_completed(struct pkt_comm *comm, int len, int error)
 				len, comm->params->input_max_len);
 		return -1;
 	}
-	comm->input_buf_len = len;
+
+	// data was received into additional buffer, it waits
+	// until previous buffers are processed
+	if (comm->input_fill) {
+		struct pkt_input_pending *pending = &comm->input_pending[
+				(comm->input_pending_first + comm->input_pending_count)
+				% PKT_COMM_INPUT_BUFS_MAX];
+		pending->buf = comm->input_fill;
+		pending->len = len;
+		comm->input_pending_count++;
+		comm->input_fill = NULL;
+	}
+	else
+		comm->input_buf_len = len;
 		
-	if (pkt_comm_process_input_buf(comm) < 0) {
+	if (pkt_comm_input_process(comm) < 0) {
 		comm->error = 1;
 		return -1;
 	}
 	return 0;
 }
 
+int pkt_comm_set_input_mem_max(struct pkt_comm *comm, int bytes)
+{
+	int bufs = bytes / comm->params->input_max_len;
+	if (bufs < 1)
+		bufs = 1;
+	if (bufs > PKT_COMM_INPUT_BUFS_MAX)
+		bufs = PKT_COMM_INPUT_BUFS_MAX;
+	comm->input_bufs_max = bufs;
+	return bufs;
+}
+
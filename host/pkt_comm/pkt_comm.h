@@ -42,8 +42,8 @@
 #define PKT_MAX_LEN	(16 * 65536) // 1MB
 
 #define PKT_CHECKSUM_LEN	4
-// PKT_CHECKSUM_TYPE must be unsigned type
-#define PKT_CHECKSUM_TYPE	unsigned long
+// PKT_CHECKSUM_TYPE must be unsigned 32-bit type
+#define PKT_CHECKSUM_TYPE	unsigned int
 //#define PKT_CHECKSUM_INTERVAL	448
 
 struct pkt {
@@ -60,8 +60,17 @@ struct pkt {
 	int partial_data_len;
 	// variable usage for output and input
 	unsigned char *header;
+	// pool the packet was allocated from (NULL if pkt_new())
+	struct pkt_pool *pool;
+	int data_class;	// pool class of data, -1 if data is malloc'ed
+	// receive buffer 'data' points into (zero-copy input), or NULL
+	struct pkt_input_buf *input_buf;
 };
 
+// Calculates checksum of 'data' of length 'len'.
+// If 'dst' is not NULL, places checksum there (PKT_CHECKSUM_LEN bytes)
+PKT_CHECKSUM_TYPE pkt_checksum(unsigned char *dst, unsigned char *data, int len);
+
 // Currently error messages are printed to stderr
 void pkt_error(const char *s, ...);
 
@@ -74,28 +83,74 @@ struct pkt *pkt_new(int type, char *data, int data_len);
 unsigned int pkt_get_id(struct pkt *pkt);
 
 // Deletes packet, also frees pkt->data
+// (packets allocated from pkt_pool are returned there,
+// zero-copy packets release their receive buffer)
 void pkt_delete(struct pkt *pkt);
 
 
+// *****************************************************************
+//
+// Reference-counted receive buffer
+//
+// * In zero-copy input mode, complete input packets don't get
+//   their own data; pkt->data points into the receive buffer.
+// * The buffer is freed after pkt_comm has switched to another buffer
+//   and the application has deleted all packets referencing it.
+//
+// *****************************************************************
+
+struct pkt_input_buf {
+	int refs;
+	int size;
+	unsigned char data[];
+};
+
+struct pkt_input_buf *pkt_input_buf_new(int size);
+
+// Drops a reference, frees the buffer when it was the last one.
+// Thread safe.
+void pkt_input_buf_put(struct pkt_input_buf *buf);
+
+
 // *****************************************************************
 // 
 // packet queue
 //
+// * Growable queue: storage starts small and doubles as packets
+//   are pushed, up to the limits.
+// * Queue is limited by number of packets and by total size
+//   (bytes as transmitted, including headers and checksums).
+// * Limits are set per pkt_comm (struct pkt_comm_params,
+//   pkt_comm_set_queue_limits()). Default is 4096 packets
+//   or 1 MB, whichever is reached first.
+//
 // *****************************************************************
 
-#define PKT_QUEUE_MAX	100
+#define PKT_QUEUE_MAX_COUNT_DEFAULT	4096
+#define PKT_QUEUE_MAX_BYTES_DEFAULT	(1024 * 1024)
+
+#define PKT_QUEUE_INITIAL_SLOTS	16
 
 struct pkt_queue {
 	int count;			// number of packets currently in queue
+	int total_size;		// bytes
+	int max_count;
+	int max_bytes;
+	int num_slots;		// allocated slots
 	int empty_slot_idx;	// index of 1st empty slot
 	int first_pkt_idx;	// index of first packet
-	struct pkt *pkt[PKT_QUEUE_MAX];
+	struct pkt **pkt;
 };
 
 struct pkt_queue *pkt_queue_new();
 
 void pkt_queue_delete(struct pkt_queue *queue);
 
+// Sets limits. Queue is full when it has 'max_count' packets or
+// 'max_bytes' or more. A packet larger than 'max_bytes' can be
+// added to the queue if it's below the limit.
+void pkt_queue_set_limits(struct pkt_queue *queue, int max_count, int max_bytes);
+
 // returns false if queue has space for 'num' more packets
 int pkt_queue_full(struct pkt_queue *queue, int num);
 
@@ -105,6 +160,13 @@ int pkt_queue_push(struct pkt_queue *queue, struct pkt *pkt);
 // returns NULL if queue is empty
 struct pkt *pkt_queue_fetch(struct pkt_queue *queue);
 
+// returns first packet without removing it from the queue,
+// NULL if queue is empty
+struct pkt *pkt_queue_peek(struct pkt_queue *queue);
+
+// Get total size (including headers and checksums) of all packets in queue
+int pkt_queue_get_total_size(struct pkt_queue *queue);
+
 
 // *****************************************************************
 //
@@ -122,21 +184,68 @@ struct pkt_comm_params {
 	int alignment;
 	int output_max_len;	// link layer max. transmit length
 	int input_max_len;	// link layer max. receive length
+	// limits for input and output queues, 0 for defaults
+	// (PKT_QUEUE_MAX_COUNT_DEFAULT, PKT_QUEUE_MAX_BYTES_DEFAULT)
+	int queue_max_count;
+	int queue_max_bytes;
+};
+
+// Max. number of receive buffers
+#define PKT_COMM_INPUT_BUFS_MAX	16
+
+// Output ring holds that many link layer transfers
+#define PKT_COMM_OUTPUT_RING_TRANSFERS	4
+#define PKT_COMM_OUTPUT_RING_MIN	4096
+
+// Received buffer waiting for processing
+struct pkt_input_pending {
+	struct pkt_input_buf *buf;
+	int len;
 };
 
 struct pkt_comm {
 	struct pkt_comm_params *params;
 	
 	struct pkt_queue *output_queue;
-	unsigned char *output_buf;
-	int output_buf_size;
-	int output_buf_offset;
+	// Serialized output packets. Data to transmit is
+	// [head, tail) or, if wrapped, [head, wrap) followed by [0, tail)
+	unsigned char *output_ring;
+	int output_ring_size;
+	int output_ring_head;
+	int output_ring_tail;
+	int output_ring_wrap;		// -1 if not wrapped
+	int output_reserve_offset;	// -1 if there's no reservation
+	int output_reserve_len;
+	// packet from output queue being serialized in parts
+	struct pkt *output_pkt;
+	int output_pkt_offset;		// serialized bytes, including header
+	PKT_CHECKSUM_TYPE output_pkt_sum;	// sum of serialized data
+	// output shorter than output_max_len waits for more data
+	int output_flush_usec;
+	int output_flush;
+	long long output_pending_since;	// usec, 0 if output is not held
+	// no more packets go into the ring (pkt_comm_set_output_suspend())
+	int output_suspend;
 
 	struct pkt_queue *input_queue;
-	unsigned char *input_buf;
+	unsigned char *input_buf;	// input_ref->data
 	int input_buf_len;
 	int input_buf_offset;
 	struct pkt *input_pkt;
+	struct pkt_input_buf *input_ref;
+	int input_zero_copy;
+	// When input_buf can't be processed (input queue is full),
+	// input continues into additional buffers, up to input_bufs_max total
+	int input_bufs_max;
+	struct pkt_input_buf *input_fill;	// given to link layer
+	struct pkt_input_buf *input_spare;
+	struct pkt_input_pending input_pending[PKT_COMM_INPUT_BUFS_MAX];
+	int input_pending_first;
+	int input_pending_count;
+	// result packets are decoded there if enabled (pkt_result.h)
+	struct pkt_result_batch *result_batch;
+	// input packets are allocated from the pool (pkt_pool.h)
+	struct pkt_pool *pool;
 
 	int error;
 };
@@ -145,6 +254,67 @@ struct pkt_comm *pkt_comm_new(struct pkt_comm_params *params);
 
 void pkt_comm_delete(struct pkt_comm *comm);
 
+// Sets limits for both input and output queues
+// (pkt_queue_set_limits()), 0 for default.
+// pkt_comm_new() applies the limits from pkt_comm_params.
+void pkt_comm_set_queue_limits(struct pkt_comm *comm,
+		int max_count, int max_bytes);
+
+// Enables or disables zero-copy input. In zero-copy mode, packets
+// received completely in one link layer transfer reference the receive
+// buffer; packets split over transfers are copied.
+void pkt_comm_set_input_zero_copy(struct pkt_comm *comm, int enable);
+
+// Sets memory limit for receive buffers (rounded down to
+// a multiple of input_max_len, 1 .. PKT_COMM_INPUT_BUFS_MAX buffers).
+// With more than 1 buffer, link layer input continues while received
+// data waits for space in input queue. Default is 1 buffer.
+// Returns number of buffers.
+int pkt_comm_set_input_mem_max(struct pkt_comm *comm, int bytes);
+
+// Enables or disables decoding of result packets into
+// comm->result_batch (pkt_result.h). Returns -1 on error.
+int pkt_comm_set_result_batch(struct pkt_comm *comm, int enable);
+
+
+// *****************************************************************
+//
+// Output ring
+//
+// * Output packets are serialized (header, data, checksums, alignment
+//   padding) into a persistent ring, link layer transmits straight
+//   from the ring.
+// * Packets from output queue are moved into the ring when there's
+//   space, before packets added with pkt_comm_output_reserve().
+// * Ring size is a few link layer transfers. Packets larger than
+//   output_max_len are pulled from output queue and serialized in parts
+//   as the link layer consumes data, the ring doesn't grow.
+// * Application can build a packet in the ring in place,
+//   with no 'struct pkt' and no copying:
+//
+//	unsigned char *data = pkt_comm_output_reserve(comm, max_data_len);
+//	if (data) {
+//		... write up to max_data_len bytes ...
+//		pkt_comm_output_commit(comm, type, id, data_len);
+//	}
+//
+// * Reservation must be committed before output over link layer
+//   is requested.
+//
+// *****************************************************************
+
+// Reserves space for a packet with up to 'data_len' bytes of data.
+// Returns pointer to packet data or NULL if there's no space
+// (ring is waiting for transmission or output queue is not empty).
+// A packet larger than the ring gets space after the ring is empty
+// (the ring is reallocated).
+unsigned char *pkt_comm_output_reserve(struct pkt_comm *comm, int data_len);
+
+// Publishes reserved packet, 'data_len' must not exceed reserved length.
+// Header and checksums are written in place.
+// Returns -1 on error.
+int pkt_comm_output_commit(struct pkt_comm *comm, int type, int id, int data_len);
+
 
 // *****************************************************************
 //
@@ -153,10 +323,35 @@ void pkt_comm_delete(struct pkt_comm *comm);
 // *****************************************************************
 
 // Returns true if there's data for output
-//int pkt_comm_has_output_data(struct pkt_comm *comm);
+int pkt_comm_has_output_data(struct pkt_comm *comm);
+
+// With output_flush_usec set, output shorter than output_max_len
+// is held for up to 'usec' so more packets can be added to the transfer.
+// 0 (default) sends output immediately.
+void pkt_comm_set_output_flush_usec(struct pkt_comm *comm, int usec);
+
+// Sends pending output without waiting for output_flush_usec
+// (e.g. after a latency-sensitive packet was queued)
+void pkt_comm_output_flush(struct pkt_comm *comm);
+
+// Returns microseconds the output is going to be held for, 0 if
+// there's no output data or it's ready for transmission
+int pkt_comm_output_hold_usec(struct pkt_comm *comm);
+
+// While output is suspended, packets from output queue aren't moved
+// into the output ring and pkt_comm_output_reserve() returns NULL.
+// Data already in the ring (including the rest of a streamed packet)
+// is transmitted, so the output stream reaches a packet boundary.
+// Used to insert data from other source (device broadcast).
+void pkt_comm_set_output_suspend(struct pkt_comm *comm, int suspend);
+
+// Returns true if transmitted output ends at a packet boundary
+// (output ring is empty, no packet is being streamed)
+int pkt_comm_output_at_boundary(struct pkt_comm *comm);
 
 // Get data for output over link layer. Can be used to check
-// if there's data for output. If all or part of the data was actually sent,
+// if there's data for output. Packets from output queue are moved
+// into the output ring. If all or part of the data was actually sent,
 // then the caller must call pkt_comm_output_completed().
 // Returns a pointer to data buffer or NULL if there's no data for output.
 // 'len' is updated with data length.
@@ -168,9 +363,15 @@ unsigned char *pkt_comm_get_output_data(struct pkt_comm *comm, int *len);
 void pkt_comm_output_completed(struct pkt_comm *comm, int len, int error);
 
 // Get buffer for link layer input
-// Return NULL if input is full
+// Return NULL if input is full (all receive buffers are in use)
 unsigned char *pkt_comm_input_get_buf(struct pkt_comm *comm);
 
+// Returns true if there's no buffer for link layer input: received data
+// waits for processing and all receive buffers are in use, or input
+// queue is full. Unlike pkt_comm_input_get_buf(), doesn't process
+// input or allocate buffers.
+int pkt_comm_input_full(struct pkt_comm *comm);
+
 // Called after data was received into buffer requested with pkt_comm_input_get_buf()
 // 'len' is length of actually received data
 // < 0 on error
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pkt_comm.h"
+#include "pkt_pool.h"
+
+extern int total_pkt_count;
+
+
+struct pkt_pool *pkt_pool_new()
+{
+	struct pkt_pool *pool = malloc(sizeof(struct pkt_pool));
+	if (!pool) {
+		pkt_error("pkt_pool_new(): unable to allocate %d bytes\n",
+				(int)sizeof(struct pkt_pool));
+		return NULL;
+	}
+	memset(pool, 0, sizeof(struct pkt_pool));
+	pool->refs = 1;
+	pool->owned = 1;
+	pool->owner = pthread_self();
+
+	// objects are 16-byte aligned
+	pool->class[PKT_POOL_CLASS_PKT].size = (sizeof(struct pkt) + 15) & ~15;
+	int i;
+	for (i = 1; i < PKT_POOL_NUM_CLASSES; i++)
+		pool->class[i].size = PKT_POOL_DATA_MIN << (i - 1);
+
+	return pool;
+}
+
+void pkt_pool_destroy(struct pkt_pool *pool)
+{
+	int i;
+	for (i = 0; i < PKT_POOL_NUM_CLASSES; i++) {
+		void *slab = pool->class[i].slab;
+		while (slab) {
+			void *next = *(void **)slab;
+			free(slab);
+			slab = next;
+		}
+	}
+	free(pool);
+}
+
+void pkt_pool_delete(struct pkt_pool *pool)
+{
+	if (!pool) {
+		pkt_error("pkt_pool_delete(): NULL argument\n");
+		return;
+	}
+	if (!__atomic_sub_fetch(&pool->refs, 1, __ATOMIC_ACQ_REL))
+		pkt_pool_destroy(pool);
+}
+
+void pkt_pool_set_shared(struct pkt_pool *pool)
+{
+	pool->owned = 0;
+}
+
+// Carves objects from a new slab, places them into free list.
+// The first object holds pointer to the next slab.
+int pkt_pool_add_slab(struct pkt_pool_class *class)
+{
+	char *slab = malloc(PKT_POOL_SLAB_SIZE);
+	if (!slab) {
+		pkt_error("pkt_pool_add_slab(): unable to allocate %d bytes\n",
+				PKT_POOL_SLAB_SIZE);
+		return -1;
+	}
+	*(void **)slab = class->slab;
+	class->slab = slab;
+	class->slab_count++;
+
+	int offset;
+	for (offset = PKT_POOL_SLAB_SIZE - class->size; offset >= class->size;
+			offset -= class->size) {
+		*(void **)(slab + offset) = class->free;
+		class->free = slab + offset;
+		class->obj_count++;
+	}
+	return 0;
+}
+
+void *pkt_pool_alloc(struct pkt_pool *pool, int class_num)
+{
+	struct pkt_pool_class *class = &pool->class[class_num];
+
+	if (!class->free) {
+		// take objects returned by pkt_delete()
+		class->free = __atomic_exchange_n(&class->remote_free, NULL,
+				__ATOMIC_ACQUIRE);
+		if (!class->free && pkt_pool_add_slab(class) < 0)
+			return NULL;
+	}
+
+	void *obj = class->free;
+	class->free = *(void **)obj;
+	class->alloc_count++;
+	__atomic_add_fetch(&pool->refs, 1, __ATOMIC_RELAXED);
+	return obj;
+}
+
+void pkt_pool_free(struct pkt_pool *pool, void *obj, int class_num)
+{
+	struct pkt_pool_class *class = &pool->class[class_num];
+
+	if (pool->owned && pthread_equal(pool->owner, pthread_self())) {
+		*(void **)obj = class->free;
+		class->free = obj;
+
+	} else {
+		void *head = __atomic_load_n(&class->remote_free, __ATOMIC_RELAXED);
+		do {
+			*(void **)obj = head;
+		} while (!__atomic_compare_exchange_n(&class->remote_free, &head, obj,
+				1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	__atomic_add_fetch(&class->free_count, 1, __ATOMIC_RELAXED);
+
+	// pool was deleted, that's the last object
+	if (!__atomic_sub_fetch(&pool->refs, 1, __ATOMIC_ACQ_REL))
+		pkt_pool_destroy(pool);
+}
+
+struct pkt *pkt_pool_pkt_new(struct pkt_pool *pool, int type, char *data, int data_len)
+{
+	struct pkt *pkt = pkt_pool_alloc(pool, PKT_POOL_CLASS_PKT);
+	if (!pkt)
+		return NULL;
+
+	pkt->version = PKT_COMM_VERSION;
+	pkt->type = type;
+	pkt->data_len = data_len;
+	pkt->id = 0;
+
+	pkt->data = data;
+	pkt->header_ok = 0;
+	pkt->partial_header_len = 0;
+	pkt->partial_data_len = 0;
+	pkt->header = NULL;
+	pkt->pool = pool;
+	pkt->data_class = -1;
+	pkt->input_buf = NULL;
+
+	__atomic_fetch_add(&total_pkt_count, 1, __ATOMIC_RELAXED);
+	return pkt;
+}
+
+struct pkt *pkt_pool_pkt_copy(struct pkt_pool *pool, struct pkt *pkt)
+{
+	struct pkt *pkt_copy = pkt_pool_pkt_new(pool, pkt->type, NULL, pkt->data_len);
+	if (!pkt_copy)
+		return NULL;
+	pkt_copy->id = pkt->id;
+	if (!pkt->data_len)
+		return pkt_copy;
+
+	pkt_copy->data = pkt_pool_data_alloc(pkt_copy);
+	if (!pkt_copy->data) {
+		pkt_error("pkt_pool_pkt_copy(): unable to allocate %d bytes\n",
+				pkt->data_len);
+		pkt_delete(pkt_copy);
+		return NULL;
+	}
+	memcpy(pkt_copy->data, pkt->data, pkt->data_len);
+	return pkt_copy;
+}
+
+char *pkt_pool_data_alloc(struct pkt *pkt)
+{
+	struct pkt_pool *pool = pkt->pool;
+	int size = pkt->data_len + PKT_CHECKSUM_LEN;
+
+	if (size > PKT_POOL_DATA_MAX) {
+		pool->oversize_count++;
+		pkt->data_class = -1;
+		return malloc(size);
+	}
+
+	int class_num = 1;
+	while (pool->class[class_num].size < size)
+		class_num++;
+	pkt->data_class = class_num;
+	return pkt_pool_alloc(pool, class_num);
+}
+
+void pkt_pool_get_stats(struct pkt_pool *pool, int class_num,
+		struct pkt_pool_stats *stats)
+{
+	struct pkt_pool_class *class = &pool->class[class_num];
+	stats->size = class->size;
+	stats->slab_count = class->slab_count;
+	stats->obj_count = class->obj_count;
+	stats->alloc_count = class->alloc_count;
+	stats->in_use = class->alloc_count
+			- __atomic_load_n(&class->free_count, __ATOMIC_RELAXED);
+}
+
+void pkt_pool_print_stats(struct pkt_pool *pool)
+{
+	int i;
+	for (i = 0; i < PKT_POOL_NUM_CLASSES; i++) {
+		struct pkt_pool_stats stats;
+		pkt_pool_get_stats(pool, i, &stats);
+		if (!stats.slab_count)
+			continue;
+		fprintf(stderr, "pkt_pool: %s %4d bytes: %d slabs, %d objects, %d in use, %llu allocs\n",
+				i == PKT_POOL_CLASS_PKT ? "pkt " : "data", stats.size,
+				stats.slab_count, stats.obj_count, stats.in_use, stats.alloc_count);
+	}
+	if (pool->oversize_count)
+		fprintf(stderr, "pkt_pool: %llu data allocations over %d bytes\n",
+				pool->oversize_count, PKT_POOL_DATA_MAX);
+}
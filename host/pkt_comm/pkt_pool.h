@@ -0,0 +1,92 @@
+// ***************************************************************
+//
+// Pool allocator for input packets
+//
+// * Each pkt_comm has a pool. 'struct pkt' and packet data
+//   of received packets (also copies of broadcast packets)
+//   are taken from the pool, pkt_delete() returns them there.
+// * Objects are carved from PKT_POOL_SLAB_SIZE slabs.
+//   Data is allocated in size classes (PKT_POOL_DATA_MIN ..
+//   PKT_POOL_DATA_MAX bytes, powers of 2), larger data is malloc'ed.
+// * Objects are allocated by the thread that performs I/O
+//   on the pkt_comm; pkt_delete() is allowed from any thread.
+// * The thread that created the pool owns it: objects it deletes go
+//   straight to the free list. Objects deleted by other threads go
+//   to the lock-free remote list, allocating thread takes them
+//   when its free list is empty. If I/O is performed by other thread
+//   (device_worker.c), the pool is made shared before that.
+// * Memory is not returned to the system until pkt_comm is deleted
+//   and all packets from the pool are deleted.
+//
+// ***************************************************************
+
+#include <pthread.h>
+
+#define PKT_POOL_SLAB_SIZE	65536
+
+#define PKT_POOL_DATA_MIN	32
+#define PKT_POOL_DATA_MAX	4096
+
+// class 0 is 'struct pkt', classes 1..8 are data of 32..4096 bytes
+#define PKT_POOL_CLASS_PKT	0
+#define PKT_POOL_NUM_CLASSES	9
+
+struct pkt_pool_class {
+	int size;			// object size
+	void *free;			// free list, accessed by allocating thread
+	void *remote_free;	// objects returned by pkt_delete()
+	void *slab;			// list of slabs
+	int slab_count;
+	int obj_count;		// objects carved from slabs
+	unsigned long long alloc_count;
+	unsigned long long free_count;
+};
+
+struct pkt_pool {
+	// number of objects in use, +1 while the pool has an owner
+	int refs;
+	// owner thread allocates and frees without atomic operations,
+	// no owner if the pool is shared
+	int owned;
+	pthread_t owner;
+	unsigned long long oversize_count;	// data allocations with malloc()
+	struct pkt_pool_class class[PKT_POOL_NUM_CLASSES];
+};
+
+struct pkt_pool_stats {
+	int size;
+	int slab_count;
+	int obj_count;
+	int in_use;
+	unsigned long long alloc_count;
+};
+
+struct pkt_pool *pkt_pool_new();
+
+// Pool is freed when the last object is returned
+void pkt_pool_delete(struct pkt_pool *pool);
+
+// Objects are allocated by other thread from now on, every thread
+// returns objects via remote list. Must be called before the thread
+// that is going to allocate starts.
+void pkt_pool_set_shared(struct pkt_pool *pool);
+
+// Creates new packet (like pkt_new()), 'struct pkt' is from the pool
+struct pkt *pkt_pool_pkt_new(struct pkt_pool *pool, int type, char *data, int data_len);
+
+// Creates a copy of the packet, 'struct pkt' and data are from the pool
+struct pkt *pkt_pool_pkt_copy(struct pkt_pool *pool, struct pkt *pkt);
+
+// Allocates data for the packet created with pkt_pool_pkt_new()
+// (pkt->data_len + PKT_CHECKSUM_LEN bytes)
+char *pkt_pool_data_alloc(struct pkt *pkt);
+
+// Returns the object to the pool. Thread safe.
+void pkt_pool_free(struct pkt_pool *pool, void *obj, int class_num);
+
+// Statistics for the class 'class_num'
+void pkt_pool_get_stats(struct pkt_pool *pool, int class_num,
+		struct pkt_pool_stats *stats);
+
+// Prints pool statistics to stderr
+void pkt_pool_print_stats(struct pkt_pool *pool);
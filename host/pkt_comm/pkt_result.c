@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pkt_comm.h"
+#include "pkt_result.h"
+
+
+struct pkt_result_batch *pkt_result_batch_new()
+{
+	struct pkt_result_batch *batch = malloc(sizeof(struct pkt_result_batch));
+	if (!batch) {
+		pkt_error("pkt_result_batch_new(): unable to allocate %d bytes\n",
+				(int)sizeof(struct pkt_result_batch));
+		return NULL;
+	}
+	batch->count = 0;
+	return batch;
+}
+
+void pkt_result_batch_delete(struct pkt_result_batch *batch)
+{
+	free(batch);
+}
+
+void pkt_result_batch_clear(struct pkt_result_batch *batch)
+{
+	batch->count = 0;
+}
+
+int pkt_result_batch_full(struct pkt_result_batch *batch)
+{
+	return batch->count == PKT_RESULT_BATCH_MAX;
+}
+
+unsigned int pkt_result_read32(unsigned char *src)
+{
+	return src[0] | (src[1] << 8) | (src[2] << 16) | ((unsigned int)src[3] << 24);
+}
+
+// Stores result data (PKT_RESULT_DATA_LEN bytes)
+void pkt_result_store(struct pkt_result_batch *batch, int pkt_id,
+		unsigned char *data)
+{
+	int i = batch->count++;
+	batch->pkt_id[i] = pkt_id;
+	memcpy(batch->plaintext[i], data, PKT_RESULT_PLAINTEXT_LEN);
+	batch->word_id[i] = data[8] | (data[9] << 8);
+	batch->gen_id[i] = pkt_result_read32(data + 10);
+}
+
+// Header words of result packet: version 1, type 0x81, reserved 0;
+// data_len 14, reserved 0
+#define PKT_RESULT_HEADER_W0	(PKT_COMM_VERSION | PKT_TYPE_RESULT << 8)
+#define PKT_RESULT_HEADER_W1	PKT_RESULT_DATA_LEN
+
+int pkt_result_decode(struct pkt_result_batch *batch, unsigned char *buf, int len)
+{
+	int offset = 0;
+
+	while (len - offset >= PKT_RESULT_LEN && batch->count < PKT_RESULT_BATCH_MAX) {
+		unsigned char *header = buf + offset;
+		if (pkt_result_read32(header) != PKT_RESULT_HEADER_W0
+				|| pkt_result_read32(header + 4) != PKT_RESULT_HEADER_W1)
+			break;
+
+		// Header checksum: the only variable word is packet id
+		int pkt_id = header[8] | (header[9] << 8);
+		unsigned int checksum = ~(PKT_RESULT_HEADER_W0 + PKT_RESULT_HEADER_W1 + pkt_id);
+		unsigned int checksum_got = pkt_result_read32(header + PKT_HEADER_LEN);
+		if (checksum_got != checksum) {
+			pkt_error("pkt_result_decode: bad header checksum: got 0x%x, must be 0x%x\n",
+					checksum_got, checksum);
+			return -1;
+		}
+
+		unsigned char *data = header + PKT_HEADER_LEN + PKT_CHECKSUM_LEN;
+		checksum = ~(pkt_result_read32(data) + pkt_result_read32(data + 4)
+				+ pkt_result_read32(data + 8) + (data[12] | (data[13] << 8)));
+		checksum_got = pkt_result_read32(data + PKT_RESULT_DATA_LEN);
+		if (checksum_got != checksum) {
+			pkt_error("pkt_result_decode: bad checksum: got 0x%x, must be 0x%x\n",
+					checksum_got, checksum);
+			return -1;
+		}
+
+		pkt_result_store(batch, pkt_id, data);
+		offset += PKT_RESULT_LEN;
+	}
+
+	return offset;
+}
+
+int pkt_result_add_pkt(struct pkt_result_batch *batch, struct pkt *pkt)
+{
+	if (pkt->type != PKT_TYPE_RESULT || pkt->data_len != PKT_RESULT_DATA_LEN)
+		return -1;
+	pkt_result_store(batch, pkt->id, (unsigned char *)pkt->data);
+	return 0;
+}
@@ -0,0 +1,57 @@
+// ***************************************************************
+//
+// Result packets (outpkt_word.v)
+//
+// * Fixed format: 10-byte header, 14 bytes data
+//   (8 chars of plaintext, 16-bit word_id, 32-bit gen_id)
+// * With result batch enabled (pkt_comm_set_result_batch()),
+//   pkt_comm decodes result packets straight into the batch,
+//   no 'struct pkt' is created. Other packets go into input queue.
+// * Runs of complete result packets in the receive buffer are
+//   verified and decoded in bulk.
+// * When the batch is full, input stops until the application
+//   clears the batch.
+//
+// ***************************************************************
+
+#ifndef _PKT_RESULT_H_
+
+#define PKT_TYPE_RESULT		0x81
+
+#define PKT_RESULT_DATA_LEN		14
+#define PKT_RESULT_PLAINTEXT_LEN	8
+// Result packet length over link layer, including checksums
+#define PKT_RESULT_LEN		(PKT_HEADER_LEN + PKT_RESULT_DATA_LEN + 2 * PKT_CHECKSUM_LEN)
+
+#define PKT_RESULT_BATCH_MAX	1024
+
+// Structure of arrays, entries 0 .. count-1 are valid
+struct pkt_result_batch {
+	int count;
+	unsigned short pkt_id[PKT_RESULT_BATCH_MAX];
+	unsigned short word_id[PKT_RESULT_BATCH_MAX];
+	unsigned int gen_id[PKT_RESULT_BATCH_MAX];
+	unsigned char plaintext[PKT_RESULT_BATCH_MAX][PKT_RESULT_PLAINTEXT_LEN];
+};
+
+struct pkt_result_batch *pkt_result_batch_new();
+
+void pkt_result_batch_delete(struct pkt_result_batch *batch);
+
+// Application calls that after it has processed the batch
+void pkt_result_batch_clear(struct pkt_result_batch *batch);
+
+int pkt_result_batch_full(struct pkt_result_batch *batch);
+
+// Decodes run of complete result packets from 'buf' into the batch
+// until another packet type, incomplete packet or full batch.
+// Returns number of bytes consumed, < 0 on bad checksum.
+int pkt_result_decode(struct pkt_result_batch *batch, unsigned char *buf, int len);
+
+// Adds result packet received with generic input processing
+// Returns -1 if the packet is not a result packet.
+int pkt_result_add_pkt(struct pkt_result_batch *batch, struct pkt *pkt);
+
+
+#define _PKT_RESULT_H_
+#endif
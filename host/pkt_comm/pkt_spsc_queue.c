@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pkt_comm.h"
+#include "pkt_spsc_queue.h"
+
+
+struct pkt_spsc_queue *pkt_spsc_queue_new(int size)
+{
+	struct pkt_spsc_queue *queue = malloc(sizeof(struct pkt_spsc_queue));
+	if (!queue) {
+		pkt_error("pkt_spsc_queue_new(): unable to allocate %d bytes\n",
+				(int)sizeof(struct pkt_spsc_queue));
+		return NULL;
+	}
+	memset(queue, 0, sizeof(struct pkt_spsc_queue));
+
+	int num_slots = 2;
+	while (num_slots < size)
+		num_slots *= 2;
+	queue->mask = num_slots - 1;
+
+	queue->pkt = malloc(num_slots * sizeof(struct pkt *));
+	if (!queue->pkt) {
+		pkt_error("pkt_spsc_queue_new(): unable to allocate %d bytes\n",
+				(int)(num_slots * sizeof(struct pkt *)));
+		free(queue);
+		return NULL;
+	}
+	return queue;
+}
+
+void pkt_spsc_queue_delete(struct pkt_spsc_queue *queue)
+{
+	if (!queue) {
+		pkt_error("pkt_spsc_queue_delete(): NULL argument\n");
+		return;
+	}
+
+	struct pkt *pkt;
+	while ( (pkt = pkt_spsc_queue_fetch(queue)) )
+		pkt_delete(pkt);
+	free(queue->pkt);
+	free(queue);
+}
+
+int pkt_spsc_queue_full(struct pkt_spsc_queue *queue, int num)
+{
+	unsigned int tail = queue->tail;
+	if (tail - queue->head_cached + num <= queue->mask + 1)
+		return 0;
+	queue->head_cached = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	return tail - queue->head_cached + num > queue->mask + 1;
+}
+
+int pkt_spsc_queue_push(struct pkt_spsc_queue *queue, struct pkt *pkt)
+{
+	if (pkt_spsc_queue_full(queue, 1))
+		return -1;
+
+	unsigned int tail = queue->tail;
+	queue->pkt[tail & queue->mask] = pkt;
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+struct pkt *pkt_spsc_queue_fetch(struct pkt_spsc_queue *queue)
+{
+	unsigned int head = queue->head;
+	if (head == queue->tail_cached) {
+		queue->tail_cached = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+		if (head == queue->tail_cached)
+			return NULL;
+	}
+
+	struct pkt *pkt = queue->pkt[head & queue->mask];
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+	return pkt;
+}
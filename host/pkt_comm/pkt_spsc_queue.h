@@ -0,0 +1,53 @@
+// ***************************************************************
+//
+// Single-producer single-consumer packet queue
+//
+// * Passes packets between 2 threads without locks:
+//   one thread pushes, another one fetches.
+// * Capacity is fixed at creation (rounded up to a power of 2).
+// * Producer and consumer indices are padded to separate cache lines,
+//   each side keeps a cached copy of the other side's index.
+//
+// ***************************************************************
+
+#ifndef _PKT_SPSC_QUEUE_H_
+
+#include "pkt_comm.h"
+
+#define PKT_SPSC_CACHE_LINE	64
+
+// Indices grow (and wrap around), slot is (index & mask)
+struct pkt_spsc_queue {
+	// read-only after creation
+	unsigned int mask;
+	struct pkt **pkt;
+	char pad0[PKT_SPSC_CACHE_LINE];
+
+	// written by consumer
+	unsigned int head;
+	unsigned int tail_cached;	// consumer's copy of 'tail'
+	char pad1[PKT_SPSC_CACHE_LINE];
+
+	// written by producer
+	unsigned int tail;
+	unsigned int head_cached;	// producer's copy of 'head'
+	char pad2[PKT_SPSC_CACHE_LINE];
+};
+
+struct pkt_spsc_queue *pkt_spsc_queue_new(int size);
+
+// Deletes remaining packets. No thread must use the queue.
+void pkt_spsc_queue_delete(struct pkt_spsc_queue *queue);
+
+// Producer: returns false if queue has space for 'num' more packets
+int pkt_spsc_queue_full(struct pkt_spsc_queue *queue, int num);
+
+// Producer: returns -1 if queue is full
+int pkt_spsc_queue_push(struct pkt_spsc_queue *queue, struct pkt *pkt);
+
+// Consumer: returns NULL if queue is empty
+struct pkt *pkt_spsc_queue_fetch(struct pkt_spsc_queue *queue);
+
+
+#define _PKT_SPSC_QUEUE_H_
+#endif
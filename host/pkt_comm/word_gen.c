@@ -12,16 +12,8 @@ struct word_gen word_gen_words_pass_by = {
 };
 
 
-struct pkt *pkt_word_gen_new(struct word_gen *word_gen)
+int word_gen_serialize(struct word_gen *word_gen, char *data)
 {
-
-	char *data = malloc(WORD_GEN_MAX_SIZE);
-	if (!data) {
-		pkt_error("pkt_word_gen_new(): unable to allocate %d bytes\n",
-				WORD_GEN_MAX_SIZE);
-		return NULL;
-	}
-
 	int offset = 0;
 
 	int i;
@@ -47,8 +39,31 @@ struct pkt *pkt_word_gen_new(struct word_gen *word_gen)
 	data[offset++] = word_gen->num_generate >> 24;
 
 	data[offset++] = 0xBB;
-	
-	struct pkt *pkt = pkt_new(PKT_TYPE_WORD_GEN, data, offset);
-	//printf("pkt_word_gen_new: data_len %d\n", offset);
+	return offset;
+}
+
+struct pkt *pkt_word_gen_new(struct word_gen *word_gen)
+{
+
+	char *data = malloc(WORD_GEN_MAX_SIZE);
+	if (!data) {
+		pkt_error("pkt_word_gen_new(): unable to allocate %d bytes\n",
+				WORD_GEN_MAX_SIZE);
+		return NULL;
+	}
+
+	int len = word_gen_serialize(word_gen, data);
+	struct pkt *pkt = pkt_new(PKT_TYPE_WORD_GEN, data, len);
+	//printf("pkt_word_gen_new: data_len %d\n", len);
 	return pkt;
 }
+
+int pkt_word_gen_output(struct pkt_comm *comm, struct word_gen *word_gen, int id)
+{
+	char *data = (char *)pkt_comm_output_reserve(comm, WORD_GEN_MAX_SIZE);
+	if (!data)
+		return -1;
+
+	int len = word_gen_serialize(word_gen, data);
+	return pkt_comm_output_commit(comm, PKT_TYPE_WORD_GEN, id, len);
+}
@@ -35,5 +35,12 @@ struct word_gen {
 
 struct word_gen word_gen_words_pass_by;
 
+// Writes packet data (up to WORD_GEN_MAX_SIZE bytes), returns length
+int word_gen_serialize(struct word_gen *word_gen, char *data);
+
 struct pkt *pkt_word_gen_new(struct word_gen *word_gen);
 
+// Builds the packet in output ring of 'comm' (no 'struct pkt' created).
+// Returns -1 if there's no space in the ring.
+int pkt_word_gen_output(struct pkt_comm *comm, struct word_gen *word_gen, int id);
+
@@ -5,13 +5,29 @@
 #include "pkt_comm.h"
 #include "word_list.h"
 
-struct pkt *pkt_word_list_new(char **words)
+int word_list_len(char **words)
 {
 	int len = 0;
 	int i;
 	for (i = 0; words[i]; i++) {
 		len += strlen(words[i]) + 1;
 	}
+	return len;
+}
+
+void word_list_serialize(char **words, char *data)
+{
+	int offset = 0;
+	int i;
+	for (i = 0; words[i]; i++) {
+		strcpy(data + offset, words[i]);
+		offset += strlen(words[i]) + 1;
+	}
+}
+
+struct pkt *pkt_word_list_new(char **words)
+{
+	int len = word_list_len(words);
 	if (!len) {
 		pkt_error("pkt_wordlist_new(): empty packet\n");
 		return NULL;
@@ -23,16 +39,28 @@ struct pkt *pkt_word_list_new(char **words)
 		return NULL;
 	}
 	
-	int offset = 0;
-	for (i = 0; words[i]; i++) {
-		strcpy(data + offset, words[i]);
-		offset += strlen(words[i]) + 1;
-	}
+	word_list_serialize(words, data);
 
 	struct pkt *pkt = pkt_new(PKT_TYPE_WORD_LIST, data, len);
 	return pkt;
 }
 
+int pkt_word_list_output(struct pkt_comm *comm, char **words, int id)
+{
+	int len = word_list_len(words);
+	if (!len) {
+		pkt_error("pkt_word_list_output(): empty packet\n");
+		return -1;
+	}
+
+	char *data = (char *)pkt_comm_output_reserve(comm, len);
+	if (!data)
+		return -1;
+
+	word_list_serialize(words, data);
+	return pkt_comm_output_commit(comm, PKT_TYPE_WORD_LIST, id, len);
+}
+
 struct pkt *pkt_word_list_new_fixed_len(char *words, int num_words, int max_len)
 {
 	int len = 0;
@@ -9,4 +9,8 @@
 
 struct pkt *pkt_word_list_new(char **words);
 
+// Builds the packet in output ring of 'comm' (no 'struct pkt' created).
+// Returns -1 if there's no space in the ring.
+int pkt_word_list_output(struct pkt_comm *comm, char **words, int id);
+
 struct pkt *pkt_word_list_new_fixed_len(char *words, int num_words, int max_len);
@@ -23,6 +23,29 @@ void signal_handler(int signum)
 	signal_received = 1;
 }
 
+// Notification thresholds (device_notify_enable()). When a pass over
+// devices transferred nothing, the test waits for notification
+// (up to NOTIFY_WAIT_MS) instead of polling FPGAs.
+#define NOTIFY_OUTPUT_BYTES	4096
+#define NOTIFY_INPUT_BYTES	16384
+#define NOTIFY_WAIT_MS		10
+
+void notify_enable(struct device_list *device_list)
+{
+	struct device *device;
+	for (device = device_list->device; device; device = device->next) {
+		if (!device_valid(device))
+			continue;
+		int result = device_notify_enable(device, NOTIFY_OUTPUT_BYTES,
+				NOTIFY_INPUT_BYTES);
+		if (result < 0) {
+			fprintf(stderr, "SN %s device_notify_enable(): %d (%s)\n",
+				device->ztex_device->snString, result, libusb_strerror(result) );
+			device_invalidate(device);
+		}
+	}
+}
+
 void set_random()
 {
 	struct timeval tv0;
@@ -35,7 +58,8 @@ struct device_bitstream bitstream_test = {
 	0x0001,					// type ID, hardcoded at vcr.v/BITSTREAM_TYPE
 	"../fpga/inouttraffic.bit",
 	{	2,	// 2 is constant for the board; reflects the fact of 16-bit I/O
-		16384, // FPGA's input buffer can accept this many bytes when IO_STATE_INPUT_PROG_FULL deasserted
+		32768, // Size of FPGA's input buffer; writes are limited to free space reported by FPGA
+				// (IO_STATE_INPUT_FREE_VALID), 16384 bytes when IO_STATE_INPUT_PROG_FULL deasserted otherwise
 		32766 // Size of FPGA's output buffer; can receive at most this many bytes in 1 read
 	}		// struct pkt_comm_params
 };
@@ -110,6 +134,7 @@ int main(int argc, char **argv)
 	///////////////////////////////////////////////////////////////
 //ZTEX_DEBUG=1;
 //DEBUG = 1;
+//device_pkt_rw_duplex = 1;
 
 	struct device_list *device_list = device_init_scan(&bitstream_test);
 	
@@ -118,6 +143,7 @@ int main(int argc, char **argv)
 	
 	if (device_count)
 		ztex_dev_list_print(device_list->ztex_dev_list);
+	notify_enable(device_list);
 	//else
 	//	exit(0);
 	
@@ -148,11 +174,13 @@ int main(int argc, char **argv)
 		if (found_devices) {
 			fprintf(stderr, "Found %d device(s) ZTEX 1.15y\n", found_devices);
 			ztex_dev_list_print(device_list_1->ztex_dev_list);
+			notify_enable(device_list_1);
 		}
 		device_list_merge(device_list, device_list_1);
 
 
 		int device_count = 0;
+		int data_transferred = 0;
 		struct device *device;
 		for (device = device_list->device; device; device = device->next) {
 			if (!device_valid(device))
@@ -162,6 +190,8 @@ int main(int argc, char **argv)
 				break;
 
 			result = device_pkt_rw(device);
+			// Asynchronous I/O engine: I/O to several devices goes simultaneously
+			//result = device_pkt_rw_async(device);
 			if (result < 0) {
 				fprintf(stderr, "SN %s device_pkt_rw(): %d (%s)\n",
 					device->ztex_device->snString, result, libusb_strerror(result) );
@@ -169,6 +199,8 @@ int main(int argc, char **argv)
 				continue;
 			}
 			device_count ++;
+			if (result > 0)
+				data_transferred = 1;
 
 
 			struct pkt *inpkt;
@@ -227,6 +259,23 @@ int main(int argc, char **argv)
 
 		} // for (device_list)
 
+		// Nothing to do: wait for some device to report an event
+		// (device_wait_event() returns at once if notification isn't enabled)
+		for (device = device_list->device; device_count && !data_transferred
+				&& !signal_received && device; device = device->next) {
+			if (!device_valid(device))
+				continue;
+			result = device_wait_event(device, NOTIFY_WAIT_MS / device_count + 1);
+			if (result < 0) {
+				fprintf(stderr, "SN %s device_wait_event(): %d (%s)\n",
+					device->ztex_device->snString, result, libusb_strerror(result) );
+				device_invalidate(device);
+				continue;
+			}
+			if (result > 0)
+				break;
+		}
+
 		if (signal_received) {
 			fprintf(stderr, "Signal received.\n");
 			break;
@@ -237,6 +286,21 @@ int main(int argc, char **argv)
 	gettimeofday(&tv1, NULL);
 	unsigned long usec = (tv1.tv_sec - tv0.tv_sec)*1000000 + tv1.tv_usec - tv0.tv_usec;
 
+	// Control transfers per MB moved (see device_pkt_rw() scheduler)
+	struct device *device;
+	for (device = device_list->device; device; device = device->next) {
+		uint64_t cmd_count = 0, data_bytes = 0;
+		int num;
+		for (num = 0; num < device->num_of_fpgas; num++) {
+			cmd_count += device->fpga[num].cmd_count;
+			data_bytes += device->fpga[num].sched.data_bytes;
+		}
+		fprintf(stderr, "SN %s: %llu control transfers, %.1f MB, %.1f per MB\n",
+			device->ztex_device->snString, (unsigned long long)cmd_count,
+			(double)data_bytes / 1048576,
+			data_bytes ? (double)cmd_count * 1048576 / data_bytes : 0);
+	}
+
 	libusb_exit(NULL);
 }
 
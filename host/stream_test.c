@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libusb-1.0/libusb.h>
+
+#include "ztex.h"
+#include "inouttraffic.h"
+#include "pkt_comm/pkt_comm.h"
+#include "device.h"
+#include "device_async.h"
+#include "loopback.h"
+
+// Checks stream mode input (device_stream_input()). The test models
+// EP2: output of FPGAs (pkt_comm on FPGA side) goes in segments, one
+// segment per switch to the FPGA. A segment is cut into USB packets:
+// full 512-byte ones and short ones (PKTEND at random points),
+// the segment is ended with zero-length packet. USB packets are
+// collected into IN transfers of STREAM_READ_LEN that end with a short
+// packet or when full. Reply to the switch comes before or after
+// the data of the new segment; input queues in the host are small,
+// so transfers wait for space. Host side pkt_comm is from a loopback
+// device, no transfers are submitted.
+// Every packet must come to its FPGA, in order.
+//
+// Usage: stream_test [packets_per_fpga [fpgas]]
+
+struct pkt_comm_params pkt_comm_params_test = {
+	2, 16384, 32766
+};
+
+#define INPUT_QUEUE_MAX		16
+#define SEGMENT_MAX			40000
+
+struct device_async *async;
+struct pkt_comm *sender[DEVICE_FPGAS_MAX];
+int num_of_fpgas;
+int expected_id[DEVICE_FPGAS_MAX];
+int pending_owner = -1;		// switch reply isn't received yet
+unsigned long long transfers, zlps, waits, bad_pkts;
+
+// IN transfer being filled
+struct stream_transfer xfer;
+// USB packet being filled by the FPGA
+unsigned char usb_pkt[512];
+int usb_pkt_len;
+
+int pkt_len(int num, int id)
+{
+	return 1 + (id * 7 + num * 13) % 300;
+}
+
+void fetch_input(int num)
+{
+	struct pkt *inpkt;
+	while ( (inpkt = pkt_queue_fetch(async->device->fpga[num].comm->input_queue)) ) {
+		int ok = inpkt->id == (expected_id[num] & 0xffff)
+				&& inpkt->data_len == pkt_len(num, expected_id[num]);
+		int i;
+		for (i = 0; ok && i < inpkt->data_len; i++)
+			if ((unsigned char)inpkt->data[i] != ((expected_id[num] + i + num) & 0xff))
+				ok = 0;
+		if (!ok) {
+			printf("FPGA #%d: bad packet id=%d len=%d, expected id=%d\n",
+					num, inpkt->id, inpkt->data_len, expected_id[num]);
+			bad_pkts++;
+		}
+		expected_id[num]++;
+		pkt_delete(inpkt);
+	}
+}
+
+void transfer_completed()
+{
+	xfer.offset = 0;
+	xfer.zlp = xfer.len < STREAM_READ_LEN && !(xfer.len % 512);
+	xfer.done = 1;
+	transfers++;
+	if (xfer.zlp)
+		zlps++;
+
+	int result;
+	while ( !(result = device_stream_input(async, &xfer)) ) {
+		waits++;
+		if (!async->stream_owner_count && pending_owner >= 0) {
+			device_stream_owner_push(async, pending_owner);
+			pending_owner = -1;
+			continue;
+		}
+		int num;
+		for (num = 0; num < num_of_fpgas; num++)
+			fetch_input(num);
+		if (!async->stream_owner_count) {
+			printf("FAILED: data with no segment expected\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (result < 0) {
+		printf("FAILED: device_stream_input(): %d\n", result);
+		exit(EXIT_FAILURE);
+	}
+	xfer.len = 0;
+	xfer.done = 0;
+}
+
+// USB packet is committed: 512 bytes or PKTEND (including ZLP)
+void usb_pkt_commit()
+{
+	memcpy(xfer.buf + xfer.len, usb_pkt, usb_pkt_len);
+	xfer.len += usb_pkt_len;
+	if (usb_pkt_len < 512 || xfer.len == STREAM_READ_LEN)
+		transfer_completed();
+	usb_pkt_len = 0;
+}
+
+// FPGA outputs up to 'len' bytes while it's selected
+void fpga_output(int num, int len)
+{
+	while (len > 0) {
+		int output_len = 0;
+		unsigned char *data = pkt_comm_get_output_data(sender[num], &output_len);
+		if (!data || !output_len)
+			break;
+		if (output_len > len)
+			output_len = len;
+
+		int i;
+		for (i = 0; i < output_len; i += 2) {
+			usb_pkt[usb_pkt_len++] = data[i];
+			usb_pkt[usb_pkt_len++] = data[i + 1];
+			// Output FIFO is empty for a while: PKTEND
+			if (usb_pkt_len == 512 || !(random() % 1000))
+				usb_pkt_commit();
+		}
+		pkt_comm_output_completed(sender[num], output_len, 0);
+		len -= output_len;
+	}
+}
+
+// Switch to other FPGA: the rest is committed, then ZLP
+void fpga_stream_end()
+{
+	if (usb_pkt_len)
+		usb_pkt_commit();
+	usb_pkt_commit();
+}
+
+int main(int argc, char **argv)
+{
+	int num_pkts = argc > 1 ? atoi(argv[1]) : 3000;
+	num_of_fpgas = argc > 2 ? atoi(argv[2]) : DEVICE_FPGAS_MAX;
+	if (num_pkts <= 0 || num_of_fpgas <= 0 || num_of_fpgas > DEVICE_FPGAS_MAX) {
+		printf("Usage: %s [packets_per_fpga [fpgas]]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	struct device_list *device_list = device_loopback_list_new(1,
+			num_of_fpgas, &pkt_comm_params_test);
+	struct device *device = device_list->device;
+	async = device_async_new(device);
+	if (!async) {
+		printf("device_async_new() failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	int num;
+	for (num = 0; num < num_of_fpgas; num++) {
+		pkt_comm_set_queue_limits(device->fpga[num].comm, INPUT_QUEUE_MAX, 0);
+		sender[num] = pkt_comm_new(&pkt_comm_params_test);
+		if (!sender[num]) {
+			printf("pkt_comm_new() failed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	srandom(1);
+	int sent[DEVICE_FPGAS_MAX] = { 0 };
+	int streaming = -1;
+
+	for ( ; ; ) {
+		// Application places packets into FPGA's output
+		int done = 1;
+		for (num = 0; num < num_of_fpgas; num++) {
+			while (sent[num] < num_pkts
+					&& !pkt_queue_full(sender[num]->output_queue, 1)) {
+				int len = pkt_len(num, sent[num]);
+				char *data = malloc(len);
+				int i;
+				for (i = 0; i < len; i++)
+					data[i] = sent[num] + i + num;
+				struct pkt *pkt = pkt_new(1, data, len);
+				pkt->id = sent[num]++;
+				pkt_queue_push(sender[num]->output_queue, pkt);
+			}
+			if (sent[num] < num_pkts || pkt_comm_has_output_data(sender[num]))
+				done = 0;
+		}
+		if (done)
+			break;
+
+		// Switch to other FPGA. Reply comes before or after the data
+		int next = random() % num_of_fpgas;
+		if (next != streaming) {
+			if (streaming >= 0)
+				fpga_stream_end();
+			if (random() % 2)
+				device_stream_owner_push(async, next);
+			else
+				pending_owner = next;
+			streaming = next;
+		}
+		fpga_output(streaming, (random() % SEGMENT_MAX) & ~1);
+
+		if (pending_owner >= 0) {
+			device_stream_owner_push(async, pending_owner);
+			pending_owner = -1;
+		}
+	}
+
+	// Stream mode is disabled: the output is ended.
+	// Input that waited for space in input queue is processed
+	// (r/w pass does that)
+	fpga_stream_end();
+	int i;
+	for (i = 0; i < 16; i++)
+		for (num = 0; num < num_of_fpgas; num++) {
+			pkt_comm_input_get_buf(device->fpga[num].comm);
+			fetch_input(num);
+		}
+
+	int ok = !bad_pkts && !async->stream_owner_count;
+	for (num = 0; num < num_of_fpgas; num++) {
+		printf("FPGA #%d: %d of %d packets\n", num, expected_id[num], num_pkts);
+		if (expected_id[num] != num_pkts)
+			ok = 0;
+	}
+	printf("transfers: %llu (%llu with ZLP), waits: %llu, bad packets: %llu\n",
+			transfers, zlps, waits, bad_pkts);
+
+	if (!ok) {
+		printf("FAILED\n");
+		exit(EXIT_FAILURE);
+	}
+	return 0;
+}
@@ -211,7 +211,7 @@ int device_fpgas_rw(struct device *device)
 struct device_bitstream bitstream_test = {
 	0x0001,					// type ID, hardcoded at vcr.v/BITSTREAM_TYPE
 	"../fpga/inouttraffic.bit",
-	{ 2, 16384, 32766 }		// struct pkt_comm_params
+	{ 2, 32768, 32766 }		// struct pkt_comm_params
 };
 
 int main(int argc, char **argv)
@@ -121,6 +121,20 @@ int ztex_timely_scan(struct ztex_dev_list *new_dev_list, struct ztex_dev_list *d
 }
 
 
+int ztex_scan_next_usec(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	long long elapsed = (tv.tv_sec - ztex_scan_prev_time.tv_sec) * 1000000LL
+			+ tv.tv_usec - ztex_scan_prev_time.tv_usec;
+	long long interval = (ztex_scan_fw_upload_count
+			? ZTEX_FW_UPLOAD_DELAY : ztex_scan_interval) * 1000000LL;
+	if (elapsed >= interval)
+		return 0;
+	return interval - elapsed;
+}
+
+
 ///////////////////////////////////////////////////////////////////
 //
 // ztex_init_scan()
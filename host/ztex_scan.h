@@ -24,6 +24,10 @@ int ztex_scan(struct ztex_dev_list *new_dev_list, struct ztex_dev_list *dev_list
 // Immediately returns number of ready devices (excluding those that were reset).
 int ztex_timely_scan(struct ztex_dev_list *new_dev_list, struct ztex_dev_list *dev_list);
 
+// Returns microseconds until ztex_timely_scan() performs actual scan
+// (0 if it's already time to scan).
+int ztex_scan_next_usec(void);
+
 // Function to be invoked at program initialization.
 // If no devices immediately ready and it was firmware upload - waits and rescans.
 // Returns number of ready devices with uploaded firmware.
@@ -25,6 +25,11 @@ EP_CONFIG(2,0,BULK,IN,512,4);
 // configure endpoint 6, out, quad buffered, 512 bytes, interface 0
 EP_CONFIG(6,0,BULK,OUT,512,4);
 
+// configure endpoint 1, in, interrupt, 64 bytes, interface 0
+// (notification of FPGA state, VC 0x91); polled every microframe
+EP_CONFIG(1IN,0,INT,IN,64,1);
+EP_POLL(1IN,1);
+
 // select ZTEX USB FPGA Module 1.15 as target  (required for FPGA configuration)
 IDENTITY_UFM_1_15Y(10.15.0.0,0);
 
@@ -146,17 +151,22 @@ ADD_EP0_VENDOR_REQUEST((0x85,,
 	ep0_commit();
 ,,
 ));;
+// r/w is enabled on the selected FPGA
+__xdata BYTE hs_io_enabled = 1;
+
 // fpga_reset();
 ADD_EP0_VENDOR_COMMAND((0x8B,,
 	fpga_set_addr(0x81); // 1. disable r/w
 	fpga_set_addr(0x8B); // 2. reset FPGA with Global Set Reset (GSR)
 	fifo_reset(); // 3. reset ez-usb fifo, invalidate data
 	fpga_set_addr(0x80); // 4. enable r/w
+	hs_io_enabled = 1;
 ,,
 ));;
 // fpga_hs_io_enable/disable()
 ADD_EP0_VENDOR_COMMAND((0x80,,
 	fpga_set_addr(SETUPDAT[2] ? 0x80 : 0x81);
+	hs_io_enabled = SETUPDAT[2] ? 1 : 0;
 ,,
 ));;
 // fpga_output_limit_enable/disable()
@@ -177,7 +187,8 @@ void fpga_test_get_id()
 	ep0_read_data (0,4);
 	fpga_set_addr(0x8A);// vcr_io/VCR_GET_FPGA_ID
 	ep0_read_data (4,1);
-	EP0BUF[5] = 0;
+	fpga_set_addr(0x98);// VCR_GET_CAPS, 0 from older bitstreams
+	ep0_read_data (5,1);
 	fpga_set_addr(0x90); //VCR_GET_ID_DATA
 	ep0_read_data (6,2);
 }
@@ -192,8 +203,8 @@ ADD_EP0_VENDOR_REQUEST((0x88,,
 __xdata BYTE select_num;
 void select_fpga ( BYTE fn );
 
-// fpga_select(): waits for i/o timeout before select_fpga()
-void fpga_select(BYTE fpga_num) {
+// waits for i/o timeout on the selected FPGA
+void fpga_wait_io_timeout() {
 	BYTE timeout;
 	BYTE counter = 0;
 
@@ -208,11 +219,17 @@ void fpga_select(BYTE fpga_num) {
 			break;
 		NOP;
 	}
+}
+
+// fpga_select(): waits for i/o timeout before select_fpga()
+void fpga_select(BYTE fpga_num) {
+	fpga_wait_io_timeout();
 	if (select_num == fpga_num)
 		return;
 	fpga_set_addr(0x81); // 1. disable r/w
 	select_fpga(fpga_num);
 	fpga_set_addr(0x80); // enable r/w
+	hs_io_enabled = 1;
 }
 
 ADD_EP0_VENDOR_COMMAND((0x8E,,
@@ -228,10 +245,331 @@ ADD_EP0_VENDOR_REQUEST((0x8C,,
 	ep0_read_data (0,6);
 	fpga_set_addr(0x85);// output limit
 	ep0_read_data (6,2);
+	fpga_set_addr(0x92);// input FIFO free space
+	ep0_read_data (8,2);
+	ep0_commit();
+,,
+));;
+
+// device_select_setup_io(): VR 0x8C on several FPGAs
+// SETUPDAT[2] : number of FPGAs (FPGAs 0..n-1), the last one remains selected
+// SETUPDAT[4] : bitmask of FPGAs where output limit is registered,
+//	read limit is 0 for other FPGAs
+// Reply: 10 bytes per FPGA, same as VR 0x8C
+// Only the selected FPGA can have I/O in progress: i/o timeout is waited
+// for once, then FPGAs are selected with high-speed interface disabled.
+void fpga_select_setup_io_all() {
+	BYTE i;
+	BYTE offset = 0;
+	if (!SETUPDAT[2])
+		return;
+	fpga_wait_io_timeout();
+	fpga_set_addr(0x81); // disable r/w
+	for (i = 0; i < SETUPDAT[2] && offset + 10 <= 64; i++) {
+		if (i != select_num)
+			select_fpga(i);
+		fpga_set_addr(0x84);// vcr_io/VCR_GET_IO_STATUS
+		ep0_read_data (offset,6);
+		if (SETUPDAT[4] & (1 << i)) {
+			fpga_set_addr(0x85);// output limit
+			ep0_read_data (offset+6,2);
+		} else {
+			EP0BUF[offset+6] = 0;
+			EP0BUF[offset+7] = 0;
+		}
+		fpga_set_addr(0x92);// input FIFO free space
+		ep0_read_data (offset+8,2);
+		offset += 10;
+	}
+	fpga_set_addr(0x80); // the last one: enable r/w
+	hs_io_enabled = 1;
+}
+ADD_EP0_VENDOR_REQUEST((0x8D,,
+	fpga_select_setup_io_all();
 	ep0_commit();
 ,,
 ));;
 
+// device_pkt_broadcast(): broadcast write
+// SETUPDAT[2] : bitmask of FPGAs. The highest one gets selected,
+//	others are put into listen mode (VCR 0x93): they receive
+//	the data the selected FPGA reads from EP6.
+//	0: ends broadcast, the selected FPGA remains selected.
+// Listen mode is disabled (VCR 0x94) after I/O timeout on the selected FPGA
+__xdata BYTE listen_mask = 0;
+void fpga_broadcast(BYTE mask) {
+	BYTE i;
+	BYTE selected = select_num;
+
+	for (i = 0; i < 8; i++) {
+		if (listen_mask & (1 << i)) {
+			fpga_select(i);
+			fpga_set_addr(0x94);
+		}
+	}
+	listen_mask = 0;
+	if (!mask) {
+		fpga_select(selected);
+		return;
+	}
+
+	for (i = 0; i < 8; i++)
+		if (mask & (1 << i))
+			selected = i;
+	for (i = 0; i < selected; i++) {
+		if (mask & (1 << i)) {
+			fpga_select(i);
+			fpga_set_addr(0x93);
+			listen_mask |= 1 << i;
+		}
+	}
+	fpga_select(selected);
+}
+ADD_EP0_VENDOR_COMMAND((0x8F,,
+	fpga_broadcast(SETUPDAT[2]);
+,,
+));;
+
+// device_mux_enable(): autonomous multiplexing of FPGAs
+// SETUPDAT[2] : number of FPGAs (FPGAs 0..n-1), 0 disables.
+//	FPGAs are put into mux mode (VCR 0x95): every FPGA receives
+//	EP6 data and keeps frames tagged with its number, its output
+//	goes in tagged frames. The main loop selects FPGAs in turn and
+//	registers output limit, the host only streams bulk data.
+//	Disabling leaves the last FPGA selected.
+__xdata BYTE mux_num = 0;
+void fpga_mux(BYTE num) {
+	BYTE i;
+	BYTE n = num ? num : mux_num;
+
+	mux_num = 0;
+	for (i = 0; i < n; i++) {
+		fpga_select(i);
+		fpga_set_addr(num ? 0x95 : 0x96);
+	}
+	mux_num = num;
+}
+ADD_EP0_VENDOR_COMMAND((0x90,,
+	fpga_mux(SETUPDAT[2]);
+,,
+));;
+
+// Mux mode: next FPGA outputs a frame.
+// Called from the main loop with interrupts disabled
+// (vendor requests also access FPGAs). While the selected FPGA
+// has I/O in progress it returns at once, so interrupts are served
+// meanwhile; fpga_select() doesn't wait then.
+void fpga_mux_next() {
+	BYTE timeout;
+	BYTE next = select_num + 1;
+	if (next >= mux_num)
+		next = 0;
+
+	fpga_set_addr(0x91);// vcr_io/VCR_GET_IO_TIMEOUT
+	OEC = 0;
+	timeout = IOC;
+	IOA0 = 1;
+	IOA0 = 0;
+	if (!timeout)
+		return;
+	fpga_select(next);
+	fpga_set_addr(0x85);// output limit, the tag goes before the data
+	OEC = 0; // read 2 bytes (not used)
+	IOA0 = 1;
+	IOA0 = 0;
+	IOA0 = 1;
+	IOA0 = 0;
+}
+
+// device_notify_enable(): notification via EP1 IN (interrupt)
+// SETUPDAT[2..3] : output threshold, in 16-bit words. FPGA has output
+//	ready when the amount not registered yet (VCR 0x97) reaches it.
+//	0: no output notification.
+// SETUPDAT[4] : input threshold, in 256-word units. FPGA input is drained
+//	when free space in input FIFO (VCR 0x92) reaches it.
+//	0: no input notification.
+// SETUPDAT[5] : number of FPGAs (FPGAs 0..n-1), 0 disables.
+// Message (2 bytes): bitmask of FPGAs with output ready,
+//	bitmask of FPGAs with input drained. It's sent when some FPGA
+//	gets into one of these states; the state is reported again
+//	after FPGA leaves it.
+__xdata WORD notify_output = 0;
+__xdata BYTE notify_input = 0;
+__xdata BYTE notify_num = 0;
+__xdata BYTE notify_sent[2] = { 0, 0 };
+ADD_EP0_VENDOR_COMMAND((0x91,,
+	notify_num = 0;
+	notify_output = SETUPDAT[2] | (SETUPDAT[3] << 8);
+	notify_input = SETUPDAT[4];
+	notify_sent[0] = 0;
+	notify_sent[1] = 0;
+	notify_num = SETUPDAT[5];
+,,
+));;
+
+// reads 2-byte VCR value (little-endian)
+WORD fpga_read_word(BYTE addr) {
+	WORD w;
+	fpga_set_addr(addr);
+	OEC = 0;
+	w = IOC;
+	IOA0 = 1;
+	IOA0 = 0;
+	w |= IOC << 8;
+	IOA0 = 1;
+	IOA0 = 0;
+	return w;
+}
+
+// checks the selected FPGA for notification events
+void fpga_notify_check(BYTE *events) {
+	if (notify_output && fpga_read_word(0x97) >= notify_output)
+		events[0] |= 1 << select_num;
+	if (notify_input && (fpga_read_word(0x92) >> 8) >= notify_input)
+		events[1] |= 1 << select_num;
+}
+
+// Notification: checks FPGAs when the selected one has no I/O
+// in progress, at most once per USB frame (1 ms).
+// The selected FPGA is checked without switching. Like in fpga_select(),
+// r/w on the selected FPGA is disabled before other FPGAs are selected;
+// after it's selected back, r/w is restored to the previous state:
+// a transfer the host starts meanwhile waits in Slave FIFO.
+// Other FPGAs have high-speed interface disabled.
+// Called from the main loop with interrupts disabled.
+__xdata BYTE notify_frame = 0;
+void fpga_notify_poll() {
+	BYTE i, timeout;
+	BYTE selected = select_num;
+	BYTE events[2] = { 0, 0 };
+
+	if (USBFRAMEL == notify_frame)
+		return;
+	if (EP1INCS & bmBIT1) // previous message wasn't taken yet
+		return;
+	if (listen_mask) // broadcast write in progress
+		return;
+	fpga_set_addr(0x91);// vcr_io/VCR_GET_IO_TIMEOUT
+	OEC = 0;
+	timeout = IOC;
+	IOA0 = 1;
+	IOA0 = 0;
+	if (!timeout)
+		return;
+	notify_frame = USBFRAMEL;
+
+	if (selected < notify_num)
+		fpga_notify_check(events);
+	if (notify_num > 1 || selected >= notify_num) {
+		fpga_set_addr(0x81); // disable r/w
+		for (i = 0; i < notify_num; i++) {
+			if (i == selected)
+				continue;
+			select_fpga(i);
+			fpga_notify_check(events);
+		}
+		select_fpga(selected);
+		if (hs_io_enabled)
+			fpga_set_addr(0x80); // enable r/w
+	}
+
+	notify_sent[0] &= events[0];
+	notify_sent[1] &= events[1];
+	if (events[0] == notify_sent[0] && events[1] == notify_sent[1])
+		return;
+	EP1INBUF[0] = events[0];
+	EP1INBUF[1] = events[1];
+	EP1INBC = 2;
+	notify_sent[0] = events[0];
+	notify_sent[1] = events[1];
+}
+
+// device_stream_enable(): stream mode
+// SETUPDAT[2] : number of FPGAs (FPGAs 0..n-1), 0 disables.
+//	FPGAs are switched with VR 0x93. FPGA selected that way has output
+//	limit off: its output goes into EP2 as it comes, the host keeps
+//	IN transfers posted. Output of the FPGA is ended with zero-length
+//	packet before the switch. End the output (VR 0x93, 0xFF)
+//	before stream mode is disabled. No notification in stream mode.
+__xdata BYTE stream_num = 0;
+__xdata BYTE stream_fpga = 0xFF; // FPGA with output limit off
+ADD_EP0_VENDOR_COMMAND((0x92,,
+	stream_num = SETUPDAT[2];
+	stream_fpga = 0xFF;
+,,
+));;
+
+// Stream mode: ends the output of the streaming FPGA.
+// Output limit is turned on (data that's already in output FIFO
+// still goes out), FPGA sends the rest followed by zero-length packet.
+// Returns 0 if ZLP isn't sent in time (EP2 buffers are full,
+// the host has to read and repeat the request).
+BYTE fpga_stream_end() {
+	BYTE sent;
+	WORD counter = 0;
+
+	if (stream_fpga == 0xFF)
+		return 1;
+	fpga_set_addr(0x86); // output limit on
+	fpga_set_addr(0x99); // vcr_io/VCR_SET_STREAM_END
+	for (;;) {
+		fpga_set_addr(0x9A); // vcr_io/VCR_GET_STREAM_STATUS
+		OEC = 0;
+		sent = IOC;
+		IOA0 = 1;
+		IOA0 = 0;
+		if (sent & 1)
+			break;
+		if (++counter == 4096)
+			return 0;
+	}
+	stream_fpga = 0xFF;
+	return 1;
+}
+
+// Stream mode: selects FPGA, turns output limit off.
+// 0xFF: ends the output, the FPGA remains selected.
+// Returns 0 if the output of the streaming FPGA isn't ended yet.
+BYTE fpga_stream_switch(BYTE fpga_num) {
+	if (fpga_num == stream_fpga)
+		return 1;
+	if (!fpga_stream_end())
+		return 0;
+	if (fpga_num == 0xFF)
+		return 1;
+
+	fpga_wait_io_timeout(); // input in EP6 is read by the FPGA
+	if (select_num != fpga_num) {
+		fpga_set_addr(0x81); // disable r/w
+		select_fpga(fpga_num);
+	}
+	fpga_set_addr(0x80); // enable r/w, clears stream end
+	hs_io_enabled = 1;
+	fpga_set_addr(0x87); // output limit off
+	stream_fpga = fpga_num;
+	return 1;
+}
+
+// device_stream_switch()
+// SETUPDAT[2] : fpga_num, 0xFF: end the output
+// Reply: 10 bytes, same as VR 0x8C (read limit is 0), for the selected
+//	FPGA. 0 bytes if the output of the streaming FPGA isn't ended yet.
+ADD_EP0_VENDOR_REQUEST((0x93,,
+	if (fpga_stream_switch(SETUPDAT[2])) {
+		fpga_set_addr(0x84);// vcr_io/VCR_GET_IO_STATUS
+		ep0_read_data (0,6);
+		EP0BUF[6] = 0;
+		EP0BUF[7] = 0;
+		fpga_set_addr(0x92);// input FIFO free space
+		ep0_read_data (8,2);
+		ep0_commit();
+	} else {
+		EP0BCH = 0;
+		EP0BCL = 0;
+	}
+,,
+));;
+
 // include the main part of the firmware kit, define the descriptors, ...
 #include[ztex.h]
 
@@ -250,6 +588,18 @@ void main(void)
 	OEC = 0;
 
 	while (1) {
+		if (mux_num) {
+			EA = 0;
+			if (mux_num)
+				fpga_mux_next();
+			EA = 1;
+		}
+		else if (notify_num && !stream_num) {
+			EA = 0;
+			if (notify_num && !mux_num && !stream_num)
+				fpga_notify_poll();
+			EA = 1;
+		}
 	}
 }
 